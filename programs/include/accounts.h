@@ -1,62 +1,184 @@
 #ifndef __ACCOUNTS_H_
 #define __ACCOUNTS_H_
 
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "status_t.h"
 
+//First bytes of a compiled accounts file
+#define ACCOUNTS_MAGIC "FTPACCT1"
+#define ACCOUNTS_MAGIC_LEN 8
+
+//Fewest slots a table has; tables are kept at most half full
+#define ACCOUNT_MIN_SLOTS 16
+
+/**
+  * The start of an accounts image, which is what ftpaccounts-compile writes
+  * out and what the server maps straight into memory. The header is followed
+  * by the slots and then by every username and password, each ending in a
+  * '\0'. Numbers are stored in the byte order of the machine that compiled it.
+  * magic - ACCOUNTS_MAGIC, without its '\0'
+  * slot_count - the number of slots; a power of two
+  * count - the number of accounts
+  */
+typedef struct
+{
+	char magic[ACCOUNTS_MAGIC_LEN];
+	uint64_t slot_count;
+	uint64_t count;
+} accounts_header_t;
+
 /**
-  *	Structure used to represent a user account. Contains next field to be used
-  *	as a linked list.
-  * username - account username
+  * One slot of the open addressing (linear probing) hash table in an accounts
+  * image
+  * hash - the full hash of the username, so that most slots that don't match
+  *		can be skipped without comparing strings
+  * username - where the username starts in the image, or 0 for an empty slot
+  * password - where the password starts in the image
+  */
+typedef struct
+{
+	uint64_t hash;
+	uint64_t username;
+	uint64_t password;
+} account_slot_t;
+
+/**
+  *	Structure used to represent a user account found in a table
+  * username - account username, or NULL if there was no such account
   * password - account password
-  * next - the next element in the linked list
   */
-typedef struct account
+typedef struct
 {
 	char *username;
 	char *password;
-	struct account *next;
 } account_t;
 
-#define ACCOUNT_BUCKETS 512
 /**
-  * A hash table data structure for all of the accounts
-  * accounts - the hash table itself
+  * All of the accounts, as an accounts image held in memory. A compiled
+  * accounts file is mapped in as it is, so loading it costs nothing however
+  * many accounts it has; a text accounts file is compiled into memory first.
+  * The table is never changed once loaded, so any number of threads can search
+  * it at once.
+  * image - the accounts image
+  * length - the size of the image in bytes
+  * mapped - whether the image is mapped from a file, rather than allocated
+  * slots - the slots in the image
+  * mask - the number of slots minus one
+  * count - the number of accounts
   */
 typedef struct
 {
-	account_t *accounts[ACCOUNT_BUCKETS];
+	char *image;
+	size_t length;
+	uint8_t mapped;
+	account_slot_t *slots;
+	size_t mask;
+	size_t count;
 } accounts_table_t;
 
 /**
-  * Reads the accounts file at location filename and puts the
-  * user account information into the accounts table. The format of the accounts
-  * file is as follows:
+  * The accounts table in use, which can be swapped for a freshly loaded one
+  * while sessions are looking things up in it. Lookups announce themselves in
+  * the reader count for the current epoch and never wait. A reload publishes
+  * the new table with an atomic pointer swap, then moves the epoch on and
+  * waits for each reader count to drain before freeing the old table.
+  * table - the current table
+  * filename - where the accounts are loaded from
+  * epoch - moved on by reloads; its low bit picks the reader count that new
+  *		lookups use
+  * readers - the number of lookups in progress under each epoch parity
+  * reload_lock - keeps reloads from running at the same time
+  */
+typedef struct
+{
+	accounts_table_t *table;
+	char *filename;
+	size_t epoch;
+	size_t readers[2];
+	pthread_mutex_t reload_lock;
+} accounts_t;
+
+/**
+  * Reads a text accounts file and compiles it into an accounts image. The
+  * format of the accounts file is as follows:
   *		The first line is the number of accounts in the file
   *		After that, the first user's username sits on a line, followed by CRLF,
   *			and then that user's password sits on the next line, followed by
   *			CRLF
   *		The next user's username sits on the following line, and this repeats
   *			for all the users in the file
+  * If a username appears more than once, the last of its records wins.
   * @param filename - the accounts file to use
-  * @param accounts - out param; will hold all the account information upon
-  * 	completion
+  * @param image - out param; the image, to be freed with free
+  * @param length - out param; the size of the image in bytes
   */
-status_t get_accounts(char *filename, accounts_table_t *accounts);
+status_t compile_accounts(char *filename, char **image, size_t *length);
 
 /**
-  *	Finds the user with the given username in the accounts table and makes
-  *	*account point to it, making it point to NULL if there is no matching user.
+  * Loads the accounts file at location filename as a new table. A compiled
+  * file (one that starts with ACCOUNTS_MAGIC) is mapped read-only and used
+  * where it is; anything else is taken to be a text accounts file and is
+  * compiled first.
+  * @param filename - the accounts file to use
+  * @param accounts - out param; will point to the new table upon completion
+  */
+status_t get_accounts(char *filename, accounts_table_t **accounts);
+
+/**
+  *	Finds the user with the given username in the accounts table and fills in
+  *	*account with it, setting account->username to NULL if there is no matching
+  *	user. The strings are only good until the table is released with
+  *	accounts_read_end.
   * @param accounts - accounts table to search
   * @param username - username for which to search
-  * @param accoutn - out param; pointer to the pointer which will hold the
-  *		account reference
+  * @param account - out param; the account found
   */
-status_t get_account_by_username(accounts_table_t *accounts, char *username, account_t **account);
+status_t get_account_by_username(accounts_table_t *accounts, char *username, account_t *account);
 
 /**
-  * Frees all of the account data associated with the accounts table
+  * Frees (or unmaps) all of the account data associated with the accounts
+  * table, and the table itself
   * @param accounts - the table to be freed
   */
 status_t free_accounts(accounts_table_t *accounts);
 
+/**
+  * Loads the accounts file at filename as the first table of accounts
+  * @param accounts - the accounts to set up
+  * @param filename - the accounts file to use, which reloads read again
+  */
+status_t initialize_accounts(accounts_t *accounts, char *filename);
+
+/**
+  * Reads the accounts file again and swaps the new table in. Lookups carry on
+  * throughout; the old table is freed once none of them can be using it. If
+  * the file can't be loaded, the old table stays.
+  * @param accounts - the accounts to reload
+  */
+status_t reload_accounts(accounts_t *accounts);
+
+/**
+  * Starts a lookup, returning the current table, which stays valid until
+  * accounts_read_end. Never blocks.
+  * @param accounts - the accounts to look in
+  * @param epoch - out param; to be passed on to accounts_read_end
+  */
+accounts_table_t *accounts_read_begin(accounts_t *accounts, size_t *epoch);
+
+/**
+  * Ends a lookup started by accounts_read_begin
+  * @param accounts - the accounts that were looked in
+  * @param epoch - what accounts_read_begin gave back
+  */
+void accounts_read_end(accounts_t *accounts, size_t epoch);
+
+/**
+  * Frees the current table and everything else in accounts
+  * @param accounts - the accounts to free
+  */
+void uninitialize_accounts(accounts_t *accounts);
+
 #endif
@@ -0,0 +1,58 @@
+#ifndef __CONNECTION_QUEUE_H__
+#define __CONNECTION_QUEUE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "status_t.h"
+
+/**
+  * A fixed-size, thread-safe queue of accepted connections waiting for a worker
+  * to pick them up. Used as a ring buffer.
+  * sockets - the queued sockets
+  * capacity - the most sockets the queue can hold
+  * head - index of the socket at the front of the queue
+  * count - the number of sockets currently in the queue
+  * lock - protects every other field
+  * not_empty - signalled whenever a socket is added
+  */
+typedef struct
+{
+	int *sockets;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+} connection_queue_t;
+
+/**
+  * Sets up an empty queue able to hold capacity sockets
+  * @param queue - the queue to set up
+  * @param capacity - the most sockets the queue can hold at once
+  */
+status_t connection_queue_initialize(connection_queue_t *queue, size_t capacity);
+
+/**
+  * Adds the socket to the back of the queue without ever waiting, returning
+  * QUEUE_FULL_ERROR if there is no room for it
+  * @param queue - the queue to add to
+  * @param sock - the socket to add
+  */
+status_t connection_queue_try_push(connection_queue_t *queue, int sock);
+
+/**
+  * Takes the socket at the front of the queue, waiting for one to be added if
+  * the queue is empty
+  * @param queue - the queue to take from
+  * @param sock - out param; the socket taken off the queue
+  */
+status_t connection_queue_pop(connection_queue_t *queue, int *sock);
+
+/**
+  * Closes any sockets still in the queue and frees it
+  * @param queue - the queue to free
+  */
+void connection_queue_free(connection_queue_t *queue);
+
+#endif
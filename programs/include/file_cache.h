@@ -0,0 +1,189 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "status_t.h"
+
+#define FILE_CACHE_BUCKETS 1024
+
+struct file_entry;
+
+/**
+  * A name in a directory that a cached file was opened by
+  * dir_dev, dir_ino - the directory the name is in
+  * name - the name, a single path component
+  * watch - the inotify watch descriptor on the directory
+  * file - the file the name leads to
+  * name_next - the next name in the same name bucket
+  * watch_next - the next name in the same watch bucket
+  * sibling - the file's next name
+  */
+typedef struct file_name
+{
+	dev_t dir_dev;
+	ino_t dir_ino;
+	char *name;
+	int watch;
+	struct file_entry *file;
+	struct file_name *name_next;
+	struct file_name *watch_next;
+	struct file_name *sibling;
+} file_name_t;
+
+/**
+  * An open file held in the cache, along with its metadata
+  * fd - the file, open read-only. Every session uses it at once, so it must
+  *		only ever be read at explicit offsets (pread, sendfile with an offset)
+  * stat - the file's metadata, from when it was opened
+  * contents - the whole file, read into memory, or NULL if it hasn't been.
+  *		Never changes once set, and lives as long as the entry does
+  * watch - the inotify watch descriptor on the file
+  * refs - the number of sessions using the file right now
+  * cached - whether the entry is still in the cache; once it isn't, the last
+  *		session to release it closes the file
+  * names - the names the file has been opened by
+  * inode_next - the next entry in the same inode bucket
+  * watch_next - the next entry in the same watch bucket
+  * lru_prev, lru_next - neighbours in the least recently used order; the head
+  *		of the list is the most recently used
+  */
+typedef struct file_entry
+{
+	int fd;
+	struct stat stat;
+	char *contents;
+	int watch;
+	size_t refs;
+	uint8_t cached;
+	file_name_t *names;
+	struct file_entry *inode_next;
+	struct file_entry *watch_next;
+	struct file_entry *lru_prev;
+	struct file_entry *lru_next;
+} file_entry_t;
+
+/**
+  * Server-wide cache of open files and their metadata, keyed by device and
+  * inode, so that sessions downloading the same popular file share one open
+  * descriptor and never open or stat it themselves. Files are found by the
+  * directory (again by device and inode) and name they were opened by. Each
+  * file and each of its directories is watched with inotify, and a watcher
+  * thread throws a file out as soon as it is written to, has its attributes
+  * changed, or has its name removed or replaced. The least recently used
+  * files are thrown out to keep the number of open descriptors within the
+  * budget. The contents of small files can be kept in memory too, within a
+  * budget of their own, so that they are sent without reading the file at all.
+  * name_buckets - hash table from directories and names to names
+  * inode_buckets - hash table from devices and inodes to entries
+  * name_watch_buckets - hash table from directory watch descriptors to names
+  * file_watch_buckets - hash table from file watch descriptors to entries
+  * lru_head, lru_tail - the ends of the least recently used order
+  * count - the number of entries in the cache
+  * budget - the most entries, and so open descriptors, the cache may hold
+  * content_bytes - the total size of the contents held in memory
+  * content_budget - the most bytes of contents to hold in memory
+  * content_file_size - the largest file whose contents may be held in memory
+  * generation - bumped whenever a watch goes away or fires, so that a file
+  *		opened while that happened doesn't get cached
+  * inotify_fd - the inotify instance watching the cached files
+  * watcher - the thread reading inotify_fd
+  * lock - protects every other field, and the fields of every entry and name
+  */
+typedef struct
+{
+	file_name_t *name_buckets[FILE_CACHE_BUCKETS];
+	file_entry_t *inode_buckets[FILE_CACHE_BUCKETS];
+	file_name_t *name_watch_buckets[FILE_CACHE_BUCKETS];
+	file_entry_t *file_watch_buckets[FILE_CACHE_BUCKETS];
+	file_entry_t *lru_head;
+	file_entry_t *lru_tail;
+	size_t count;
+	size_t budget;
+	size_t content_bytes;
+	size_t content_budget;
+	size_t content_file_size;
+	uint64_t generation;
+	int inotify_fd;
+	pthread_t watcher;
+	pthread_mutex_t lock;
+} file_cache_t;
+
+/**
+  * Sets up an empty cache holding at most budget open files, and starts its
+  * watcher thread
+  * @param cache - the cache to set up
+  * @param budget - the most files to keep open
+  * @param content_budget - the most bytes of file contents to keep in memory,
+  *		or 0 to never keep any
+  * @param content_file_size - the largest file to keep the contents of
+  */
+status_t file_cache_initialize(file_cache_t *cache, size_t budget, size_t content_budget,
+	size_t content_file_size);
+
+/**
+  * Finds the file a name in a directory leads to, if it is cached, and takes a
+  * reference on it, which must be given back with file_cache_release
+  * @param cache - the cache to look in; may be NULL
+  * @param dir_dev, dir_ino - the directory the name is in
+  * @param name - the name, a single path component
+  * @return the entry, or NULL if the file isn't cached
+  */
+file_entry_t *file_cache_acquire(file_cache_t *cache, dev_t dir_dev, ino_t dir_ino, char *name);
+
+/**
+  * Gets the cache's current generation, to be passed to file_cache_insert.
+  * Must be called before the file is opened.
+  * @param cache - the cache
+  */
+uint64_t file_cache_generation(file_cache_t *cache);
+
+/**
+  * Offers a file that has just been opened by name to the cache. If it gets
+  * cached (or the same file already was), the cache takes the descriptor over
+  * and a reference on the entry is returned, which must be given back with
+  * file_cache_release. Otherwise the descriptor is left to the caller. Only
+  * regular files whose name isn't a symlink are cached.
+  * @param cache - the cache to add to; may be NULL
+  * @param dir_fd - the directory the name is in
+  * @param dir_dev, dir_ino - the directory's device and inode
+  * @param name - the name the file was opened by, a single path component
+  * @param fd - the file, open read-only
+  * @param generation - what file_cache_generation gave before fd was opened
+  * @return the entry, or NULL if the file wasn't cached
+  */
+file_entry_t *file_cache_insert(file_cache_t *cache, int dir_fd, dev_t dir_dev, ino_t dir_ino,
+	char *name, int fd, uint64_t generation);
+
+/**
+  * Gets the contents of a cached file from memory, reading them in first if
+  * they aren't there yet and the file is small enough. The contents are only
+  * kept if the file's size and modification time are the same after reading
+  * as when it was opened. Files whose contents are in memory count against
+  * the content budget, and the least recently used of them are thrown out of
+  * the cache to stay within it.
+  * @param cache - the cache the entry came from
+  * @param entry - the entry, which the caller holds a reference on
+  * @return the contents, entry->stat.st_size bytes long and valid for as long
+  *		as the reference is held, or NULL if they aren't in memory
+  */
+char *file_cache_contents(file_cache_t *cache, file_entry_t *entry);
+
+/**
+  * Gives back a reference taken by file_cache_acquire or file_cache_insert
+  * @param cache - the cache the entry came from
+  * @param entry - the entry
+  */
+void file_cache_release(file_cache_t *cache, file_entry_t *entry);
+
+/**
+  * Stops the watcher thread and frees the cache along with every entry in it.
+  * No session may still hold a reference.
+  * @param cache - the cache to free
+  */
+void file_cache_free(file_cache_t *cache);
+
+#endif
@@ -46,13 +46,102 @@
 #define ACTION_ABORTED "551"
 #define FILE_ACTION_ABORTED "552"
 #define FILE_NAME_NOT_ALLOWED "553"
+#define INVALID_REST_PARAMETER "554"
 
 #define PORT_DIVISOR 256
 
+#define LINE_READER_BUFFER_SIZE 4096
+
+//Every command verb is three or four letters long
+#define MAX_VERB_LEN 4
+
+/**
+  * Per-connection input buffer for the control channel. Data is read from the
+  * socket in bulk and lines are cut out of the buffer, with any bytes left over
+  * after a line kept around for the next call, so that several commands
+  * arriving in one packet are handled one after another.
+  * socket - the socket from which to read
+  * read_flags - flags passed to recv; MSG_DONTWAIT makes reads return
+  *		SOCKET_WOULD_BLOCK instead of waiting for data
+  * buffer - the bytes read from the socket
+  * start - index of the first byte in buffer not yet handed out
+  * end - index one past the last valid byte in buffer
+  */
+typedef struct
+{
+	int socket;
+	int read_flags;
+	char buffer[LINE_READER_BUFFER_SIZE];
+	size_t start;
+	size_t end;
+} line_reader_t;
+
+/**
+  * A piece of a line, pointing into the line itself rather than copying it out
+  * start - the first character of the piece
+  * length - the number of characters in the piece
+  */
+typedef struct
+{
+	char *start;
+	size_t length;
+} slice_t;
+
+/**
+  * A command line split up into its verb and its argument
+  * verb - the command name, e.g., "RETR"
+  * argument - everything after the verb and the spaces following it. Since it
+  *		runs to the end of the line, it is also '\0' terminated
+  * key - the verb packed by pack_verb, or 0 if the verb can't be a command
+  */
+typedef struct
+{
+	slice_t verb;
+	slice_t argument;
+	uint32_t key;
+} command_line_t;
+
 status_t send_string(int sock, string_t *s, log_t *log);
 
 status_t read_line_strip_endings(int socket, string_t *line);
 
+/**
+  * sets up reader to read from socket, with an empty buffer
+  * @param reader - the reader to initialize
+  * @param socket - the socket from which the reader will read
+  */
+void line_reader_initialize(line_reader_t *reader, int socket);
+
+/**
+  * reads a line ending in '\r\n' from the reader's socket, refilling the
+  * reader's buffer as needed. The '\r\n' is kept at the end of the line. If
+  * the reader doesn't wait for data and the line isn't complete yet,
+  * SOCKET_WOULD_BLOCK is returned and what there is of the line is left in
+  * line, so the next call picks up where this one left off.
+  * @param reader - the reader from which to read
+  * @param line   - out param; the string onto which to append the line. Must be
+  *		initialized
+  */
+status_t read_buffered_line(line_reader_t *reader, string_t *line);
+
+/**
+  * splits a command line up into its verb and argument without copying
+  * anything; the pieces point into line. The line ending and any trailing
+  * spaces are removed from line first.
+  * @param line - the line to split up; must not change while command is used
+  * @param command - out param; the verb and argument of the line
+  */
+void parse_command(string_t *line, command_line_t *command);
+
+/**
+  * packs a verb of up to MAX_VERB_LEN letters into a single integer, ignoring
+  * case, so that commands can be looked up in one step
+  * @param verb - the verb to pack
+  * @param length - the length of verb
+  * @return the packed verb, or 0 if verb is too long or isn't all letters
+  */
+uint32_t pack_verb(char *verb, size_t length);
+
 /**
   * reads from socket socket until a '\r\n' sequence is reached
   * @param socket - socket from which to read
@@ -77,6 +166,24 @@ status_t parse_ip_and_port(string_t *split, size_t len, string_t *host, uint16_t
   */
 status_t make_connection(int *sock, char *host_str, uint16_t port);
 
+/**
+  * starts making a connection to the given numeric IPv4 host on the given port
+  * without waiting for it to finish. The socket is non-blocking; once it
+  * becomes writable, finish_connection tells whether the connection worked.
+  * @param sock - out param; the socket over which the connection will be made,
+  *		or -1 if it couldn't be started
+  * @param host - the dotted IPv4 address to which to connect
+  * @param port - the port number to which to connect (still in host order)
+  */
+status_t start_connection(int *sock, char *host_str, uint16_t port);
+
+/**
+  * checks whether a connection begun with start_connection succeeded. Should
+  * only be called once the socket is writable.
+  * @param sock - the socket given back by start_connection
+  */
+status_t finish_connection(int sock);
+
 /**
   * gets the IPv4 and IPv6 IP addresses, if available, by walking the ifaddrs
   * list and sets them appropriately in session
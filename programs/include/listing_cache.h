@@ -0,0 +1,140 @@
+#ifndef __LISTING_CACHE_H__
+#define __LISTING_CACHE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "status_t.h"
+#include "string_t.h"
+
+#define LISTING_CACHE_BUCKETS 1024
+//No one listing may take up more than this fraction of the cache
+#define LISTING_CACHE_MAX_SHARE 16
+
+/**
+  * A rendered directory listing held in the cache
+  * path - the resolved path of the directory
+  * listing - the listing, exactly as LIST sends it
+  * length - the length of listing
+  * watch - the inotify watch descriptor on the directory
+  * path_next - the next entry in the same path bucket
+  * watch_next - the next entry in the same watch bucket
+  * lru_prev, lru_next - neighbours in the least recently used order; the head
+  *		of the list is the most recently used
+  */
+typedef struct listing_entry
+{
+	char *path;
+	char *listing;
+	size_t length;
+	int watch;
+	struct listing_entry *path_next;
+	struct listing_entry *watch_next;
+	struct listing_entry *lru_prev;
+	struct listing_entry *lru_next;
+} listing_entry_t;
+
+/**
+  * A listing being collected for the cache while the directory is read
+  * path - the resolved path of the directory, or NULL if nothing is being
+  *		collected
+  * listing - what has been collected so far
+  * generation - the cache's generation when the directory started to be read
+  * watch - the inotify watch on the directory, or -1
+  * abandoned - set once the listing can no longer be cached
+  */
+typedef struct
+{
+	char *path;
+	string_t listing;
+	uint64_t generation;
+	int watch;
+	uint8_t abandoned;
+} listing_fill_t;
+
+/**
+  * Server-wide cache of rendered directory listings, keyed by resolved path.
+  * Every cached directory is watched with inotify, and a watcher thread throws
+  * a directory's listing away as soon as anything in it is created, deleted or
+  * renamed. The least recently used listings are thrown away to keep the cache
+  * under its memory cap.
+  * path_buckets - hash table from paths to entries
+  * watch_buckets - hash table from watch descriptors to entries
+  * lru_head, lru_tail - the ends of the least recently used order
+  * size - the bytes used by the entries in the cache
+  * capacity - the most bytes the entries may use
+  * generation - bumped whenever a watch goes away or fires, so that a listing
+  *		rendered while that happened doesn't get cached
+  * inotify_fd - the inotify instance watching the cached directories
+  * watcher - the thread reading inotify_fd
+  * lock - protects every other field
+  */
+typedef struct
+{
+	listing_entry_t *path_buckets[LISTING_CACHE_BUCKETS];
+	listing_entry_t *watch_buckets[LISTING_CACHE_BUCKETS];
+	listing_entry_t *lru_head;
+	listing_entry_t *lru_tail;
+	size_t size;
+	size_t capacity;
+	uint64_t generation;
+	int inotify_fd;
+	pthread_t watcher;
+	pthread_mutex_t lock;
+} listing_cache_t;
+
+/**
+  * Sets up an empty cache holding at most capacity bytes of listings, and
+  * starts its watcher thread
+  * @param cache - the cache to set up
+  * @param capacity - the memory cap, in bytes
+  */
+status_t listing_cache_initialize(listing_cache_t *cache, size_t capacity);
+
+/**
+  * Appends the cached listing of the directory at path to listing, if there is
+  * one
+  * @param cache - the cache to look in; may be NULL
+  * @param path - the resolved path of the directory
+  * @param listing - out param; the string onto which to append the listing
+  * @return whether the listing was in the cache
+  */
+uint8_t listing_cache_lookup(listing_cache_t *cache, char *path, string_t *listing);
+
+/**
+  * Starts collecting a listing of the directory at path as it gets read, so
+  * that it can be cached once it is complete. Must be called before the
+  * directory is read, and must always be followed by listing_fill_finish.
+  * @param cache - the cache the listing is for; if NULL, nothing is collected
+  * @param fill - the fill to start
+  * @param path - the resolved path of the directory
+  */
+void listing_fill_begin(listing_cache_t *cache, listing_fill_t *fill, char *path);
+
+/**
+  * Adds the next piece of a listing to a fill. A listing that grows past its
+  * share of the cache is dropped rather than kept whole in memory.
+  * @param cache - the cache given to listing_fill_begin
+  * @param fill - the fill to add to
+  * @param data - the next piece of the listing
+  * @param length - the length of data
+  */
+void listing_fill_append(listing_cache_t *cache, listing_fill_t *fill, char *data, size_t length);
+
+/**
+  * Ends a fill, caching the collected listing if it is complete, still current
+  * and within its share of the cache
+  * @param cache - the cache given to listing_fill_begin
+  * @param fill - the fill to end
+  * @param complete - whether the whole directory was read into the fill
+  */
+void listing_fill_finish(listing_cache_t *cache, listing_fill_t *fill, uint8_t complete);
+
+/**
+  * Stops the watcher thread and frees the cache along with every entry in it
+  * @param cache - the cache to free
+  */
+void listing_cache_free(listing_cache_t *cache);
+
+#endif
@@ -2,6 +2,8 @@
 #define __LOG_H__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #include "status_t.h"
 #include "string_t.h"
@@ -9,26 +11,171 @@
 #define MAX_LOG_FILES 1000
 #define LOG_FILE_EXT_LEN 3
 
+#define LOG_RING_SLOTS 4096
+#define LOG_RECORD_SIZE 512
+
+/**
+  * What a thread logging into a full ring buffer does
+  * LOG_FULL_BLOCK - waits for the flusher to make room
+  * LOG_FULL_DROP - throws the message away and counts it; the count is written
+  *		to the log once there is room again
+  */
+typedef enum
+{
+	LOG_FULL_BLOCK = 0,
+	LOG_FULL_DROP,
+} log_full_policy_t;
+
+//Most pieces write_log_event_parts takes a message in
+#define LOG_MAX_MESSAGE_PARTS 8
+
+#define LOG_BINARY_MAGIC "FTPLOG1"
+#define LOG_BINARY_MAGIC_LEN 8
+
+/**
+  * How lines are laid out in the log file
+  * LOG_FORMAT_TEXT - a ctime timestamp followed by the message, one per line
+  * LOG_FORMAT_BINARY - a log_binary_header_t followed by the raw message bytes;
+  *		much cheaper to write, and turned back into text by ftplogdump
+  */
+typedef enum
+{
+	LOG_FORMAT_TEXT = 0,
+	LOG_FORMAT_BINARY,
+} log_format_t;
+
+/**
+  * What a log entry records, which also decides how it reads as text
+  * LOG_EVENT_OPEN - the first entry of a binary log; its payload is a
+  *		log_binary_open_t
+  * LOG_EVENT_MESSAGE - a plain message
+  * LOG_EVENT_RECEIVED - a line received from the other side ("Received: ")
+  * LOG_EVENT_SENT - a line sent to the other side ("Sent: ")
+  * LOG_EVENT_DROPPED - lines were thrown away because the ring buffer was
+  *		full; its payload is the count, as a uint64_t
+  */
+typedef enum
+{
+	LOG_EVENT_OPEN = 0,
+	LOG_EVENT_MESSAGE,
+	LOG_EVENT_RECEIVED,
+	LOG_EVENT_SENT,
+	LOG_EVENT_DROPPED,
+} log_event_t;
+
+/**
+  * Fixed size header in front of every entry of a binary log
+  * timestamp - CLOCK_MONOTONIC time of the entry, in nanoseconds
+  * session_id - the session the entry came from, or 0 for the server itself
+  * event - a log_event_t
+  * length - the number of payload bytes following the header
+  */
+typedef struct
+{
+	uint64_t timestamp;
+	uint32_t session_id;
+	uint16_t event;
+	uint16_t length;
+} log_binary_header_t;
+
+/**
+  * Payload of the LOG_EVENT_OPEN entry, which ties the monotonic timestamps of
+  * the entries after it to the wall clock
+  * magic - LOG_BINARY_MAGIC, with its '\0'
+  * realtime - CLOCK_REALTIME time, in nanoseconds, at the same moment as the
+  *		entry's monotonic timestamp
+  */
+typedef struct
+{
+	char magic[LOG_BINARY_MAGIC_LEN];
+	uint64_t realtime;
+} log_binary_open_t;
+
+/**
+  * A single, already formatted entry waiting in the ring buffer
+  * sequence - tells producers and the flusher whose turn the slot is
+  * length - the number of bytes in data
+  * data - the entry itself; for text logs, timestamp and newline included
+  */
+typedef struct
+{
+	size_t sequence;
+	size_t length;
+	char data[LOG_RECORD_SIZE];
+} log_record_t;
+
+/**
+  * Lock-free multi-producer ring buffer which the logging threads push lines
+  * into and which a background flusher thread drains into the log file with
+  * batched writevs
+  * records - the slots of the ring buffer
+  * enqueue_pos - the next position producers will claim
+  * dequeue_pos - the next position the flusher will write out
+  * dropped - number of lines thrown away since the last flush
+  * sleeping - set while the flusher is (about to be) asleep on wakeups, so
+  *		producers know to wake it
+  * wakeups - futex word the flusher sleeps on; bumped for every wake up
+  * flusher - the thread draining the ring buffer
+  */
+typedef struct
+{
+	log_record_t *records;
+	size_t enqueue_pos;
+	size_t dequeue_pos;
+	size_t dropped;
+	uint32_t sleeping;
+	uint32_t wakeups;
+	pthread_t flusher;
+} log_ring_t;
+
+/**
+  * Structure for a log file
+  * log_file - the file being logged to
+  * format - whether entries are written as text or binary
+  * threaded - whether lines go through the ring buffer rather than straight
+  *		to the file
+  * ring - the ring buffer, for threaded logs
+  * full_policy - what to do with new lines when ring is full
+  * writers - number of threads in the middle of logging, so that closing can
+  *		wait until nobody is touching the ring any more
+  * closing - set once the log is being closed; no new lines are taken
+  */
 typedef struct
 {
 	int log_file;
-	pthread_mutex_t *lock;
+	log_format_t format;
+	uint8_t threaded;
+	log_ring_t *ring;
+	log_full_policy_t full_policy;
+	size_t writers;
+	uint8_t closing;
 } log_t;
 
 /**
-  * opens the file to be ussed for logging at file name filename
+  * opens the file to be ussed for logging at file name filename. If threaded is
+  * set, many threads can log at once: lines go into a ring buffer and are
+  * written out by a flusher thread.
   * @param fd       - out param; the log file structure
   * @param filename - the file name to use for the log file
   */
 status_t open_log_file(log_t *log, char *filename, uint8_t threaded);
 
 /**
-  * 
+  * opens the next numbered log file in directory, removing the oldest one so
+  * that only files_to_keep are left
+  * @param log - out param; the log file structure
+  * @param directory - the directory holding the log files
+  * @param files_to_keep - how many log files to keep around
+  * @param next_log_num - the number of the file to open
+  * @param threaded - whether many threads will log at once
+  * @param format - whether to write text or binary entries
   */
-status_t open_log_file_in_dir(log_t *log, char *directory, int files_to_keep, int next_log_num, uint8_t threaded);
+status_t open_log_file_in_dir(log_t *log, char *directory, int files_to_keep, int next_log_num, uint8_t threaded, log_format_t format);
 
 /**
-  * close the given log file out
+  * close the given log file out. For threaded logs, waits for any thread in the
+  * middle of logging, then writes out everything still in the ring buffer
+  * before closing the file, so that nothing logged gets lost
   * @param log -the log structure to close up
   */
 status_t close_log_file(log_t *log);
@@ -41,6 +188,33 @@ status_t close_log_file(log_t *log);
   */
 status_t write_log(log_t *log, char *message, size_t length);
 
+/**
+  * logs an entry of the given kind; the text form of the entry is prefixed
+  * according to event, while the binary form just records it
+  * @param log - the log to which the entry will be written
+  * @param event - what kind of entry this is
+  * @param message - the message to write to the log
+  * @param length - the length of the message
+  */
+status_t write_log_event(log_t *log, log_event_t event, char *message, size_t length);
+
+/**
+  * logs an entry like write_log_event, but with the message gathered from
+  * several pieces, so that the caller doesn't have to put it together first
+  * @param log - the log to which the entry will be written
+  * @param event - what kind of entry this is
+  * @param message - the pieces of the message, in order
+  * @param count - the number of pieces; at most LOG_MAX_MESSAGE_PARTS are used
+  */
+status_t write_log_event_parts(log_t *log, log_event_t event, struct iovec *message, int count);
+
+/**
+  * sets the session id that the calling thread's binary log entries are tagged
+  * with; 0 means the server itself
+  * @param session_id - the id of the session the thread is now working for
+  */
+void set_log_session(uint32_t session_id);
+
 /**
   * write a "received" message to the log, with the received data
   * @param session - file to which to log
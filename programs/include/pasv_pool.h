@@ -0,0 +1,68 @@
+#ifndef __PASV_POOL_H__
+#define __PASV_POOL_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "status_t.h"
+
+/**
+  * A server-wide set of passive mode listening sockets, one per port in the
+  * configured range, bound and listening from startup. A PASV leases one of
+  * them for as long as it is needed instead of setting up a new socket each
+  * time, and the lease is given back once the data connection has been
+  * accepted or given up on.
+  * sockets - the listening sockets; all of them are nonblocking
+  * ports - the port each socket is listening on
+  * count - the number of sockets in the pool
+  * free_leases - stack of the indexes of the sockets not leased right now
+  * free_count - the number of indexes on free_leases
+  * lock - protects free_leases and free_count
+  */
+typedef struct
+{
+	int *sockets;
+	uint16_t *ports;
+	size_t count;
+	size_t *free_leases;
+	size_t free_count;
+	pthread_mutex_t lock;
+} pasv_pool_t;
+
+/**
+  * Binds a listening socket to every port from first_port to last_port that is
+  * available. Ports that are already in use are skipped, but it's an error if
+  * none of them can be used.
+  * @param pool - the pool to set up
+  * @param first_port - the lowest port in the range
+  * @param last_port - the highest port in the range
+  */
+status_t pasv_pool_initialize(pasv_pool_t *pool, uint16_t first_port, uint16_t last_port);
+
+/**
+  * Leases a listening socket out of the pool, first throwing away any
+  * connections left over from the last time it was leased. Returns
+  * PASV_POOL_EMPTY_ERROR if every socket is leased already.
+  * @param pool - the pool to lease from
+  * @param lease - out param; identifies the lease when giving it back
+  * @param sock - out param; the listening socket
+  * @param port - out param; the port on which sock is listening
+  */
+status_t pasv_pool_lease(pasv_pool_t *pool, size_t *lease, int *sock, uint16_t *port);
+
+/**
+  * Gives a leased socket back to the pool. The socket must not be closed.
+  * Connections still waiting to be accepted on it are thrown away.
+  * @param pool - the pool the socket was leased from
+  * @param lease - the lease, as given by pasv_pool_lease
+  */
+void pasv_pool_release(pasv_pool_t *pool, size_t lease);
+
+/**
+  * Closes every socket in the pool and frees it
+  * @param pool - the pool to free
+  */
+void pasv_pool_free(pasv_pool_t *pool);
+
+#endif
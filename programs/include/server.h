@@ -2,26 +2,72 @@
 #define __SERVER_H__
 
 #include "accounts.h"
+#include "file_cache.h"
+#include "listing_cache.h"
 #include "log.h"
+#include "pasv_pool.h"
 #include "status_t.h"
 
 /**
   * Structure for holding the server configuration/information. Contains a
   * reference to the accounts table, the log file, the address of the server,
   * and various flags.
-  * accounts - the table of accounts on the server
+  * accounts - the accounts on the server, which SIGHUP reloads
   * log - the log file on the server
   * ip4 - the IPv4 address of the server
   * ip6 - the IPv6 address of the server
+  * event_mode - whether sessions are driven by event loops rather than by a
+  *		thread each
+  * event_threads - the number of event loop threads to run in event mode
+  * max_users - the most sessions that can run at once; in threaded mode, the
+  *		number of worker threads
+  * accept_queue_size - in threaded mode, how many connections can wait for a
+  *		free worker before new ones get turned away
+  * active_sessions - in event mode, the number of sessions running right now
+  * next_session_id - the id last handed out to a session, for tagging log
+  *		entries
+  * pasv_pool - the pre-bound passive mode sockets, or NULL if no port range was
+  *		given, in which case each PASV gets a socket of its own
+  * pasv_accept_timeout - how many seconds to wait for a client to connect after
+  *		a PASV before giving up on it
+  * listing_cache - the rendered directory listings shared by every session, or
+  *		NULL if the cache has been turned off
+  * file_cache - the open files, and the contents of small ones, shared by every
+  *		session's downloads, or NULL if the cache has been turned off
+  * root_fd - an O_PATH descriptor for the directory clients are served from,
+  *		which sessions start in and can't get out of: the "root_directory"
+  *		parameter, or else the directory the server was started in
+  * root - the real path of root_fd
+  * root_length - how much of a real path under the root is the root itself;
+  *		the rest is the path clients see
+  * config_path, accounts_path, log_path - the real paths of the configuration
+  *		file, the accounts file (NULL if there isn't one) and the log
+  *		directory, which uploads may not write over
   */
 typedef struct
 {
-	accounts_table_t *accounts;
+	accounts_t *accounts;
 	log_t *log;
 	char *ip4;
 	char *ip6;
 	int8_t port_enabled;
 	int8_t pasv_enabled;
+	int8_t event_mode;
+	int event_threads;
+	int max_users;
+	int accept_queue_size;
+	int active_sessions;
+	uint32_t next_session_id;
+	pasv_pool_t *pasv_pool;
+	int pasv_accept_timeout;
+	listing_cache_t *listing_cache;
+	file_cache_t *file_cache;
+	int root_fd;
+	char *root;
+	size_t root_length;
+	char *config_path;
+	char *accounts_path;
+	char *log_path;
 } server_t;
 
 /**
@@ -31,6 +31,14 @@ typedef enum
 	FILE_READ_ERROR,
 	CONFIG_FILE_ERROR,
 	DIR_OPEN_ERROR,
+	SOCKET_WOULD_BLOCK,
+	EPOLL_ERROR,
+	QUEUE_FULL_ERROR,
+	SIGNAL_ERROR,
+	LOG_FORMAT_ERROR,
+	PASV_POOL_EMPTY_ERROR,
+	COMPRESSION_ERROR,
+	ACCOUNTS_FORMAT_ERROR,
 } status_t;
 
 /**
@@ -1,28 +1,102 @@
 #include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "accounts.h"
-#include "string_t.h"
 
 /**
   * Hash function for the accounts hash table. Uses the djb2 algorithm - see
-  * http://www.cse.yorku.ca/~oz/hash.html
+  * http://www.cse.yorku.ca/~oz/hash.html. It is fixed at 64 bits and works on
+  * unsigned bytes, so that a compiled file means the same thing to every build.
   * @param str - the string (username) to be hashed
   */
-size_t hash(char *str);
+uint64_t hash(char *str);
 
 /**
-  * Performs a hash and then mods by the number of buckets available in the hash
-  * table
-  * @param str - the string/username to be hashed
+  * Finds where username belongs in the accounts table: the slot holding it, or
+  * otherwise the empty slot it would go in
+  * @param accounts - the table to search
+  * @param username - the username to find
+  * @param hash_val - hash(username)
+  * @return the slot, or NULL if the table is damaged (it has no empty slot, or
+  *		a slot points outside the image)
   */
-size_t accounts_hash(char *str);
+account_slot_t *find_slot(accounts_table_t *accounts, char *username, uint64_t hash_val);
 
-status_t get_accounts(char *filename, accounts_table_t *accounts)
+/**
+  * Checks that image holds a sound header and slots, and sets the table up to
+  * search it. Only the header is looked at, so this takes the same time
+  * however many accounts there are; slots are checked as lookups reach them.
+  * @param accounts - the table to set up
+  * @param image - the accounts image
+  * @param length - the size of the image in bytes
+  */
+status_t use_accounts_image(accounts_table_t *accounts, char *image, size_t length);
+
+/**
+  * Compiles the text accounts file that is open as file. See compile_accounts.
+  * @param file - the accounts file to read
+  * @param image - out param; the image
+  * @param length - out param; the size of the image in bytes
+  */
+status_t compile_accounts_file(int file, char **image, size_t *length);
+
+/**
+  * Reads all of a file into a new buffer, ending it with a '\0'
+  * @param file - the file to read
+  * @param buffer - out param; the contents, to be freed with free
+  * @param length - out param; how many bytes were read
+  */
+status_t read_whole_file(int file, char **buffer, size_t *length);
+
+/**
+  * Cuts the next line out of the buffer, ending it with a '\0' in place of its
+  * line ending (LF or CRLF)
+  * @param position - in/out param; where the line starts, which is moved on to
+  *		the start of the next line
+  * @param end - the end of the buffer
+  * @return the line, or NULL if the buffer has run out
+  */
+char *next_line(char **position, char *end);
+
+/**
+  * Copies a string onto the end of an image being compiled
+  * @param image - the image
+  * @param used - in/out param; how much of the image is used so far
+  * @param str - the string to add
+  * @return where the string now starts in the image
+  */
+uint64_t append_string(char *image, size_t *used, char *str);
+
+/**
+  * Waits until no lookups are counted under the given epoch parity
+  * @param accounts - the accounts being reloaded
+  * @param parity - which reader count to wait on
+  */
+void wait_for_readers(accounts_t *accounts, size_t parity);
+
+status_t compile_accounts(char *filename, char **image, size_t *length)
 {
 	status_t error;
 
-	memset(accounts->accounts, 0, ACCOUNT_BUCKETS * sizeof *accounts->accounts);
+	int file = open(filename, O_RDONLY, 0);
+	if (file < 0)
+	{
+		return FILE_OPEN_ERROR;
+	}
+
+	error = compile_accounts_file(file, image, length);
+	close(file);
+	return error;
+}
+
+status_t get_accounts(char *filename, accounts_table_t **accounts)
+{
+	status_t error = SUCCESS;
 
 	int file = open(filename, O_RDONLY, 0);
 	if (file < 0)
@@ -31,98 +105,410 @@ status_t get_accounts(char *filename, accounts_table_t *accounts)
 		goto exit0;
 	}
 
-	string_t num_entries_str;
-	string_initialize(&num_entries_str);
-	error = read_line_strip_endings(file, &num_entries_str);
-	if (error)
+	accounts_table_t *table = calloc(1, sizeof *table);
+	if (table == NULL)
 	{
+		error = MEMORY_ERROR;
 		goto exit1;
 	}
-	int records = atoi(string_c_str(&num_entries_str));
-
-	string_t username, password;
-	string_initialize(&username);
-	string_initialize(&password);
 
-	int i;
-	for (i = 0; i < records; i++)
+	struct stat file_stat;
+	if (fstat(file, &file_stat) < 0)
 	{
-		char_vector_clear(&username);
-		char_vector_clear(&password);
+		error = FILE_READ_ERROR;
+		goto exit_error2;
+	}
 
-		error = read_line_strip_endings(file, &username);
-		if (error)
+	char magic[ACCOUNTS_MAGIC_LEN];
+	char *image;
+	size_t length;
+	if (pread(file, magic, sizeof magic, 0) == sizeof magic &&
+		memcmp(magic, ACCOUNTS_MAGIC, ACCOUNTS_MAGIC_LEN) == 0)
+	{
+		//A compiled file is used right where it is: nothing is read or
+		//allocated up front, and lookups only fault in the pages they touch
+		length = file_stat.st_size;
+		image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+		if (image == MAP_FAILED)
 		{
-			goto exit_error1;
+			error = FILE_READ_ERROR;
+			goto exit_error2;
 		}
-
-		error = read_line_strip_endings(file, &password);
+		madvise(image, length, MADV_RANDOM);
+		table->mapped = 1;
+	}
+	else
+	{
+		error = compile_accounts_file(file, &image, &length);
 		if (error)
 		{
-			goto exit_error1;
+			goto exit_error2;
 		}
+	}
+	table->image = image;
+	table->length = length;
+
+	error = use_accounts_image(table, image, length);
+	if (error)
+	{
+		goto exit_error2;
+	}
 
-		account_t *account = malloc(sizeof *account);
-		if (account == NULL)
+	*accounts = table;
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit1;
+
+exit_error2:
+	free_accounts(table);
+exit1:
+	close(file);
+exit0:
+	return error;
+}
+
+status_t get_account_by_username(accounts_table_t *accounts, char *username, account_t *account)
+{
+	account->username = NULL;
+	account->password = NULL;
+
+	account_slot_t *slot = find_slot(accounts, username, hash(username));
+	if (slot != NULL && slot->username != 0)
+	{
+		account->username = accounts->image + slot->username;
+		account->password = accounts->image + slot->password;
+	}
+
+	return SUCCESS;
+}
+
+status_t free_accounts(accounts_table_t *accounts)
+{
+	if (accounts != NULL)
+	{
+		if (accounts->mapped)
 		{
-			goto exit_error1;
+			munmap(accounts->image, accounts->length);
 		}
+		else
+		{
+			free(accounts->image);
+		}
+		free(accounts);
+	}
+
+	return SUCCESS;
+}
+
+status_t initialize_accounts(accounts_t *accounts, char *filename)
+{
+	status_t error;
+
+	accounts->table = NULL;
+	accounts->epoch = 0;
+	accounts->readers[0] = 0;
+	accounts->readers[1] = 0;
+	accounts->filename = strdup(filename);
+	if (accounts->filename == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
 
-		account->username = strdup(string_c_str(&username));
-		account->password = strdup(string_c_str(&password));
+	if (pthread_mutex_init(&accounts->reload_lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit_error1;
+	}
 
-		size_t hash_val = accounts_hash(account->username);
-		account->next = accounts->accounts[hash_val];
-		accounts->accounts[hash_val] = account;
+	error = get_accounts(filename, &accounts->table);
+	if (error)
+	{
+		goto exit_error2;
 	}
 
-	goto exit2;
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
 
+exit_error2:
+	pthread_mutex_destroy(&accounts->reload_lock);
 exit_error1:
-	free_accounts(accounts);
-exit2:
-	string_uninitialize(&password);
-	string_uninitialize(&username);
-exit1:
-	string_uninitialize(&num_entries_str);
-	close(file);
+	free(accounts->filename);
+exit0:
+	return error;
+}
+
+status_t reload_accounts(accounts_t *accounts)
+{
+	status_t error;
+
+	pthread_mutex_lock(&accounts->reload_lock);
+
+	accounts_table_t *table;
+	error = get_accounts(accounts->filename, &table);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	accounts_table_t *old_table = __atomic_exchange_n(&accounts->table, table, __ATOMIC_SEQ_CST);
+
+	//Lookups that began before the swap might still be in the old table. Move
+	//new lookups off each reader count in turn and wait for it to empty; then
+	//nobody can be left in there.
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		size_t parity = __atomic_fetch_add(&accounts->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		wait_for_readers(accounts, parity);
+	}
+	free_accounts(old_table);
+
 exit0:
+	pthread_mutex_unlock(&accounts->reload_lock);
 	return error;
 }
 
-status_t get_account_by_username(accounts_table_t *accounts, char *username, account_t **account)
+accounts_table_t *accounts_read_begin(accounts_t *accounts, size_t *epoch)
+{
+	*epoch = __atomic_load_n(&accounts->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&accounts->readers[*epoch], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&accounts->table, __ATOMIC_SEQ_CST);
+}
+
+void accounts_read_end(accounts_t *accounts, size_t epoch)
+{
+	__atomic_sub_fetch(&accounts->readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+void uninitialize_accounts(accounts_t *accounts)
+{
+	free_accounts(accounts->table);
+	pthread_mutex_destroy(&accounts->reload_lock);
+	free(accounts->filename);
+}
+
+account_slot_t *find_slot(accounts_table_t *accounts, char *username, uint64_t hash_val)
+{
+	size_t i = hash_val & accounts->mask;
+	size_t probes;
+	//A sound table always has an empty slot, but a damaged file might not
+	for (probes = 0; probes <= accounts->mask; probes++)
+	{
+		account_slot_t *slot = accounts->slots + i;
+		if (slot->username == 0)
+		{
+			return slot;
+		}
+
+		if (slot->username >= accounts->length || slot->password >= accounts->length)
+		{
+			return NULL;
+		}
+
+		if (slot->hash == hash_val && strcmp(accounts->image + slot->username, username) == 0)
+		{
+			return slot;
+		}
+
+		i = (i + 1) & accounts->mask;
+	}
+
+	return NULL;
+}
+
+status_t use_accounts_image(accounts_table_t *accounts, char *image, size_t length)
 {
-	size_t hash_val = accounts_hash(username);
-	*account = accounts->accounts[hash_val];
-	while (*account != NULL && !bool_strcmp((*account)->username, username))
+	accounts_header_t *header = (accounts_header_t *) image;
+	if (length < sizeof *header + 1 || memcmp(header->magic, ACCOUNTS_MAGIC, ACCOUNTS_MAGIC_LEN) != 0)
 	{
-		*account = (*account)->next;
+		return ACCOUNTS_FORMAT_ERROR;
 	}
 
+	//The slot count has to be a power of two, and the slots have to fit
+	uint64_t slot_count = header->slot_count;
+	if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+		slot_count > (length - sizeof *header) / sizeof(account_slot_t))
+	{
+		return ACCOUNTS_FORMAT_ERROR;
+	}
+
+	//Every string ends before the image does as long as the image itself ends
+	//in a '\0', so a string in a damaged file still can't run off the end
+	if (image[length - 1] != '\0')
+	{
+		return ACCOUNTS_FORMAT_ERROR;
+	}
+
+	accounts->slots = (account_slot_t *) (image + sizeof *header);
+	accounts->mask = slot_count - 1;
+	accounts->count = header->count;
 	return SUCCESS;
 }
 
-status_t free_accounts(accounts_table_t *accounts)
+status_t compile_accounts_file(int file, char **image, size_t *length)
 {
-	size_t i;
-	for (i = 0; i < ACCOUNT_BUCKETS; i++)
+	status_t error;
+
+	char *text;
+	size_t text_length;
+	error = read_whole_file(file, &text, &text_length);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	char *position = text;
+	char *end = text + text_length;
+	char *num_entries_str = next_line(&position, end);
+	long records = num_entries_str == NULL ? 0 : atol(num_entries_str);
+	//Each record takes at least two bytes of the file, so a count bigger than
+	//the file can't be right
+	if (records < 0 || (size_t) records > text_length)
+	{
+		error = FILE_READ_ERROR;
+		goto exit1;
+	}
+
+	//Keep the table at most half full, so that probes stay short
+	size_t slots = ACCOUNT_MIN_SLOTS;
+	while (slots < 2 * (size_t) records)
 	{
-		account_t *head = accounts->accounts[i];
-		while (head != NULL)
+		slots *= 2;
+	}
+
+	//No line takes up more room in the image than it did in the file, except
+	//that a last line without a line ending gains a '\0'. The image's strings
+	//also start with an empty one, so that the image always ends in a '\0'.
+	size_t strings_start = sizeof(accounts_header_t) + slots * sizeof(account_slot_t);
+	size_t capacity = strings_start + text_length + 2;
+	char *new_image = calloc(1, capacity);
+	if (new_image == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit1;
+	}
+
+	accounts_header_t *header = (accounts_header_t *) new_image;
+	memcpy(header->magic, ACCOUNTS_MAGIC, ACCOUNTS_MAGIC_LEN);
+	header->slot_count = slots;
+	header->count = 0;
+
+	accounts_table_t table;
+	table.image = new_image;
+	table.length = capacity;
+	table.slots = (account_slot_t *) (new_image + sizeof *header);
+	table.mask = slots - 1;
+
+	size_t used = strings_start + 1;
+	long i;
+	for (i = 0; i < records; i++)
+	{
+		char *username = next_line(&position, end);
+		char *password = next_line(&position, end);
+		if (password == NULL)
+		{
+			error = FILE_READ_ERROR;
+			goto exit_error2;
+		}
+
+		uint64_t hash_val = hash(username);
+		account_slot_t *slot = find_slot(&table, username, hash_val);
+		if (slot->username == 0)
+		{
+			header->count++;
+		}
+		slot->hash = hash_val;
+		slot->username = append_string(new_image, &used, username);
+		slot->password = append_string(new_image, &used, password);
+	}
+
+	*image = new_image;
+	*length = used;
+	//equivalent to return SUCCESS (and don't free the image)
+	goto exit1;
+
+exit_error2:
+	free(new_image);
+exit1:
+	free(text);
+exit0:
+	return error;
+}
+
+status_t read_whole_file(int file, char **buffer, size_t *length)
+{
+	struct stat file_stat;
+	if (fstat(file, &file_stat) < 0)
+	{
+		return FILE_READ_ERROR;
+	}
+
+	char *contents = malloc(file_stat.st_size + 1);
+	if (contents == NULL)
+	{
+		return MEMORY_ERROR;
+	}
+
+	size_t total = 0;
+	while (total < (size_t) file_stat.st_size)
+	{
+		ssize_t amount = pread(file, contents + total, file_stat.st_size - total, total);
+		if (amount <= 0)
 		{
-			free(head->username);
-			free(head->password);
-			account_t *tmp = head->next;
-			free(head);
-			head = tmp;
+			free(contents);
+			return FILE_READ_ERROR;
 		}
+		total += amount;
+	}
+	contents[total] = '\0';
+
+	*buffer = contents;
+	*length = total;
+	return SUCCESS;
+}
+
+char *next_line(char **position, char *end)
+{
+	char *line = *position;
+	if (line >= end)
+	{
+		return NULL;
+	}
+
+	char *newline = memchr(line, '\n', end - line);
+	char *line_end = newline == NULL ? end : newline;
+	*position = newline == NULL ? end : newline + 1;
+
+	if (line_end > line && line_end[-1] == '\r')
+	{
+		line_end--;
+	}
+	*line_end = '\0';
+
+	return line;
+}
+
+uint64_t append_string(char *image, size_t *used, char *str)
+{
+	uint64_t offset = *used;
+	size_t length = strlen(str) + 1;
+	memcpy(image + offset, str, length);
+	*used += length;
+	return offset;
+}
+
+void wait_for_readers(accounts_t *accounts, size_t parity)
+{
+	while (__atomic_load_n(&accounts->readers[parity], __ATOMIC_ACQUIRE) != 0)
+	{
+		sched_yield();
 	}
 }
 
-size_t hash(char *str)
+uint64_t hash(char *str)
 {
-    size_t hash_val = 5381;
-    char c;
+    uint64_t hash_val = 5381;
+    unsigned char c;
 
     while ((c = *str++))
     {
@@ -131,8 +517,3 @@ size_t hash(char *str)
 
     return hash_val;
 }
-
-size_t accounts_hash(char *str)
-{
-	return hash(str) % ACCOUNT_BUCKETS;
-}
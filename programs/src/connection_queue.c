@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "connection_queue.h"
+#include "status_t.h"
+
+status_t connection_queue_initialize(connection_queue_t *queue, size_t capacity)
+{
+	status_t error = SUCCESS;
+
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->sockets = malloc(capacity * sizeof *queue->sockets);
+	if (queue->sockets == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
+
+	if (pthread_mutex_init(&queue->lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit1;
+	}
+
+	if (pthread_cond_init(&queue->not_empty, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit2;
+	}
+
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit2:
+	pthread_mutex_destroy(&queue->lock);
+exit1:
+	free(queue->sockets);
+exit0:
+	return error;
+}
+
+status_t connection_queue_try_push(connection_queue_t *queue, int sock)
+{
+	status_t error = SUCCESS;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity)
+	{
+		error = QUEUE_FULL_ERROR;
+		goto exit0;
+	}
+
+	queue->sockets[(queue->head + queue->count) % queue->capacity] = sock;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+
+exit0:
+	pthread_mutex_unlock(&queue->lock);
+	return error;
+}
+
+status_t connection_queue_pop(connection_queue_t *queue, int *sock)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0)
+	{
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	*sock = queue->sockets[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	pthread_mutex_unlock(&queue->lock);
+
+	return SUCCESS;
+}
+
+void connection_queue_free(connection_queue_t *queue)
+{
+	while (queue->count > 0)
+	{
+		close(queue->sockets[queue->head]);
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+	}
+
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->sockets);
+}
@@ -0,0 +1,707 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "status_t.h"
+
+//Anything that changes what a name in the directory leads to, or the
+//directory itself going away
+#define NAME_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+//Anything that changes the file's contents or metadata, including a link to it
+//being removed
+#define FILE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF)
+#define INOTIFY_BUFFER_SIZE 4096
+//Long enough for "/proc/self/fd/" and any descriptor number
+#define FD_PATH_SIZE 32
+
+/**
+  * FNV-1a hash of a directory and a name in it, for picking the name's bucket
+  * @param dir_dev, dir_ino - the directory
+  * @param name - the name
+  */
+size_t hash_file_name(dev_t dir_dev, ino_t dir_ino, char *name);
+
+/**
+  * Hash of a device and inode, for picking an entry's bucket
+  * @param dev, ino - the file
+  */
+size_t hash_inode(dev_t dev, ino_t ino);
+
+/**
+  * Finds the record of a name in a directory. The lock must be held.
+  * @param cache - the cache to search
+  * @param dir_dev, dir_ino - the directory
+  * @param name - the name to look for
+  * @return the name, or NULL if nothing is cached under it
+  */
+file_name_t *find_file_name(file_cache_t *cache, dev_t dir_dev, ino_t dir_ino, char *name);
+
+/**
+  * Finds the entry for a file. The lock must be held.
+  * @param cache - the cache to search
+  * @param dev, ino - the file
+  * @return the entry, or NULL if the file isn't cached
+  */
+file_entry_t *find_file_entry(file_cache_t *cache, dev_t dev, ino_t ino);
+
+/**
+  * Finds a name watched by the given watch, and called the given name if that
+  * isn't NULL. The lock must be held.
+  * @param cache - the cache to search
+  * @param watch - the watch descriptor on the directory
+  * @param name - the name to look for, or NULL for any
+  */
+file_name_t *find_watched_name(file_cache_t *cache, int watch, char *name);
+
+/**
+  * Finds an entry whose file is watched by the given watch. The lock must be
+  * held.
+  * @param cache - the cache to search
+  * @param watch - the watch descriptor on the file
+  */
+file_entry_t *find_watched_file(file_cache_t *cache, int watch);
+
+/**
+  * Removes a watch that nothing is using any more, and bumps the generation
+  * so that no file opened under the watch gets cached. The lock must be held.
+  * @param cache - the cache owning the watch
+  * @param watch - the watch descriptor
+  */
+void drop_file_watch_if_unused(file_cache_t *cache, int watch);
+
+/**
+  * Moves an entry to the front of the least recently used order. The lock
+  * must be held.
+  * @param cache - the cache holding the entry
+  * @param entry - the entry just used
+  */
+void touch_file_entry(file_cache_t *cache, file_entry_t *entry);
+
+/**
+  * Adds a new entry to the cache as the most recently used. The lock must be
+  * held.
+  * @param cache - the cache to add to
+  * @param entry - the entry to add
+  */
+void insert_file_entry(file_cache_t *cache, file_entry_t *entry);
+
+/**
+  * Adds a name to a cached entry. The lock must be held.
+  * @param cache - the cache holding the entry
+  * @param entry - the entry the name leads to
+  * @param name - the name to add
+  */
+void insert_file_name(file_cache_t *cache, file_entry_t *entry, file_name_t *name);
+
+/**
+  * Takes an entry and all of its names out of the cache, dropping their
+  * watches if nothing else uses them. The entry is freed, and its file closed,
+  * unless a session still holds a reference. The lock must be held.
+  * @param cache - the cache holding the entry
+  * @param entry - the entry to remove
+  */
+void remove_file_entry(file_cache_t *cache, file_entry_t *entry);
+
+/**
+  * Closes an entry's file and frees it, its contents and its names
+  * @param entry - an entry that is out of the cache and no longer referenced
+  */
+void free_file_entry(file_entry_t *entry);
+
+/**
+  * The thread function for the watcher; throws files out as inotify reports
+  * changes to them or to their names
+  * @param void_args - the cache. Actually of type file_cache_t *
+  */
+void *file_watcher(void *void_args);
+
+status_t file_cache_initialize(file_cache_t *cache, size_t budget, size_t content_budget,
+	size_t content_file_size)
+{
+	status_t error = SUCCESS;
+
+	memset(cache->name_buckets, 0, sizeof cache->name_buckets);
+	memset(cache->inode_buckets, 0, sizeof cache->inode_buckets);
+	memset(cache->name_watch_buckets, 0, sizeof cache->name_watch_buckets);
+	memset(cache->file_watch_buckets, 0, sizeof cache->file_watch_buckets);
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	cache->count = 0;
+	cache->budget = budget;
+	cache->content_bytes = 0;
+	cache->content_budget = content_budget;
+	cache->content_file_size = content_file_size;
+	cache->generation = 0;
+
+	cache->inotify_fd = inotify_init();
+	if (cache->inotify_fd < 0)
+	{
+		error = FILE_OPEN_ERROR;
+		goto exit0;
+	}
+
+	if (pthread_mutex_init(&cache->lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit_error1;
+	}
+
+	if (pthread_create(&cache->watcher, NULL, file_watcher, cache) != 0)
+	{
+		error = PTHREAD_CREATE_ERROR;
+		goto exit_error2;
+	}
+
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit_error2:
+	pthread_mutex_destroy(&cache->lock);
+exit_error1:
+	close(cache->inotify_fd);
+exit0:
+	return error;
+}
+
+file_entry_t *file_cache_acquire(file_cache_t *cache, dev_t dir_dev, ino_t dir_ino, char *name)
+{
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	file_entry_t *entry = NULL;
+	pthread_mutex_lock(&cache->lock);
+	file_name_t *record = find_file_name(cache, dir_dev, dir_ino, name);
+	if (record != NULL)
+	{
+		entry = record->file;
+		entry->refs++;
+		touch_file_entry(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return entry;
+}
+
+uint64_t file_cache_generation(file_cache_t *cache)
+{
+	if (cache == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	uint64_t generation = cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+
+	return generation;
+}
+
+file_entry_t *file_cache_insert(file_cache_t *cache, int dir_fd, dev_t dir_dev, ino_t dir_ino,
+	char *name, int fd, uint64_t generation)
+{
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	//Watch before looking at anything, so that any change made after the
+	//checks below is caught. Without both watches there would be no telling
+	//when the file goes stale, so it just doesn't get cached.
+	char path[FD_PATH_SIZE];
+	sprintf(path, "/proc/self/fd/%d", dir_fd);
+	int name_watch = inotify_add_watch(cache->inotify_fd, path, NAME_WATCH_EVENTS);
+	sprintf(path, "/proc/self/fd/%d", fd);
+	int file_watch = inotify_add_watch(cache->inotify_fd, path, FILE_WATCH_EVENTS);
+
+	//The name has to lead straight to the file: a symlink's target could be
+	//changed without anything in this directory changing
+	struct stat file_stat;
+	struct stat name_stat;
+	uint8_t usable = name_watch >= 0 && file_watch >= 0 &&
+		fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+		fstatat(dir_fd, name, &name_stat, AT_SYMLINK_NOFOLLOW) == 0 &&
+		name_stat.st_dev == file_stat.st_dev && name_stat.st_ino == file_stat.st_ino;
+
+	file_name_t *record = NULL;
+	file_entry_t *entry = NULL;
+	if (usable)
+	{
+		record = calloc(1, sizeof *record);
+		entry = calloc(1, sizeof *entry);
+		if (record != NULL)
+		{
+			record->name = strdup(name);
+		}
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	//Something changed or went away since the file was opened, or another
+	//session got there first
+	if (entry == NULL || record == NULL || record->name == NULL || cache->generation != generation ||
+		find_file_name(cache, dir_dev, dir_ino, name) != NULL)
+	{
+		if (name_watch >= 0)
+		{
+			drop_file_watch_if_unused(cache, name_watch);
+		}
+		if (file_watch >= 0)
+		{
+			drop_file_watch_if_unused(cache, file_watch);
+		}
+		pthread_mutex_unlock(&cache->lock);
+
+		if (record != NULL)
+		{
+			free(record->name);
+		}
+		free(record);
+		free(entry);
+		return NULL;
+	}
+
+	record->dir_dev = dir_dev;
+	record->dir_ino = dir_ino;
+	record->watch = name_watch;
+
+	//The same file under another name shares the one descriptor
+	file_entry_t *existing = find_file_entry(cache, file_stat.st_dev, file_stat.st_ino);
+	if (existing != NULL)
+	{
+		free(entry);
+		entry = existing;
+		touch_file_entry(cache, entry);
+	}
+	else
+	{
+		entry->fd = fd;
+		entry->stat = file_stat;
+		entry->watch = file_watch;
+		insert_file_entry(cache, entry);
+	}
+	insert_file_name(cache, entry, record);
+	entry->refs++;
+
+	//Only once the new name holds its watch can older files go, or the watch
+	//could go with them
+	while (cache->count > cache->budget && cache->lru_tail != entry)
+	{
+		remove_file_entry(cache, cache->lru_tail);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (existing != NULL)
+	{
+		close(fd);
+	}
+
+	return entry;
+}
+
+char *file_cache_contents(file_cache_t *cache, file_entry_t *entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	char *contents = entry->contents;
+	uint8_t loadable = contents == NULL && entry->cached && cache->content_budget > 0 &&
+		(size_t) entry->stat.st_size <= cache->content_file_size &&
+		(size_t) entry->stat.st_size <= cache->content_budget;
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!loadable)
+	{
+		return contents;
+	}
+
+	//Read without holding the lock; if several sessions get here at once for
+	//the same file, only the first to finish keeps its copy
+	size_t length = entry->stat.st_size;
+	//An empty file still gets a buffer, so that NULL only ever means the
+	//contents aren't in memory
+	contents = malloc(length > 0 ? length : 1);
+	if (contents == NULL)
+	{
+		return NULL;
+	}
+
+	size_t total = 0;
+	while (total < length)
+	{
+		ssize_t amount = pread(entry->fd, contents + total, length - total, total);
+		if (amount < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (amount <= 0)
+		{
+			break;
+		}
+		total += amount;
+	}
+
+	//The watches catch any change eventually, but the events might not have
+	//been handled yet, so make sure the file is still what was opened before
+	//trusting what was read
+	struct stat file_stat;
+	if (total != length || fstat(entry->fd, &file_stat) < 0 ||
+		file_stat.st_size != entry->stat.st_size ||
+		file_stat.st_mtim.tv_sec != entry->stat.st_mtim.tv_sec ||
+		file_stat.st_mtim.tv_nsec != entry->stat.st_mtim.tv_nsec)
+	{
+		free(contents);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (!entry->cached || entry->contents != NULL)
+	{
+		//Either the file went stale while it was being read, or another
+		//session read it first
+		free(contents);
+		contents = entry->contents;
+	}
+	else
+	{
+		entry->contents = contents;
+		cache->content_bytes += length;
+
+		//Make room by throwing out the least recently used files that are in
+		//memory; the ones that are only open cost nothing against this budget
+		file_entry_t *victim = cache->lru_tail;
+		while (cache->content_bytes > cache->content_budget && victim != NULL)
+		{
+			file_entry_t *previous = victim->lru_prev;
+			if (victim != entry && victim->contents != NULL)
+			{
+				remove_file_entry(cache, victim);
+			}
+			victim = previous;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return contents;
+}
+
+void file_cache_release(file_cache_t *cache, file_entry_t *entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	entry->refs--;
+	uint8_t unused = entry->refs == 0 && !entry->cached;
+	pthread_mutex_unlock(&cache->lock);
+
+	//Thrown out of the cache while it was being used, so nobody else can have
+	//it any more
+	if (unused)
+	{
+		free_file_entry(entry);
+	}
+}
+
+void file_cache_free(file_cache_t *cache)
+{
+	pthread_cancel(cache->watcher);
+	pthread_join(cache->watcher, NULL);
+
+	while (cache->lru_head != NULL)
+	{
+		remove_file_entry(cache, cache->lru_head);
+	}
+
+	close(cache->inotify_fd);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+size_t hash_file_name(dev_t dir_dev, ino_t dir_ino, char *name)
+{
+	size_t hash = hash_inode(dir_dev, dir_ino);
+	for (; *name != '\0'; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+size_t hash_inode(dev_t dev, ino_t ino)
+{
+	size_t hash = 2166136261u;
+	hash = (hash ^ (size_t) dev) * 16777619;
+	hash = (hash ^ (size_t) ino) * 16777619;
+	return hash;
+}
+
+file_name_t *find_file_name(file_cache_t *cache, dev_t dir_dev, ino_t dir_ino, char *name)
+{
+	file_name_t *record = cache->name_buckets[hash_file_name(dir_dev, dir_ino, name) % FILE_CACHE_BUCKETS];
+	while (record != NULL &&
+		(record->dir_ino != dir_ino || record->dir_dev != dir_dev || strcmp(record->name, name) != 0))
+	{
+		record = record->name_next;
+	}
+
+	return record;
+}
+
+file_entry_t *find_file_entry(file_cache_t *cache, dev_t dev, ino_t ino)
+{
+	file_entry_t *entry = cache->inode_buckets[hash_inode(dev, ino) % FILE_CACHE_BUCKETS];
+	while (entry != NULL && (entry->stat.st_ino != ino || entry->stat.st_dev != dev))
+	{
+		entry = entry->inode_next;
+	}
+
+	return entry;
+}
+
+file_name_t *find_watched_name(file_cache_t *cache, int watch, char *name)
+{
+	file_name_t *record = cache->name_watch_buckets[watch % FILE_CACHE_BUCKETS];
+	while (record != NULL && (record->watch != watch || (name != NULL && strcmp(record->name, name) != 0)))
+	{
+		record = record->watch_next;
+	}
+
+	return record;
+}
+
+file_entry_t *find_watched_file(file_cache_t *cache, int watch)
+{
+	file_entry_t *entry = cache->file_watch_buckets[watch % FILE_CACHE_BUCKETS];
+	while (entry != NULL && entry->watch != watch)
+	{
+		entry = entry->watch_next;
+	}
+
+	return entry;
+}
+
+void drop_file_watch_if_unused(file_cache_t *cache, int watch)
+{
+	if (find_watched_name(cache, watch, NULL) != NULL || find_watched_file(cache, watch) != NULL)
+	{
+		return;
+	}
+
+	//Another session might have been handed the same watch descriptor for a
+	//file it is opening right now; the new generation keeps that file out of
+	//the cache, since the watch is about to disappear
+	inotify_rm_watch(cache->inotify_fd, watch);
+	cache->generation++;
+}
+
+void touch_file_entry(file_cache_t *cache, file_entry_t *entry)
+{
+	if (entry == cache->lru_head)
+	{
+		return;
+	}
+
+	entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next != NULL)
+	{
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else
+	{
+		cache->lru_tail = entry->lru_prev;
+	}
+
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	cache->lru_head->lru_prev = entry;
+	cache->lru_head = entry;
+}
+
+void insert_file_entry(file_cache_t *cache, file_entry_t *entry)
+{
+	file_entry_t **inode_bucket = cache->inode_buckets + hash_inode(entry->stat.st_dev, entry->stat.st_ino) % FILE_CACHE_BUCKETS;
+	entry->inode_next = *inode_bucket;
+	*inode_bucket = entry;
+
+	file_entry_t **watch_bucket = cache->file_watch_buckets + entry->watch % FILE_CACHE_BUCKETS;
+	entry->watch_next = *watch_bucket;
+	*watch_bucket = entry;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL)
+	{
+		cache->lru_head->lru_prev = entry;
+	}
+	else
+	{
+		cache->lru_tail = entry;
+	}
+	cache->lru_head = entry;
+
+	entry->cached = 1;
+	cache->count++;
+}
+
+void insert_file_name(file_cache_t *cache, file_entry_t *entry, file_name_t *name)
+{
+	file_name_t **name_bucket = cache->name_buckets + hash_file_name(name->dir_dev, name->dir_ino, name->name) % FILE_CACHE_BUCKETS;
+	name->name_next = *name_bucket;
+	*name_bucket = name;
+
+	file_name_t **watch_bucket = cache->name_watch_buckets + name->watch % FILE_CACHE_BUCKETS;
+	name->watch_next = *watch_bucket;
+	*watch_bucket = name;
+
+	name->file = entry;
+	name->sibling = entry->names;
+	entry->names = name;
+}
+
+void remove_file_entry(file_cache_t *cache, file_entry_t *entry)
+{
+	file_name_t *name;
+	for (name = entry->names; name != NULL; name = name->sibling)
+	{
+		file_name_t **name_link = cache->name_buckets + hash_file_name(name->dir_dev, name->dir_ino, name->name) % FILE_CACHE_BUCKETS;
+		while (*name_link != name)
+		{
+			name_link = &(*name_link)->name_next;
+		}
+		*name_link = name->name_next;
+
+		name_link = cache->name_watch_buckets + name->watch % FILE_CACHE_BUCKETS;
+		while (*name_link != name)
+		{
+			name_link = &(*name_link)->watch_next;
+		}
+		*name_link = name->watch_next;
+
+		drop_file_watch_if_unused(cache, name->watch);
+	}
+
+	file_entry_t **link = cache->inode_buckets + hash_inode(entry->stat.st_dev, entry->stat.st_ino) % FILE_CACHE_BUCKETS;
+	while (*link != entry)
+	{
+		link = &(*link)->inode_next;
+	}
+	*link = entry->inode_next;
+
+	link = cache->file_watch_buckets + entry->watch % FILE_CACHE_BUCKETS;
+	while (*link != entry)
+	{
+		link = &(*link)->watch_next;
+	}
+	*link = entry->watch_next;
+
+	if (entry->lru_prev != NULL)
+	{
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else
+	{
+		cache->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next != NULL)
+	{
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else
+	{
+		cache->lru_tail = entry->lru_prev;
+	}
+
+	entry->cached = 0;
+	cache->count--;
+	if (entry->contents != NULL)
+	{
+		cache->content_bytes -= entry->stat.st_size;
+	}
+	drop_file_watch_if_unused(cache, entry->watch);
+
+	if (entry->refs == 0)
+	{
+		free_file_entry(entry);
+	}
+}
+
+void free_file_entry(file_entry_t *entry)
+{
+	close(entry->fd);
+	free(entry->contents);
+
+	while (entry->names != NULL)
+	{
+		file_name_t *next = entry->names->sibling;
+		free(entry->names->name);
+		free(entry->names);
+		entry->names = next;
+	}
+
+	free(entry);
+}
+
+void *file_watcher(void *void_args)
+{
+	file_cache_t *cache = (file_cache_t *) void_args;
+	char buffer[INOTIFY_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (1)
+	{
+		ssize_t amount = read(cache->inotify_fd, buffer, sizeof buffer);
+		if (amount <= 0)
+		{
+			if (amount < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&cache->lock);
+		char *position = buffer;
+		while (position < buffer + amount)
+		{
+			struct inotify_event *event = (struct inotify_event *) position;
+			position += sizeof *event + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				//Events were lost, so there's no knowing what's stale any more
+				while (cache->lru_head != NULL)
+				{
+					remove_file_entry(cache, cache->lru_head);
+				}
+				continue;
+			}
+
+			//A file that changed goes, along with all of its names
+			file_entry_t *entry;
+			while ((entry = find_watched_file(cache, event->wd)) != NULL)
+			{
+				remove_file_entry(cache, entry);
+			}
+
+			//An event about a name in a directory takes out the file it led
+			//to; one about the directory itself takes out every file in it
+			char *name = event->len > 0 ? event->name : NULL;
+			file_name_t *record;
+			while ((record = find_watched_name(cache, event->wd, name)) != NULL)
+			{
+				remove_file_entry(cache, record->file);
+			}
+
+			if (!(event->mask & IN_IGNORED))
+			{
+				drop_file_watch_if_unused(cache, event->wd);
+			}
+			cache->generation++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return NULL;
+}
@@ -1,3 +1,5 @@
+#include <arpa/inet.h>
+#include <errno.h>
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -43,6 +45,67 @@ exit0:
 	return error;
 }
 
+void line_reader_initialize(line_reader_t *reader, int socket)
+{
+	reader->socket = socket;
+	reader->read_flags = 0;
+	reader->start = 0;
+	reader->end = 0;
+}
+
+status_t read_buffered_line(line_reader_t *reader, string_t *line)
+{
+	status_t error = SUCCESS;
+
+	while (1)
+	{
+		if (reader->start == reader->end)
+		{
+			//Everything buffered has been handed out, so refill from the start
+			reader->start = 0;
+			reader->end = 0;
+
+			ssize_t bytes_read = recv(reader->socket, reader->buffer, sizeof reader->buffer, reader->read_flags);
+			if (bytes_read < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				error = errno == EAGAIN || errno == EWOULDBLOCK ? SOCKET_WOULD_BLOCK : SOCKET_READ_ERROR;
+				goto exit0;
+			}
+			else if (bytes_read == 0)
+			{
+				error = SOCKET_EOF;
+				goto exit0;
+			}
+
+			reader->end = bytes_read;
+		}
+
+		char *begin = reader->buffer + reader->start;
+		size_t available = reader->end - reader->start;
+		char *newline = memchr(begin, '\n', available);
+		size_t take = newline == NULL ? available : (size_t) (newline - begin) + 1;
+
+		string_concatenate_char_array_with_size(line, begin, take);
+		reader->start += take;
+
+		//A bare '\n' doesn't end the line, and the '\r' before the '\n' might
+		//have come in with an earlier read, so check what's actually in line
+		size_t length = string_length(line);
+		if (newline != NULL && length >= 2 && char_vector_get(line, length - 2) == '\r')
+		{
+			goto exit0;
+		}
+	}
+
+exit0:
+	return error;
+}
+
 status_t read_single_line(int socket, string_t *line)
 {
 	status_t error;
@@ -160,6 +223,48 @@ status_t make_connection(int *sock, char *host_str, uint16_t port)
 	return SUCCESS;
 }
 
+status_t start_connection(int *sock, char *host_str, uint16_t port)
+{
+	struct sockaddr_in sad;
+	memset(&sad, 0, sizeof sad);
+	sad.sin_family = AF_INET;
+	sad.sin_port = htons(port);
+	if (inet_pton(AF_INET, host_str, &sad.sin_addr) != 1)
+	{
+		*sock = -1;
+		return HOST_ERROR;
+	}
+
+	if ((*sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+	{
+		return SOCKET_OPEN_ERROR;
+	}
+
+	//EINPROGRESS just means the connection is on its way
+	if (connect(*sock, (struct sockaddr *) &sad, sizeof sad) < 0 && errno != EINPROGRESS)
+	{
+		//Don't leave the caller holding a descriptor number that might be
+		//handed to somebody else's socket next
+		close(*sock);
+		*sock = -1;
+		return CONNECTION_ERROR;
+	}
+
+	return SUCCESS;
+}
+
+status_t finish_connection(int sock)
+{
+	int result;
+	socklen_t result_len = sizeof result;
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &result, &result_len) < 0 || result != 0)
+	{
+		return CONNECTION_ERROR;
+	}
+
+	return SUCCESS;
+}
+
 status_t get_ips(char **ip4, char **ip6)
 {
 	status_t error = SUCCESS;
@@ -322,6 +427,73 @@ void create_comma_delimited_address(string_t *args, char *address, uint16_t port
 	string_concatenate_char_array(args, tmp);
 }
 
+void parse_command(string_t *line, command_line_t *command)
+{
+	//Take the line ending and trailing spaces off, so that the argument ends
+	//where the line does
+	while (string_length(line) > 0)
+	{
+		char last = string_c_str(line)[string_length(line) - 1];
+		if (last != '\r' && last != '\n' && last != ' ')
+		{
+			break;
+		}
+		char_vector_pop_back(line);
+	}
+
+	char *c_str = string_c_str(line);
+	char *end = c_str + string_length(line);
+
+	char *position = c_str;
+	while (position < end && *position == ' ')
+	{
+		position++;
+	}
+
+	command->verb.start = position;
+	while (position < end && *position != ' ')
+	{
+		position++;
+	}
+	command->verb.length = position - command->verb.start;
+
+	while (position < end && *position == ' ')
+	{
+		position++;
+	}
+	command->argument.start = position;
+	command->argument.length = end - position;
+
+	command->key = pack_verb(command->verb.start, command->verb.length);
+}
+
+uint32_t pack_verb(char *verb, size_t length)
+{
+	if (length == 0 || length > MAX_VERB_LEN)
+	{
+		return 0;
+	}
+
+	uint32_t key = 0;
+	size_t i;
+	for (i = 0; i < length; i++)
+	{
+		char c = verb[i];
+		if (c >= 'a' && c <= 'z')
+		{
+			c -= 'a' - 'A';
+		}
+		else if (c < 'A' || c > 'Z')
+		{
+			return 0;
+		}
+
+		key = (key << 8) | (uint8_t) c;
+	}
+
+	return key;
+}
+
 uint8_t bool_strcmp(char *s1, char *s2)
 {
 	return strcmp(s1, s2) == 0;
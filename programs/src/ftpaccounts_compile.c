@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "accounts.h"
+#include "status_t.h"
+
+#define NUM_ARGS 3
+//What mkstemp fills in to make the temporary file's name
+#define TEMP_SUFFIX ".XXXXXX"
+
+/**
+  * Writes all of buffer to fd
+  * @param fd - the file to write to
+  * @param buffer - what to write
+  * @param length - how many bytes to write
+  */
+status_t write_all(int fd, char *buffer, size_t length);
+
+/**
+  * Compiles a text accounts file into the binary form the server can map
+  * straight into memory. Run as "ftpaccounts-compile accounts compiled". The
+  * compiled file is written under a temporary name and renamed into place, so
+  * a running server that has the old one mapped keeps seeing it whole until it
+  * is sent a SIGHUP.
+  */
+int main(int argc, char *argv[])
+{
+	status_t error;
+
+	if (argc != NUM_ARGS)
+	{
+		printf("Usage: ftpaccounts-compile accounts_file compiled_file\n");
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	char *image;
+	size_t length;
+	error = compile_accounts(argv[1], &image, &length);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	char *temp_name = malloc(strlen(argv[2]) + sizeof TEMP_SUFFIX);
+	if (temp_name == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit1;
+	}
+	strcpy(temp_name, argv[2]);
+	strcat(temp_name, TEMP_SUFFIX);
+
+	//mkstemp makes the file readable by its owner only, which is what a file
+	//of passwords should be
+	int fd = mkstemp(temp_name);
+	if (fd < 0)
+	{
+		error = FILE_OPEN_ERROR;
+		goto exit2;
+	}
+
+	error = write_all(fd, image, length);
+	if (!error && fsync(fd) < 0)
+	{
+		error = FILE_WRITE_ERROR;
+	}
+	if (close(fd) < 0 && !error)
+	{
+		error = FILE_WRITE_ERROR;
+	}
+	if (!error && rename(temp_name, argv[2]) < 0)
+	{
+		error = FILE_WRITE_ERROR;
+	}
+	if (error)
+	{
+		unlink(temp_name);
+		goto exit2;
+	}
+
+	accounts_header_t *header = (accounts_header_t *) image;
+	printf("Compiled %llu accounts into %s (%zu bytes).\n",
+		(unsigned long long) header->count, argv[2], length);
+
+exit2:
+	free(temp_name);
+exit1:
+	free(image);
+exit0:
+	print_error_message(error);
+	return error;
+}
+
+status_t write_all(int fd, char *buffer, size_t length)
+{
+	size_t total = 0;
+	while (total < length)
+	{
+		ssize_t amount = write(fd, buffer + total, length - total);
+		if (amount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			return FILE_WRITE_ERROR;
+		}
+
+		total += amount;
+	}
+
+	return SUCCESS;
+}
@@ -0,0 +1,1195 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ftp.h"
+#include "status_t.h"
+#include "string_t.h"
+
+//server, port, username and password
+#define MIN_POSITIONAL_ARGS 4
+#define DEFAULT_CLIENTS 8
+#define MAX_CLIENTS 1024
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MIX "login:1,list:1,retr:8,pasv:1,port:0"
+//How long a client that couldn't log in waits before trying again
+#define LOGIN_RETRY_DELAY_NS (10 * 1000 * 1000)
+//How much of a data connection is read at a time
+#define RECEIVE_BUFFER_SIZE (1 << 18)
+//Longest command line a client sends, verb, argument and line ending included
+#define COMMAND_BUFFER_SIZE 4096
+#define CSV_HEADER "label,clients,seconds,command,count,errors,ops_per_second,mb_per_second,p50_ms,p99_ms,p999_ms,max_ms\n"
+
+/**
+  * The commands whose latencies are measured
+  * BENCH_CONNECT - connecting the control connection and reading the 220
+  * BENCH_USER, BENCH_PASS - logging in
+  * BENCH_PASV, BENCH_PORT - setting up a data connection, from sending the
+  *		command until the connection is made
+  * BENCH_LIST, BENCH_RETR - from sending the command until the 226, with all
+  *		of the data read
+  */
+typedef enum
+{
+	BENCH_CONNECT = 0,
+	BENCH_USER,
+	BENCH_PASS,
+	BENCH_PASV,
+	BENCH_PORT,
+	BENCH_LIST,
+	BENCH_RETR,
+	BENCH_COMMANDS,
+} bench_command_t;
+
+static char *command_names[BENCH_COMMANDS] =
+{
+	[BENCH_CONNECT] = "connect",
+	[BENCH_USER] = "USER",
+	[BENCH_PASS] = "PASS",
+	[BENCH_PASV] = "PASV",
+	[BENCH_PORT] = "PORT",
+	[BENCH_LIST] = "LIST",
+	[BENCH_RETR] = "RETR",
+};
+
+/**
+  * What the clients do, given as relative weights. Each operation is a fresh
+  * login (a new control connection with USER and PASS), a LIST, or a RETR of
+  * one of the files; each LIST and RETR sets its data connection up with PASV
+  * or PORT.
+  */
+typedef struct
+{
+	unsigned int login;
+	unsigned int list;
+	unsigned int retr;
+	unsigned int pasv;
+	unsigned int port;
+} bench_mix_t;
+
+/**
+  * The run, as given on the command line, shared by every client
+  * host - the server to connect to
+  * port - the server's port
+  * username, password - what every client logs in with
+  * files - the names of the files to RETR, picked at random
+  * file_count - the length of files
+  * mix - how often each operation happens
+  * clients - how many clients run at once
+  * seconds - how long the clients run for
+  * csv - the file the results are added to as CSV, or NULL
+  * label - the label of the run's CSV rows, e.g. the release being measured
+  * deadline - the CLOCK_MONOTONIC time at which the clients stop
+  */
+typedef struct
+{
+	char *host;
+	uint16_t port;
+	char *username;
+	char *password;
+	char **files;
+	size_t file_count;
+	bench_mix_t mix;
+	int clients;
+	unsigned int seconds;
+	char *csv;
+	char *label;
+	struct timespec deadline;
+} bench_config_t;
+
+/**
+  * The measurements of one command
+  * latencies - how long, in seconds, each successful command took
+  * count - the length of latencies
+  * capacity - how many latencies there is room for
+  * errors - how many times the command failed
+  * bytes - how much data the command received
+  */
+typedef struct
+{
+	double *latencies;
+	size_t count;
+	size_t capacity;
+	size_t errors;
+	uint64_t bytes;
+} bench_samples_t;
+
+/**
+  * One simulated client, run on a thread of its own
+  * config - the run
+  * command_socket - the control connection, or -1 if there isn't one
+  * reader - reads the replies from command_socket
+  * local_address - the address of this end of the control connection, for
+  *		PORT to give the server
+  * seed - the client's random number state
+  * buffer - where data connections are read into
+  * samples - the measurements of each command
+  * error - set if the client had to stop early, having run out of memory
+  * thread - the thread running the client
+  */
+typedef struct
+{
+	bench_config_t *config;
+	int command_socket;
+	line_reader_t reader;
+	char local_address[INET_ADDRSTRLEN];
+	unsigned int seed;
+	char *buffer;
+	bench_samples_t samples[BENCH_COMMANDS];
+	status_t error;
+	pthread_t thread;
+} bench_client_t;
+
+/**
+  * Parses the command line into config
+  * @param argc - the number of arguments
+  * @param argv - the arguments
+  * @param config - out param; the run
+  */
+status_t parse_command_line(int argc, char *argv[], bench_config_t *config);
+
+/**
+  * Parses a mix of the form "login:1,list:1,retr:8,pasv:1,port:0". Anything
+  * left out has a weight of 0, except that data connections use PASV if
+  * neither pasv nor port is given a weight.
+  * @param text - the mix to parse
+  * @param mix - out param; the weights
+  */
+status_t parse_mix(char *text, bench_mix_t *mix);
+
+/**
+  * The thread function for a client: logs in, then carries out operations
+  * picked from the mix until the deadline, logging in again whenever it has
+  * to
+  * @param arg - the client. Actually of type bench_client_t *
+  */
+void *client_thread(void *arg);
+
+/**
+  * Opens a new control connection and logs in on it, measuring each step
+  * @param client - the client logging in
+  */
+status_t log_in(bench_client_t *client);
+
+/**
+  * Sends QUIT on the client's control connection, if it has one, and closes it
+  * @param client - the client logging out
+  */
+void log_out(bench_client_t *client);
+
+/**
+  * Carries out a LIST or a RETR, data connection and all
+  * @param client - the client doing the transfer
+  * @param command - BENCH_LIST or BENCH_RETR
+  * @param argument - the file for RETR, or NULL
+  * @return NON_FATAL_ERROR if the server turned the command down, or another
+  *		error if the control connection can't be used any more
+  */
+status_t transfer(bench_client_t *client, bench_command_t command, char *argument);
+
+/**
+  * Sets up a data connection with PASV, connecting to the address the server
+  * gives back
+  * @param client - the client setting up the connection
+  * @param data_socket - out param; the data connection
+  */
+status_t open_passive_connection(bench_client_t *client, int *data_socket);
+
+/**
+  * Sets up a data connection with PORT, listening on the address of this end
+  * of the control connection
+  * @param client - the client setting up the connection
+  * @param data_socket - out param; the data connection
+  */
+status_t open_active_connection(bench_client_t *client, int *data_socket);
+
+/**
+  * Sends a command on the client's control connection
+  * @param client - the client sending the command
+  * @param verb - the command
+  * @param argument - the command's argument, or NULL
+  */
+status_t send_command(bench_client_t *client, char *verb, char *argument);
+
+/**
+  * Reads a whole reply, multiline or not, from the client's control connection
+  * @param client - the client reading the reply
+  * @param reply - out param; the reply. Must be initialized
+  */
+status_t read_reply(bench_client_t *client, string_t *reply);
+
+/**
+  * Sends a command and checks that its reply has the given code
+  * @param client - the client sending the command
+  * @param verb - the command
+  * @param argument - the command's argument, or NULL
+  * @param code - the code that means the command worked
+  * @param reply - out param; the reply. Must be initialized
+  * @return NON_FATAL_ERROR if the reply had some other code
+  */
+status_t send_command_expect(bench_client_t *client, char *verb, char *argument, char *code,
+	string_t *reply);
+
+/**
+  * Reads from a data connection until the server closes it
+  * @param socket - the data connection
+  * @param buffer - where to read into, RECEIVE_BUFFER_SIZE bytes long
+  * @param received - out param; how many bytes came
+  */
+status_t receive_all(int socket, char *buffer, uint64_t *received);
+
+/**
+  * Adds a latency to a command's measurements
+  * @param samples - the command's measurements
+  * @param latency - how long the command took, in seconds
+  */
+status_t record_latency(bench_samples_t *samples, double latency);
+
+/**
+  * Picks an index at random, each as likely as its weight
+  * @param seed - the random number state to use
+  * @param weights - the weights
+  * @param count - the length of weights
+  */
+size_t pick_weighted(unsigned int *seed, unsigned int *weights, size_t count);
+
+/**
+  * The time in seconds from start until now
+  * @param start - a CLOCK_MONOTONIC time
+  */
+double seconds_since(struct timespec *start);
+
+/**
+  * Checks whether the reply begins with the given code
+  * @param reply - the reply
+  * @param code - the three digit code
+  */
+uint8_t reply_has_code(string_t *reply, char *code);
+
+/**
+  * Puts together every client's measurements, prints them, and adds them to
+  * the CSV file if there is one
+  * @param config - the run
+  * @param clients - the clients
+  * @param started - how many clients were started
+  * @param lost - how many clients had to stop early
+  * @param seconds - how long the run took
+  */
+status_t report_results(bench_config_t *config, bench_client_t *clients, int started,
+	int lost, double seconds);
+
+/**
+  * Gives the latency at the given fraction of the way through sorted latencies
+  * @param latencies - the latencies, in order
+  * @param count - the length of latencies
+  * @param fraction - e.g. 0.99 for the 99th percentile
+  */
+double percentile(double *latencies, size_t count, double fraction);
+
+int compare_doubles(const void *a, const void *b);
+
+/**
+  * Runs a number of simulated clients against an FTP server and measures how
+  * it holds up: operations per second, MB/s, and the latency percentiles of
+  * every command. Run as
+  *		ftpbench [options] server port username password [file ...]
+  * where the files are what RETR asks for.
+  */
+int main(int argc, char *argv[])
+{
+	status_t error;
+
+	bench_config_t config;
+	error = parse_command_line(argc, argv, &config);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//A server that drops a connection shouldn't take the whole run with it
+	signal(SIGPIPE, SIG_IGN);
+
+	bench_client_t *clients = calloc(config.clients, sizeof *clients);
+	if (clients == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
+
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	config.deadline = start_time;
+	config.deadline.tv_sec += config.seconds;
+
+	int started;
+	for (started = 0; started < config.clients; started++)
+	{
+		bench_client_t *client = clients + started;
+		client->config = &config;
+		client->command_socket = -1;
+		client->seed = start_time.tv_nsec ^ (started * 2654435761u);
+		if (pthread_create(&client->thread, NULL, client_thread, client) != 0)
+		{
+			printf("Could only start %d clients.\n", started);
+			error = PTHREAD_CREATE_ERROR;
+			break;
+		}
+	}
+
+	int i;
+	int lost = 0;
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(clients[i].thread, NULL);
+		if (clients[i].error)
+		{
+			lost++;
+		}
+	}
+	double seconds = seconds_since(&start_time);
+
+	status_t report_error = report_results(&config, clients, started, lost, seconds);
+	if (!error)
+	{
+		error = report_error;
+	}
+
+	for (i = 0; i < config.clients; i++)
+	{
+		int j;
+		for (j = 0; j < BENCH_COMMANDS; j++)
+		{
+			free(clients[i].samples[j].latencies);
+		}
+	}
+	free(clients);
+exit0:
+	print_error_message(error);
+	return error;
+}
+
+status_t parse_command_line(int argc, char *argv[], bench_config_t *config)
+{
+	status_t error = SUCCESS;
+
+	config->clients = DEFAULT_CLIENTS;
+	config->seconds = DEFAULT_SECONDS;
+	config->csv = NULL;
+	config->label = "";
+	char *mix = DEFAULT_MIX;
+
+	//Every option takes a value
+	int arg = 1;
+	while (arg + 1 < argc && argv[arg][0] == '-')
+	{
+		char *value = argv[arg + 1];
+		if (bool_strcmp(argv[arg], "-c"))
+		{
+			config->clients = atoi(value);
+		}
+		else if (bool_strcmp(argv[arg], "-t"))
+		{
+			config->seconds = strtoul(value, NULL, 10);
+		}
+		else if (bool_strcmp(argv[arg], "-m"))
+		{
+			mix = value;
+		}
+		else if (bool_strcmp(argv[arg], "-o"))
+		{
+			config->csv = value;
+		}
+		else if (bool_strcmp(argv[arg], "-L"))
+		{
+			config->label = value;
+		}
+		else
+		{
+			break;
+		}
+		arg += 2;
+	}
+
+	if (argc - arg < MIN_POSITIONAL_ARGS)
+	{
+		printf("Usage: ftpbench [-c clients] [-t seconds] [-m mix] [-o csv_file] [-L label]\n"
+			"\tserver port username password [file ...]\n");
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	if (config->clients < 1 || config->clients > MAX_CLIENTS)
+	{
+		printf("The number of clients must be from 1 to %d.\n", MAX_CLIENTS);
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	if (config->seconds < 1)
+	{
+		printf("The run must last at least a second.\n");
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	int port = atoi(argv[arg + 1]);
+	if (port < 1 || port > UINT16_MAX)
+	{
+		printf("Port number must be from 1 to %u.\n", UINT16_MAX);
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	config->host = argv[arg];
+	config->port = port;
+	config->username = argv[arg + 2];
+	config->password = argv[arg + 3];
+	config->files = argv + arg + MIN_POSITIONAL_ARGS;
+	config->file_count = argc - arg - MIN_POSITIONAL_ARGS;
+
+	error = parse_mix(mix, &config->mix);
+	if (error)
+	{
+		printf("The mix must be a list like \"%s\".\n", DEFAULT_MIX);
+		goto exit0;
+	}
+
+	if (config->mix.login + config->mix.list + config->mix.retr == 0)
+	{
+		printf("The mix must give at least one of login, list or retr a weight.\n");
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+	//Data connections need setting up somehow
+	if (config->mix.pasv + config->mix.port == 0)
+	{
+		config->mix.pasv = 1;
+	}
+
+	if (config->mix.retr > 0 && config->file_count == 0)
+	{
+		printf("RETR needs at least one file to ask for.\n");
+		error = BAD_COMMAND_LINE;
+		goto exit0;
+	}
+
+exit0:
+	return error;
+}
+
+status_t parse_mix(char *text, bench_mix_t *mix)
+{
+	memset(mix, 0, sizeof *mix);
+
+	char *position = text;
+	while (*position != '\0')
+	{
+		size_t name_length = strcspn(position, ":");
+		if (position[name_length] != ':')
+		{
+			return BAD_COMMAND_LINE;
+		}
+
+		char *end;
+		errno = 0;
+		unsigned long weight = strtoul(position + name_length + 1, &end, 10);
+		if (errno != 0 || end == position + name_length + 1 || (*end != ',' && *end != '\0') ||
+			weight > UINT16_MAX)
+		{
+			return BAD_COMMAND_LINE;
+		}
+
+		unsigned int *field;
+		if (name_length == 5 && strncmp(position, "login", 5) == 0)
+		{
+			field = &mix->login;
+		}
+		else if (name_length == 4 && strncmp(position, "list", 4) == 0)
+		{
+			field = &mix->list;
+		}
+		else if (name_length == 4 && strncmp(position, "retr", 4) == 0)
+		{
+			field = &mix->retr;
+		}
+		else if (name_length == 4 && strncmp(position, "pasv", 4) == 0)
+		{
+			field = &mix->pasv;
+		}
+		else if (name_length == 4 && strncmp(position, "port", 4) == 0)
+		{
+			field = &mix->port;
+		}
+		else
+		{
+			return BAD_COMMAND_LINE;
+		}
+		*field = weight;
+
+		position = *end == ',' ? end + 1 : end;
+	}
+
+	return SUCCESS;
+}
+
+void *client_thread(void *arg)
+{
+	bench_client_t *client = arg;
+	bench_config_t *config = client->config;
+
+	client->buffer = malloc(RECEIVE_BUFFER_SIZE);
+	if (client->buffer == NULL)
+	{
+		client->error = MEMORY_ERROR;
+		goto exit0;
+	}
+
+	unsigned int weights[] = { config->mix.login, config->mix.list, config->mix.retr };
+	while (seconds_since(&config->deadline) < 0)
+	{
+		status_t error;
+
+		//A client that isn't logged in, because it was turned away or its
+		//connection broke, keeps trying; a busy server saying "try again
+		//later" is part of what is being measured
+		if (client->command_socket < 0)
+		{
+			error = log_in(client);
+			if (error == MEMORY_ERROR)
+			{
+				client->error = error;
+				break;
+			}
+			if (error)
+			{
+				struct timespec delay = { 0, LOGIN_RETRY_DELAY_NS };
+				nanosleep(&delay, NULL);
+			}
+			continue;
+		}
+
+		switch (pick_weighted(&client->seed, weights, sizeof weights / sizeof *weights))
+		{
+			case 0:
+				log_out(client);
+				error = log_in(client);
+				break;
+			case 1:
+				error = transfer(client, BENCH_LIST, NULL);
+				break;
+			default:
+				error = transfer(client, BENCH_RETR,
+					config->files[rand_r(&client->seed) % config->file_count]);
+				break;
+		}
+
+		//A command the server turned down is only counted, but running out
+		//of memory for the measurements ends the client
+		if (error == MEMORY_ERROR)
+		{
+			client->error = error;
+			break;
+		}
+		if (error && error != NON_FATAL_ERROR && client->command_socket >= 0)
+		{
+			close(client->command_socket);
+			client->command_socket = -1;
+		}
+	}
+
+	log_out(client);
+	free(client->buffer);
+exit0:
+	return NULL;
+}
+
+status_t log_in(bench_client_t *client)
+{
+	status_t error;
+	bench_config_t *config = client->config;
+
+	string_t reply;
+	string_initialize(&reply);
+
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	error = make_connection(&client->command_socket, config->host, config->port);
+	if (error)
+	{
+		client->command_socket = -1;
+		client->samples[BENCH_CONNECT].errors++;
+		goto exit0;
+	}
+
+	//Commands go out one at a time and wait for their replies, so Nagle would
+	//only hold them back
+	int on = 1;
+	setsockopt(client->command_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	line_reader_initialize(&client->reader, client->command_socket);
+
+	error = read_reply(client, &reply);
+	if (!error && !reply_has_code(&reply, SERVICE_READY))
+	{
+		error = ACCEPTING_ERROR;
+	}
+	if (error)
+	{
+		client->samples[BENCH_CONNECT].errors++;
+		goto exit0;
+	}
+	error = record_latency(client->samples + BENCH_CONNECT, seconds_since(&start_time));
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//PORT has to give an address the server can reach, which is this end of
+	//the connection it is already using
+	struct sockaddr_in local;
+	socklen_t local_length = sizeof local;
+	if (getsockname(client->command_socket, (struct sockaddr *) &local, &local_length) < 0 ||
+		inet_ntop(AF_INET, &local.sin_addr, client->local_address, sizeof client->local_address) == NULL)
+	{
+		error = SOCK_NAME_ERROR;
+		goto exit0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	char_vector_clear(&reply);
+	error = send_command_expect(client, "USER", config->username, NEED_PASSWORD, &reply);
+	if (error)
+	{
+		client->samples[BENCH_USER].errors++;
+		goto exit0;
+	}
+	error = record_latency(client->samples + BENCH_USER, seconds_since(&start_time));
+	if (error)
+	{
+		goto exit0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	char_vector_clear(&reply);
+	error = send_command_expect(client, "PASS", config->password, USER_LOGGED_IN, &reply);
+	if (error)
+	{
+		client->samples[BENCH_PASS].errors++;
+		goto exit0;
+	}
+	error = record_latency(client->samples + BENCH_PASS, seconds_since(&start_time));
+	if (error)
+	{
+		goto exit0;
+	}
+
+exit0:
+	//A connection that isn't logged in is no use to the client
+	if (error && client->command_socket >= 0)
+	{
+		close(client->command_socket);
+		client->command_socket = -1;
+	}
+	if (error == NON_FATAL_ERROR)
+	{
+		error = LOG_IN_ERROR;
+	}
+	string_uninitialize(&reply);
+	return error;
+}
+
+void log_out(bench_client_t *client)
+{
+	if (client->command_socket < 0)
+	{
+		return;
+	}
+
+	//The reply doesn't matter, but waiting for it lets the server end the
+	//session cleanly rather than finding the connection gone
+	string_t reply;
+	string_initialize(&reply);
+	if (send_command(client, "QUIT", NULL) == SUCCESS)
+	{
+		read_reply(client, &reply);
+	}
+	string_uninitialize(&reply);
+
+	close(client->command_socket);
+	client->command_socket = -1;
+}
+
+status_t transfer(bench_client_t *client, bench_command_t command, char *argument)
+{
+	status_t error;
+	bench_config_t *config = client->config;
+
+	string_t reply;
+	string_initialize(&reply);
+
+	unsigned int weights[] = { config->mix.pasv, config->mix.port };
+	bench_command_t setup = pick_weighted(&client->seed, weights, 2) == 0 ? BENCH_PASV : BENCH_PORT;
+
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	int data_socket;
+	if (setup == BENCH_PASV)
+	{
+		error = open_passive_connection(client, &data_socket);
+	}
+	else
+	{
+		error = open_active_connection(client, &data_socket);
+	}
+	if (error)
+	{
+		client->samples[setup].errors++;
+		goto exit0;
+	}
+	error = record_latency(client->samples + setup, seconds_since(&start_time));
+	if (error)
+	{
+		goto exit1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	error = send_command(client, command_names[command], argument);
+	if (error)
+	{
+		goto exit_error1;
+	}
+
+	error = read_reply(client, &reply);
+	if (error)
+	{
+		goto exit_error1;
+	}
+	if (!reply_has_code(&reply, TRANSFER_STARTING) && !reply_has_code(&reply, FILE_STATUS_OKAY))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit_error1;
+	}
+
+	uint64_t received;
+	error = receive_all(data_socket, client->buffer, &received);
+	if (error)
+	{
+		goto exit_error1;
+	}
+
+	char_vector_clear(&reply);
+	error = read_reply(client, &reply);
+	if (error)
+	{
+		goto exit_error1;
+	}
+	if (!reply_has_code(&reply, CLOSING_DATA_CONNECTION))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit_error1;
+	}
+
+	client->samples[command].bytes += received;
+	error = record_latency(client->samples + command, seconds_since(&start_time));
+	goto exit1;
+
+exit_error1:
+	client->samples[command].errors++;
+exit1:
+	close(data_socket);
+exit0:
+	string_uninitialize(&reply);
+	return error;
+}
+
+status_t open_passive_connection(bench_client_t *client, int *data_socket)
+{
+	status_t error;
+
+	string_t reply;
+	string_initialize(&reply);
+
+	error = send_command_expect(client, "PASV", NULL, ENTERING_PASSIVE_MODE, &reply);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//The address is whatever follows the '(' (or, for some servers, the '=')
+	char *address = strpbrk(string_c_str(&reply), "(=");
+	unsigned int h1, h2, h3, h4, p1, p2;
+	if (address == NULL ||
+		sscanf(address + 1, "%u,%u,%u,%u,%u,%u", &h1, &h2, &h3, &h4, &p1, &p2) != 6 ||
+		h1 > 255 || h2 > 255 || h3 > 255 || h4 > 255 || p1 > 255 || p2 > 255)
+	{
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+	char host[INET_ADDRSTRLEN];
+	sprintf(host, "%u.%u.%u.%u", h1, h2, h3, h4);
+	error = make_connection(data_socket, host, p1 * PORT_DIVISOR + p2);
+	if (error)
+	{
+		//The server is left waiting for a connection that won't come; a new
+		//PASV or PORT replaces it
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+exit0:
+	string_uninitialize(&reply);
+	return error;
+}
+
+status_t open_active_connection(bench_client_t *client, int *data_socket)
+{
+	status_t error;
+
+	string_t reply, argument;
+	string_initialize(&reply);
+	string_initialize(&argument);
+
+	int listen_socket;
+	uint16_t listen_port;
+	error = set_up_listen_socket(&listen_socket, &listen_port, AF_INET, client->local_address);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//The server connects before it sends the 200, so once the reply is in the
+	//connection is already waiting to be accepted
+	create_comma_delimited_address(&argument, client->local_address, listen_port);
+	error = send_command_expect(client, "PORT", string_c_str(&argument), COMMAND_OKAY, &reply);
+	if (error)
+	{
+		goto exit1;
+	}
+
+	*data_socket = accept(listen_socket, NULL, NULL);
+	if (*data_socket < 0)
+	{
+		error = ACCEPT_ERROR;
+		goto exit1;
+	}
+
+exit1:
+	close(listen_socket);
+exit0:
+	string_uninitialize(&argument);
+	string_uninitialize(&reply);
+	return error;
+}
+
+status_t send_command(bench_client_t *client, char *verb, char *argument)
+{
+	char line[COMMAND_BUFFER_SIZE];
+	int length;
+	if (argument != NULL)
+	{
+		length = snprintf(line, sizeof line, "%s %s\r\n", verb, argument);
+	}
+	else
+	{
+		length = snprintf(line, sizeof line, "%s\r\n", verb);
+	}
+
+	if (length < 0 || (size_t) length >= sizeof line)
+	{
+		return NON_FATAL_ERROR;
+	}
+
+	//No log, unlike the client: writing one would be measured along with the
+	//server
+	int total = 0;
+	while (total < length)
+	{
+		ssize_t amount = write(client->command_socket, line + total, length - total);
+		if (amount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return SOCKET_WRITE_ERROR;
+		}
+		total += amount;
+	}
+
+	return SUCCESS;
+}
+
+status_t read_reply(bench_client_t *client, string_t *reply)
+{
+	status_t error;
+
+	error = read_buffered_line(&client->reader, reply);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//A multiline reply runs until a line starting with the same code and a
+	//space
+	if (string_length(reply) >= 4 && string_c_str(reply)[3] == '-')
+	{
+		string_t line;
+		string_initialize(&line);
+		do
+		{
+			char_vector_clear(&line);
+			error = read_buffered_line(&client->reader, &line);
+			if (error)
+			{
+				break;
+			}
+			string_concatenate(reply, &line);
+		} while (string_length(&line) < 4 || memcmp(string_c_str(&line), string_c_str(reply), 3) != 0 ||
+			string_c_str(&line)[3] != ' ');
+		string_uninitialize(&line);
+	}
+
+	if (!error && reply_has_code(reply, SERVICE_NOT_AVAILABLE))
+	{
+		error = SERVICE_AVAILIBILITY_ERROR;
+	}
+
+exit0:
+	return error;
+}
+
+status_t send_command_expect(bench_client_t *client, char *verb, char *argument, char *code,
+	string_t *reply)
+{
+	status_t error;
+
+	error = send_command(client, verb, argument);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	error = read_reply(client, reply);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	if (!reply_has_code(reply, code))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+exit0:
+	return error;
+}
+
+status_t receive_all(int socket, char *buffer, uint64_t *received)
+{
+	*received = 0;
+	while (1)
+	{
+		ssize_t amount = read(socket, buffer, RECEIVE_BUFFER_SIZE);
+		if (amount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return SOCKET_READ_ERROR;
+		}
+
+		if (amount == 0)
+		{
+			return SUCCESS;
+		}
+
+		*received += amount;
+	}
+}
+
+status_t record_latency(bench_samples_t *samples, double latency)
+{
+	if (samples->count == samples->capacity)
+	{
+		size_t capacity = samples->capacity == 0 ? 1024 : samples->capacity * 2;
+		double *latencies = realloc(samples->latencies, capacity * sizeof *latencies);
+		if (latencies == NULL)
+		{
+			return MEMORY_ERROR;
+		}
+		samples->latencies = latencies;
+		samples->capacity = capacity;
+	}
+
+	samples->latencies[samples->count++] = latency;
+	return SUCCESS;
+}
+
+size_t pick_weighted(unsigned int *seed, unsigned int *weights, size_t count)
+{
+	unsigned int total = 0;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		total += weights[i];
+	}
+
+	unsigned int choice = rand_r(seed) % total;
+	for (i = 0; i + 1 < count && choice >= weights[i]; i++)
+	{
+		choice -= weights[i];
+	}
+
+	return i;
+}
+
+double seconds_since(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+uint8_t reply_has_code(string_t *reply, char *code)
+{
+	return string_length(reply) >= 3 && memcmp(string_c_str(reply), code, 3) == 0;
+}
+
+status_t report_results(bench_config_t *config, bench_client_t *clients, int started,
+	int lost, double seconds)
+{
+	status_t error = SUCCESS;
+
+	FILE *csv = NULL;
+	if (config->csv != NULL)
+	{
+		//Rows are added to whatever is there, so that one file can hold a run
+		//for every number of clients, or every release
+		csv = fopen(config->csv, "a");
+		if (csv == NULL)
+		{
+			printf("Could not open %s.\n", config->csv);
+			error = FILE_OPEN_ERROR;
+		}
+		else if (ftell(csv) == 0)
+		{
+			fputs(CSV_HEADER, csv);
+		}
+	}
+
+	printf("%d clients for %.2f seconds", started, seconds);
+	if (lost > 0)
+	{
+		printf(", %d of which stopped early", lost);
+	}
+	printf(".\n");
+	printf("%-8s %10s %8s %10s %9s %9s %9s %9s %9s\n", "command", "count", "errors",
+		"ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+	size_t total_count = 0;
+	size_t total_errors = 0;
+	uint64_t total_bytes = 0;
+	int command;
+	for (command = 0; command < BENCH_COMMANDS; command++)
+	{
+		size_t count = 0;
+		size_t errors = 0;
+		uint64_t bytes = 0;
+		int i;
+		for (i = 0; i < started; i++)
+		{
+			count += clients[i].samples[command].count;
+			errors += clients[i].samples[command].errors;
+			bytes += clients[i].samples[command].bytes;
+		}
+
+		if (count == 0 && errors == 0)
+		{
+			continue;
+		}
+		total_count += count;
+		total_errors += errors;
+		total_bytes += bytes;
+
+		double *latencies = malloc((count > 0 ? count : 1) * sizeof *latencies);
+		if (latencies == NULL)
+		{
+			error = MEMORY_ERROR;
+			break;
+		}
+
+		size_t filled = 0;
+		for (i = 0; i < started; i++)
+		{
+			bench_samples_t *samples = clients[i].samples + command;
+			memcpy(latencies + filled, samples->latencies, samples->count * sizeof *latencies);
+			filled += samples->count;
+		}
+		qsort(latencies, count, sizeof *latencies, compare_doubles);
+
+		double ops = count / seconds;
+		double megabytes = bytes / seconds / (1024 * 1024);
+		double p50 = percentile(latencies, count, 0.5) * 1000;
+		double p99 = percentile(latencies, count, 0.99) * 1000;
+		double p999 = percentile(latencies, count, 0.999) * 1000;
+		double max = count > 0 ? latencies[count - 1] * 1000 : 0;
+		free(latencies);
+
+		printf("%-8s %10zu %8zu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f\n", command_names[command],
+			count, errors, ops, megabytes, p50, p99, p999, max);
+		if (csv != NULL)
+		{
+			fprintf(csv, "%s,%d,%.3f,%s,%zu,%zu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n", config->label,
+				started, seconds, command_names[command], count, errors, ops, megabytes, p50,
+				p99, p999, max);
+		}
+	}
+
+	//The total has no latencies of its own, since the commands take such
+	//different amounts of time
+	printf("%-8s %10zu %8zu %10.1f %9.2f\n", "total", total_count, total_errors,
+		total_count / seconds, total_bytes / seconds / (1024 * 1024));
+	if (csv != NULL)
+	{
+		fprintf(csv, "%s,%d,%.3f,total,%zu,%zu,%.1f,%.3f,,,,\n", config->label, started, seconds,
+			total_count, total_errors, total_count / seconds, total_bytes / seconds / (1024 * 1024));
+		if (fclose(csv) != 0 && !error)
+		{
+			error = FILE_WRITE_ERROR;
+		}
+	}
+
+	return error;
+}
+
+double percentile(double *latencies, size_t count, double fraction)
+{
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	size_t index = count * fraction;
+	return latencies[index < count ? index : count - 1];
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
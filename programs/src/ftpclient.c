@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "ftp.h"
 #include "log.h"
@@ -16,6 +21,17 @@
 
 #define MINIMUM_ARGC 3
 #define DEFAULT_COMMAND_PORT 21
+//How much inflated data is produced at a time in MODE Z
+#define INFLATE_CHUNK_SIZE (1 << 16)
+//How much of a download is spliced from the data socket to the file at a time
+#define RECEIVE_CHUNK_SIZE (1 << 20)
+//Most connections get -n can split a download across
+#define MAX_SEGMENTS 16
+//Most commands a -b script has waiting for their replies at once
+#define PIPELINE_DEPTH 64
+//How many sessions fetch uses, unless told otherwise, and the most it can use
+#define DEFAULT_FETCH_SESSIONS 4
+#define MAX_FETCH_SESSIONS 64
 
 #define MAKE_COMMAND_FROM_LITERAL(var, command, str_args)\
 	command_t var;\
@@ -26,13 +42,127 @@
 typedef struct
 {
 	int command_socket;
+	line_reader_t reader;
 	log_t log;
 	char *ip4;
 	char *ip6;
 	uint8_t passive_mode;
 	uint8_t extended_mode;
+	uint8_t compress_mode;
+	char *host;
+	uint16_t port;
+	char *username;
+	char *password;
+	uint8_t quiet;
+	FILE *input;
 } session_t;
 
+/**
+  * A command which can be pipelined in a -b script, since all that happens
+  * with its reply is checking it
+  * name - what the command is called in the script
+  * verb - the FTP command it sends
+  * takes_argument - whether it needs an argument, which is passed on
+  * success - the reply code that means it worked
+  */
+typedef struct
+{
+	char *name;
+	char *verb;
+	uint8_t takes_argument;
+	char *success;
+} pipelined_command_t;
+
+/**
+  * One range of a segmented download, fetched on a connection of its own
+  * session - the segment's own control connection, with the settings of the
+  *		user's session
+  * file - the name of the file on the server
+  * directory - the directory to CWD to first, or NULL
+  * fd - the local file, written at the range's offsets
+  * start - where the range starts
+  * length - how long the range is
+  * received - how much of the range has arrived
+  * last - whether this range runs to the end of the file
+  * error - how the segment went
+  * thread - the thread fetching the segment
+  */
+typedef struct
+{
+	session_t session;
+	string_t *file;
+	string_t *directory;
+	int fd;
+	off_t start;
+	off_t length;
+	off_t received;
+	uint8_t last;
+	status_t error;
+	pthread_t thread;
+} segment_t;
+
+/**
+  * One file for fetch to download
+  * args - the line from the list, split into words: the name of the file on
+  *		the server and, optionally, the local name
+  * length - the length of the args array
+  * received - how much of the file arrived
+  * latency - how many seconds it took, from asking for it to the end of the
+  *		reply, or -1 if it wasn't fetched
+  */
+typedef struct
+{
+	string_t *args;
+	size_t length;
+	off_t received;
+	double latency;
+} fetch_item_t;
+
+/**
+  * The files fetch has to download, shared by its pool of sessions
+  * items - the files
+  * count - the number of files
+  * capacity - how many items there is room for
+  * next - the index of the next file nobody has taken yet
+  * failed - how many files couldn't be fetched
+  * lock - protects next and failed
+  */
+typedef struct
+{
+	fetch_item_t *items;
+	size_t count;
+	size_t capacity;
+	size_t next;
+	size_t failed;
+	pthread_mutex_t lock;
+} fetch_queue_t;
+
+/**
+  * One session of fetch's pool
+  * session - its own command connection, with the settings of the user's
+  *		session
+  * queue - where it gets files from
+  * directory - the directory to CWD to first, or NULL
+  * error - set if the session was lost
+  * thread - the thread running the session
+  */
+typedef struct
+{
+	session_t session;
+	fetch_queue_t *queue;
+	string_t *directory;
+	status_t error;
+	pthread_t thread;
+} fetch_worker_t;
+
+/**
+  * Somewhere for data from the data connection to go
+  * @param target - the string or file descriptor the data goes to
+  * @param data   - the data
+  * @param length - the length of data
+  */
+typedef status_t (*data_sink_t)(void *target, char *data, size_t length);
+
 typedef struct
 {
 	char *identifier;
@@ -40,15 +170,27 @@ typedef struct
 	string_t *args;
 } command_t;
 
+static const pipelined_command_t pipelined_commands[] =
+{
+	{ "cd", "CWD", 1, FILE_ACTION_COMPLETED },
+	{ "cdup", "CDUP", 0, COMMAND_OKAY },
+	{ "pwd", "PWD", 0, PATH_CREATED },
+	{ "size", "SIZE", 1, FILE_STATUS },
+};
+
 //------------------------------SETUP FUNCTIONS--------------------------------
 /**
   * parses the command line, ensuring that it's valid and places the port
   * number in port, if available.
-  * @param argc - the argc received by main
-  * @param argv - the argv argument array received by main
-  * @param port - out param; the port number to be used for the FTP connection
+  * @param argc      - the argc received by main
+  * @param argv      - the argv argument array received by main
+  * @param port      - out param; the port number to be used for the FTP connection
+  * @param script    - out param; the script given with -b, or NULL
+  * @param first_arg - out param; the index in argv of the server, after any
+  *		options
   */
-status_t parse_command_line(int argc, char *argv[], uint16_t *port);
+status_t parse_command_line(int argc, char *argv[], uint16_t *port, char **script,
+	int *first_arg);
 
 /**
   * actually begins the user's session by reading initial response, logging in,
@@ -56,6 +198,35 @@ status_t parse_command_line(int argc, char *argv[], uint16_t *port);
   * @param session - the user's session object, containing necessary info
   */
 status_t do_session(session_t *session);
+
+/**
+  * runs a single command line typed by the user or read from the script
+  * @param session - the user's session object
+  * @param args    - the command line, split into words
+  * @param length  - the length of the args array
+  * @param quit    - out param; set if the command ends the session
+  */
+status_t run_command(session_t *session, string_t *args, size_t length, uint8_t *quit);
+
+/**
+  * runs the commands in the session's -b script to the end, or until a fatal
+  * error. Runs of commands whose replies nothing else waits on are sent all at
+  * once, PIPELINE_DEPTH at a time at most, and only then are the replies read.
+  * @param session - the user's session object
+  */
+status_t run_script(session_t *session);
+
+/**
+  * sends every command waiting in pipeline in one go, then reads and checks
+  * their replies in order
+  * @param session  - the user's session object
+  * @param pipeline - the commands waiting to be sent, as they go on the wire
+  * @param waiting  - what each waiting command is
+  * @param count    - in/out param; how many commands are waiting, which is 0
+  *		afterward
+  */
+status_t flush_pipeline(session_t *session, string_t *pipeline,
+	const pipelined_command_t **waiting, size_t *count);
 //----------------------------END SETUP FUNCTIONS-------------------------------
 
 //-----------------------------COMMAND FUNCTIONS-------------------------------
@@ -115,6 +286,102 @@ status_t send_list_command(session_t *session, string_t *args);
   */
 status_t retr_command(session_t *session, string_t *args, size_t length);
 
+/**
+  * fetches a file with RETR into a local file, writing it as it arrives
+  * @param session  - the current session's object
+  * @param file     - the name of the file on the server
+  * @param new_name - the name of the local file
+  * @param size     - the size of the file, to preallocate, or -1 if unknown
+  * @param received - out param; how much was written, if not NULL
+  */
+status_t retr_file(session_t *session, string_t *file, char *new_name, off_t size,
+	off_t *received);
+
+/**
+  * handles fetch [-p N] list_file: downloads every file named in the local file
+  * list_file, one per line as "server_file [local file]", using a pool of N
+  * logged-in sessions which each take the next file off a shared queue as they
+  * finish the last, and prints throughput and latency at the end
+  * @param session - the current session's object
+  * @param args    - the arguments the user passed on the command line
+  * @param length  - the length of the args array
+  */
+status_t fetch_command(session_t *session, string_t *args, size_t length);
+
+/**
+  * thread function for one session of the fetch pool
+  * @param arg - the fetch_worker_t
+  */
+void *fetch_thread(void *arg);
+
+/**
+  * prints how a fetch went: how many files came through, the throughput, and
+  * the spread of the time each file took
+  * @param queue         - the files that were fetched
+  * @param sessions      - how many sessions were used
+  * @param lost_sessions - how many sessions died on the way
+  * @param seconds       - how long the whole fetch took
+  */
+void print_fetch_summary(fetch_queue_t *queue, int sessions, int lost_sessions,
+	double seconds);
+
+/**
+  * qsort comparison function for doubles, smallest first
+  */
+int compare_doubles(const void *a, const void *b);
+
+/**
+  * connects another session to the server like session, logs it in with the
+  * details session was logged in with, and moves it to directory. The new
+  * connection is in MODE S whatever the user's session is in, since get -n
+  * writes what it receives straight into the file
+  * @param session   - in/out param; a copy of the user's session, which gets
+  *		its own command connection
+  * @param directory - the directory to CWD to, or NULL
+  */
+status_t open_extra_session(session_t *session, string_t *directory);
+
+/**
+  * handles get -n N: splits the download into N ranges fetched at once, each on
+  * its own control and data connection using REST, and reports the throughput.
+  * Falls back to a single stream when the server can't give the size or
+  * doesn't support REST.
+  * @param session  - the current session's object
+  * @param args     - the arguments after the -n, so that args[1] is the file
+  *		and args[2] the optional local name
+  * @param length   - the length of the args array
+  * @param segments - how many connections to use
+  */
+status_t segmented_retr_command(session_t *session, string_t *args, size_t length,
+	int segments);
+
+/**
+  * thread function fetching one segment_t of a segmented download
+  * @param arg - the segment_t
+  */
+void *segment_thread(void *arg);
+
+/**
+  * connects, logs in and fetches the range given by segment, writing it into
+  * the segment's file at the right offsets
+  * @param segment - the segment to fetch
+  */
+status_t download_segment(segment_t *segment);
+
+/**
+  * sends a REST command, so that the next RETR starts at offset
+  * @param session - the current session to use
+  * @param offset  - the offset to restart at
+  */
+status_t rest_command(session_t *session, off_t offset);
+
+/**
+  * finds out the current directory on the server with a PWD
+  * @param session   - the current session to use
+  * @param directory - out param; the directory. Must be initialized
+  */
+status_t get_directory(session_t *session, string_t *directory);
+
 /**
   * actually sends the RETR command itself within the current session, using the
   * arguments args
@@ -124,14 +391,14 @@ status_t retr_command(session_t *session, string_t *args, size_t length);
 status_t send_retr_command(session_t *session, string_t *args);
 
 /**
-  * given the command line arguments args, with length length, writes the data
-  * in data to either the file name provided in args (args[2]) or the file name retrieved
-  * from the server, held in args (args[1])
-  * @param args   - the args parsed from the command line
-  * @param length - the length of the args array
-  * @param data   - the data to write to the file
+  * asks the server for the size of a file with SIZE, so that a download can be
+  * allocated up front. A server that can't say isn't an error.
+  * @param session - the current session to use
+  * @param args    - the name of the file on the server
+  * @param size    - out param; the size of the file, if known
+  * @param known   - out param; whether the server gave the size
   */
-status_t retr_write_file(string_t *args, size_t length, string_t *data);
+status_t size_command(session_t *session, string_t *args, off_t *size, uint8_t *known);
 
 /**
   * sends a PWD command to the server in the current session
@@ -186,6 +453,15 @@ status_t passive_command(session_t *session);
   */
 status_t extended_command(session_t *session);
 
+/**
+  * switches MODE Z compression of transfers on or off at the server, or, if a
+  * level is given, switches it on at that level with OPTS MODE Z LEVEL
+  * @param session - the session in which to send the MODE command
+  * @param args    - the command line argument array
+  * @param length  - the length of the args array
+  */
+status_t compress_command(session_t *session, string_t *args, size_t length);
+
 /**
   *
   */
@@ -226,17 +502,71 @@ status_t send_command_read_response(session_t *session, command_t *command, stri
 /**
   * after reading the first line, will continue reading other lines of a
   * multi-line response from the server
-  * @param socket   - socket from which to read
+  * @param reader   - the buffered reader for the socket from which to read
   * @param response - out param; the string into which to read. Must be initialized
   */
-status_t read_remaining_lines(int socket, string_t *response);
+status_t read_remaining_lines(line_reader_t *reader, string_t *response);
 
 /**
   * reads from the given socket utnil EOF is reached (i.e., read returns 0)
   * @param socket - socket from which to read
   * @param response - out param; the string into which to read. Must be initialized
+  * @param compressed - whether the data is a MODE Z stream that has to be
+  *		inflated as it comes in
+  */
+status_t read_until_eof(int socket, string_t *response, uint8_t compressed);
+
+/**
+  * reads from the given socket until EOF, handing the data to sink as it
+  * arrives, and inflating it first if it's compressed
+  * @param socket     - socket from which to read
+  * @param compressed - whether the data is a MODE Z stream
+  * @param sink       - where the data goes
+  * @param target     - the target passed to sink
+  */
+status_t receive_data(int socket, uint8_t compressed, data_sink_t sink, void *target);
+
+/**
+  * splices everything from the given socket until EOF into the file fd,
+  * without bringing it into the program
+  * @param socket - socket from which to read
+  * @param fd     - file to which to write, at its current position
+  */
+status_t receive_file(int socket, int fd);
+
+/**
+  * data_sink_t that appends the data onto the string_t target
+  */
+status_t append_to_string(void *target, char *data, size_t length);
+
+/**
+  * data_sink_t that writes all of the data to the file descriptor pointed to by
+  * target, carrying on after short writes
+  */
+status_t write_to_file(void *target, char *data, size_t length);
+
+/**
+  * reads up to length bytes from the given socket and writes them into the file
+  * fd starting at offset, stopping early only at EOF
+  * @param socket   - socket from which to read
+  * @param fd       - file to which to write
+  * @param offset   - where in the file the data goes
+  * @param length   - how much to read
+  * @param received - out param; how much has arrived, kept up to date as it goes
+  */
+status_t receive_range(int socket, int fd, off_t offset, off_t length, off_t *received);
+/**
+  * inflates a piece of a MODE Z stream, handing INFLATE_CHUNK_SIZE bytes of
+  * output at a time to sink
+  * @param stream   - the zlib stream the data belongs to
+  * @param data     - the compressed data
+  * @param length   - the length of data
+  * @param sink     - where the inflated data goes
+  * @param target   - the target passed to sink
+  * @param finished - out param; set once the end of the stream has been seen
   */
-status_t read_until_eof(int socket, string_t *response);
+status_t inflate_data(z_stream *stream, char *data, size_t length, data_sink_t sink,
+	void *target, uint8_t *finished);
 //----------------------------END SOCKET FUNCTIONS------------------------------
 
 //-----------------------------HELPER FUNCTIONS--------------------------------
@@ -264,31 +594,49 @@ int main(int argc, char *argv[])
 {
 	status_t error;
 	uint16_t port;
-	error = parse_command_line(argc, argv, &port);
+	char *script;
+	int first_arg;
+	error = parse_command_line(argc, argv, &port, &script, &first_arg);
 	if (error)
 	{
 		goto exit0;
 	}
+	char *host = argv[first_arg];
 
 	session_t session;
-	error = make_connection(&session.command_socket, argv[1], port);
+	session.input = stdin;
+	if (script != NULL)
+	{
+		session.input = fopen(script, "r");
+		if (session.input == NULL)
+		{
+			printf("Could not open the script %s.\n", script);
+			error = FILE_OPEN_ERROR;
+			goto exit0;
+		}
+	}
+
+	error = make_connection(&session.command_socket, host, port);
 	if (error)
 	{
 		printf("Could not connect to the specified host.\n");
-		goto exit0;
+		goto exit1;
 	}
+	line_reader_initialize(&session.reader, session.command_socket);
 
-	error = open_log_file(&session.log, argv[2], 0);
+	//get -n and fetch run sessions on threads of their own, all logging here
+	//at once, so entries go through the ring buffer to keep them whole
+	error = open_log_file(&session.log, argv[first_arg + 1], 1);
 	if (error)
 	{
-		goto exit1;
+		goto exit2;
 	}
 
 	error = get_ips(&session.ip4, &session.ip6);
 	if (error)
 	{
 		printf("Could not get IP information.\n");
-		goto exit2;
+		goto exit3;
 	}
 
 	//try to default to non-passive mode (i.e., use PORT), but if have neither
@@ -318,31 +666,57 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	session.compress_mode = 0;
+	session.host = host;
+	session.port = port;
+	session.username = NULL;
+	session.password = NULL;
+	session.quiet = 0;
+
 	//begin the session
 	error = do_session(&session);
 	if (error)
 	{
-		goto exit3;
+		goto exit4;
 	}
 
 	//error handling using gotos and exit labels and cleanup. At the end, return
 	//the error from main for the shell to inspect
-exit3:
+exit4:
+	free(session.username);
+	free(session.password);
 	free(session.ip4);
 	free(session.ip6);
-exit2:
+exit3:
 	close_log_file(&session.log);
-exit1:
+exit2:
 	close(session.command_socket);
+exit1:
+	if (session.input != stdin)
+	{
+		fclose(session.input);
+	}
 exit0:
 	return error;
 }
 
-status_t parse_command_line(int argc, char *argv[], uint16_t *port)
+status_t parse_command_line(int argc, char *argv[], uint16_t *port, char **script,
+	int *first_arg)
 {
+	*script = NULL;
+	*first_arg = 1;
+	if (argc > 2 && bool_strcmp(argv[1], "-b"))
+	{
+		*script = argv[2];
+		*first_arg = 3;
+	}
+
+	//Everything after the options is as if they weren't there
+	argc -= *first_arg - 1;
+	argv += *first_arg - 1;
 	if (argc < MINIMUM_ARGC)
 	{
-		printf("Usage: ftpclient server logfile [port]\n");
+		printf("Usage: ftpclient [-b script] server logfile [port]\n");
 		return BAD_COMMAND_LINE;
 	}
 
@@ -382,6 +756,12 @@ status_t do_session(session_t *session)
 		goto exit0;
 	}
 
+	if (session->input != stdin)
+	{
+		error = run_script(session);
+		goto exit0;
+	}
+
 	string_t line;
 	string_initialize(&line);
 	uint8_t quit = 0;
@@ -397,51 +777,7 @@ status_t do_session(session_t *session)
 		string_t *args = string_split_skip_consecutive(&line, ' ',
 			&array_length, 1);
 
-		//Now determine the command type and execute it
-		char *c_str = string_c_str(args + 0);
-		if (bool_strcmp(c_str, "cd"))
-		{
-			error = cwd_command(session, args, array_length);
-		}
-		else if (bool_strcmp(c_str, "cdup"))
-		{
-			error = cdup_command(session);
-		}
-		else if (bool_strcmp(c_str, "ls"))
-		{
-			error = list_command(session, args, array_length);
-		}
-		else if (bool_strcmp(c_str, "get"))
-		{
-			error = retr_command(session, args, array_length);
-		}
-		else if (bool_strcmp(c_str, "pwd"))
-		{
-			error = pwd_command(session);
-		}
-		else if (bool_strcmp(c_str, "help"))
-		{
-			error = help_command(session, args, array_length);
-		}
-		else if (bool_strcmp(c_str, "quit"))
-		{
-			error = quit_command(session);
-			quit = 1;
-		}
-		else if (bool_strcmp(c_str, "passive"))
-		{
-			error = passive_command(session);
-		}
-		else if (bool_strcmp(c_str, "extended"))
-		{
-			error = extended_command(session);
-		}
-		else if (c_str[0] != '\0')
-		{
-			//'\0' check so user can enter empty lines
-			printf("Unrecognized command.\n");
-			error = NON_FATAL_ERROR;
-		}
+		error = run_command(session, args, array_length, &quit);
 
 		size_t i = 0;
 		for (i = 0; i < array_length; i++)
@@ -463,111 +799,366 @@ exit0:
 	return error;
 }
 
-status_t read_initial_response(session_t *session)
+status_t run_command(session_t *session, string_t *args, size_t length, uint8_t *quit)
 {
-	status_t error;
-
-	string_t response;
-	string_initialize(&response);
+	status_t error = SUCCESS;
 
-	//Read the entirety of the response
-	error = read_entire_response(session, &response);
-	if (error)
+	//Now determine the command type and execute it
+	char *c_str = string_c_str(args + 0);
+	if (bool_strcmp(c_str, "cd"))
 	{
-		goto exit0;
+		error = cwd_command(session, args, length);
 	}
-
-	//If the response is an intermediary one, then read another response
-	if (matches_code(&response, SERVICE_READY_IN))
+	else if (bool_strcmp(c_str, "cdup"))
 	{
-		char_vector_clear(&response);
-		error = read_entire_response(session, &response);
-		if (error)
-		{
-			goto exit0;
-		}
+		error = cdup_command(session);
 	}
-
-	//If the service is not ready, then need to indicate this
-	if (!matches_code(&response, SERVICE_READY))
+	else if (bool_strcmp(c_str, "ls"))
 	{
-		error = ACCEPTING_ERROR;
-		goto exit0;
+		error = list_command(session, args, length);
 	}
-
-exit0:
-	string_uninitialize(&response);
-	return error;
-}
-
-status_t log_in(session_t *session)
-{
-	status_t error;
-
-	string_t line, response;
-	string_initialize(&line);
-	string_initialize(&response);
-	
-	printf("Username: ");
-	string_getline(&line, stdin);
-	MAKE_COMMAND_FROM_LITERAL(username_command, "USER", &line);
-	error = send_command_read_response(session, &username_command, &response);
-	if (error)
+	else if (bool_strcmp(c_str, "get"))
 	{
-		goto exit0;
+		error = retr_command(session, args, length);
 	}
-
-	//If the response informs us that a password is required, then retrieve that
-	//from the user and send it
-	if (matches_code(&response, NEED_PASSWORD))
+	else if (bool_strcmp(c_str, "fetch"))
 	{
-		printf("Password: ");
-		string_getline(&line, stdin);
-		char_vector_clear(&response);
-		MAKE_COMMAND_FROM_LITERAL(password_command, "PASS", &line);
-		error = send_command_read_response(session, &password_command, &response);
-		if (error)
+		error = fetch_command(session, args, length);
+	}
+	else if (bool_strcmp(c_str, "size"))
+	{
+		if (length <= 1)
 		{
-			goto exit0;
+			printf("Please supply a file to get the size of.\n");
+			return NON_FATAL_ERROR;
 		}
-		
-		//If a password isn't needed, then continue on
-		if (matches_code(&response, NOT_IMPLEMENTED_SUPERFLUOUS))
+
+		off_t size;
+		uint8_t size_known;
+		error = size_command(session, args + 1, &size, &size_known);
+		if (!error && !size_known)
 		{
-			goto exit0;
+			error = NON_FATAL_ERROR;
 		}
 	}
-
-	//If after submitting the password we're still not logged in, return an
-	//error.
-	if (!matches_code(&response, USER_LOGGED_IN))
+	else if (bool_strcmp(c_str, "pwd"))
 	{
-		error = LOG_IN_ERROR;
-		goto exit0;
+		error = pwd_command(session);
+	}
+	else if (bool_strcmp(c_str, "help"))
+	{
+		error = help_command(session, args, length);
+	}
+	else if (bool_strcmp(c_str, "quit"))
+	{
+		error = quit_command(session);
+		*quit = 1;
+	}
+	else if (bool_strcmp(c_str, "passive"))
+	{
+		error = passive_command(session);
+	}
+	else if (bool_strcmp(c_str, "extended"))
+	{
+		error = extended_command(session);
+	}
+	else if (bool_strcmp(c_str, "compress"))
+	{
+		error = compress_command(session, args, length);
+	}
+	else if (c_str[0] != '\0')
+	{
+		//'\0' check so user can enter empty lines
+		printf("Unrecognized command.\n");
+		error = NON_FATAL_ERROR;
 	}
 
-exit0:
-	string_uninitialize(&response);
-	string_uninitialize(&line);
 	return error;
 }
 
-status_t cwd_command(session_t *session, string_t *args, size_t array_length)
+status_t run_script(session_t *session)
 {
 	status_t error = SUCCESS;
-	if (array_length < 2)
-	{
-		printf("Please include the directory to which to switch.\n");
-		goto exit0;
-	}
-
-	string_t response;
-	string_initialize(&response);
 
-	MAKE_COMMAND_FROM_LITERAL(command, "CWD", args + 1);
+	string_t line;
+	string_initialize(&line);
+	string_t pipeline;
+	string_initialize(&pipeline);
+	const pipelined_command_t *waiting[PIPELINE_DEPTH];
+	size_t count = 0;
 
-	error = send_command_read_response(session, &command, &response);
-	if (error)
+	uint8_t quit = 0;
+	while (!quit && (!error || error == NON_FATAL_ERROR))
+	{
+		string_getline(&line, session->input);
+		string_trim(&line);
+		if (feof(session->input) && string_length(&line) == 0)
+		{
+			break;
+		}
+
+		size_t array_length;
+		string_t *args = string_split_skip_consecutive(&line, ' ',
+			&array_length, 1);
+
+		const pipelined_command_t *pipelined = NULL;
+		size_t i;
+		for (i = 0; i < sizeof pipelined_commands / sizeof *pipelined_commands; i++)
+		{
+			if (bool_strcmp(string_c_str(args + 0), pipelined_commands[i].name) &&
+				array_length == 1u + pipelined_commands[i].takes_argument)
+			{
+				pipelined = pipelined_commands + i;
+				break;
+			}
+		}
+
+		if (string_length(&line) > 0)
+		{
+			printf("ftp> %s\n", string_c_str(&line));
+		}
+
+		if (pipelined != NULL)
+		{
+			if (count == PIPELINE_DEPTH)
+			{
+				error = flush_pipeline(session, &pipeline, waiting, &count);
+			}
+
+			//Queue the command up instead of waiting for each reply in turn
+			string_concatenate_char_array(&pipeline, pipelined->verb);
+			if (pipelined->takes_argument)
+			{
+				char_vector_push_back(&pipeline, ' ');
+				string_concatenate(&pipeline, args + 1);
+			}
+			string_concatenate_char_array(&pipeline, "\r\n");
+			waiting[count++] = pipelined;
+		}
+		else
+		{
+			//Anything else might depend on what's in flight, so that all has to
+			//be answered first
+			error = flush_pipeline(session, &pipeline, waiting, &count);
+			if (!error || error == NON_FATAL_ERROR)
+			{
+				error = run_command(session, args, array_length, &quit);
+			}
+		}
+
+		for (i = 0; i < array_length; i++)
+		{
+			string_uninitialize(args + i);
+		}
+		free(args);
+	}
+
+	if (!error || error == NON_FATAL_ERROR)
+	{
+		error = flush_pipeline(session, &pipeline, waiting, &count);
+	}
+
+	if (!quit && (!error || error == NON_FATAL_ERROR))
+	{
+		error = quit_command(session);
+	}
+
+	//A script only fails on errors that end the session; a command that didn't
+	//work has already said so
+	if (error == NON_FATAL_ERROR)
+	{
+		error = SUCCESS;
+	}
+	else if (error)
+	{
+		printf("Fatal error. Exiting.\n");
+	}
+
+	string_uninitialize(&pipeline);
+	string_uninitialize(&line);
+	return error;
+}
+
+status_t flush_pipeline(session_t *session, string_t *pipeline,
+	const pipelined_command_t **waiting, size_t *count)
+{
+	status_t error = SUCCESS;
+	if (*count == 0)
+	{
+		goto exit0;
+	}
+
+	string_t response;
+	string_initialize(&response);
+
+	error = send_string(session->command_socket, pipeline, &session->log);
+	if (error)
+	{
+		goto exit1;
+	}
+
+	uint8_t failed = 0;
+	size_t i;
+	for (i = 0; i < *count; i++)
+	{
+		char_vector_clear(&response);
+		error = read_entire_response(session, &response);
+		if (error)
+		{
+			goto exit1;
+		}
+
+		if (matches_code(&response, NOT_LOGGED_IN))
+		{
+			error = LOG_IN_ERROR;
+			goto exit1;
+		}
+
+		//Like the same commands run one at a time, failing isn't fatal
+		if (!matches_code(&response, waiting[i]->success))
+		{
+			failed = 1;
+		}
+	}
+
+	error = failed ? NON_FATAL_ERROR : SUCCESS;
+
+exit1:
+	string_uninitialize(&response);
+	char_vector_clear(pipeline);
+	*count = 0;
+exit0:
+	return error;
+}
+
+status_t read_initial_response(session_t *session)
+{
+	status_t error;
+
+	string_t response;
+	string_initialize(&response);
+
+	//Read the entirety of the response
+	error = read_entire_response(session, &response);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//If the response is an intermediary one, then read another response
+	if (matches_code(&response, SERVICE_READY_IN))
+	{
+		char_vector_clear(&response);
+		error = read_entire_response(session, &response);
+		if (error)
+		{
+			goto exit0;
+		}
+	}
+
+	//If the service is not ready, then need to indicate this
+	if (!matches_code(&response, SERVICE_READY))
+	{
+		error = ACCEPTING_ERROR;
+		goto exit0;
+	}
+
+exit0:
+	string_uninitialize(&response);
+	return error;
+}
+
+status_t log_in(session_t *session)
+{
+	status_t error;
+
+	string_t line, response;
+	string_initialize(&line);
+	string_initialize(&response);
+	
+	//The details are kept so that get -n can log in its other connections
+	if (session->username == NULL)
+	{
+		if (session->input == stdin)
+		{
+			printf("Username: ");
+		}
+		string_getline(&line, session->input);
+		session->username = strdup(string_c_str(&line));
+	}
+	else
+	{
+		string_assign_from_char_array(&line, session->username);
+	}
+	MAKE_COMMAND_FROM_LITERAL(username_command, "USER", &line);
+	error = send_command_read_response(session, &username_command, &response);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//If the response informs us that a password is required, then retrieve that
+	//from the user and send it
+	if (matches_code(&response, NEED_PASSWORD))
+	{
+		if (session->password == NULL)
+		{
+			if (session->input == stdin)
+			{
+				printf("Password: ");
+			}
+			string_getline(&line, session->input);
+			session->password = strdup(string_c_str(&line));
+		}
+		else
+		{
+			string_assign_from_char_array(&line, session->password);
+		}
+		char_vector_clear(&response);
+		MAKE_COMMAND_FROM_LITERAL(password_command, "PASS", &line);
+		error = send_command_read_response(session, &password_command, &response);
+		if (error)
+		{
+			goto exit0;
+		}
+		
+		//If a password isn't needed, then continue on
+		if (matches_code(&response, NOT_IMPLEMENTED_SUPERFLUOUS))
+		{
+			goto exit0;
+		}
+	}
+
+	//If after submitting the password we're still not logged in, return an
+	//error.
+	if (!matches_code(&response, USER_LOGGED_IN))
+	{
+		error = LOG_IN_ERROR;
+		goto exit0;
+	}
+
+exit0:
+	string_uninitialize(&response);
+	string_uninitialize(&line);
+	return error;
+}
+
+status_t cwd_command(session_t *session, string_t *args, size_t array_length)
+{
+	status_t error = SUCCESS;
+	if (array_length < 2)
+	{
+		printf("Please include the directory to which to switch.\n");
+		goto exit0;
+	}
+
+	string_t response;
+	string_initialize(&response);
+
+	MAKE_COMMAND_FROM_LITERAL(command, "CWD", args + 1);
+
+	error = send_command_read_response(session, &command, &response);
+	if (error)
 	{
 		goto exit1;
 	}
@@ -659,7 +1250,7 @@ status_t list_command(session_t *session, string_t *args, size_t length)
 	//read the data itself
 	string_t data;
 	string_initialize(&data);
-	error = read_until_eof(data_socket, &data);
+	error = read_until_eof(data_socket, &data, session->compress_mode);
 	if (error)
 	{
 		goto exit1;
@@ -703,7 +1294,736 @@ status_t send_list_command(session_t *session, string_t *args)
 	string_t response;
 	string_initialize(&response);
 
-	MAKE_COMMAND_FROM_LITERAL(command, "LIST", args);
+	MAKE_COMMAND_FROM_LITERAL(command, "LIST", args);
+
+	error = send_command_read_response(session, &command, &response);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//If not logged in, return an error to the caller to let them know.
+	if (matches_code(&response, NOT_LOGGED_IN))
+	{
+		error = LOG_IN_ERROR;
+		goto exit0;
+	}
+
+	//Otherwise, while not matching either of these means the command failed,
+	//the error is non-fatal (i.e., the program can keep executing), so indicate
+	//that
+	if (!matches_code(&response, TRANSFER_STARTING) &&
+		!matches_code(&response, FILE_STATUS_OKAY))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+exit0:
+	string_uninitialize(&response);
+	return error;
+}
+
+status_t retr_command(session_t *session, string_t *args, size_t length)
+{
+	status_t error = SUCCESS;
+
+	if (length <= 1)
+	{
+		printf("Please supply a file to get.\n");
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+	if (bool_strcmp(string_c_str(args + 1), "-n"))
+	{
+		int segments = length > 3 ? atoi(string_c_str(args + 2)) : 0;
+		if (segments < 1 || segments > MAX_SEGMENTS)
+		{
+			printf("Usage: get -n N server_file [local file], with N from 1 to %d.\n",
+				MAX_SEGMENTS);
+			error = NON_FATAL_ERROR;
+			goto exit0;
+		}
+
+		//Shift the arguments along so that the file is in args[1] again
+		error = segmented_retr_command(session, args + 2, length - 2, segments);
+		goto exit0;
+	}
+
+	//if the user supplied a third argument, make that the name of the output
+	//file; otherwise, default to the name of the server file
+	char *new_name = string_c_str(length > 2 ? args + 2 : args + 1);
+
+	off_t size;
+	uint8_t size_known;
+	error = size_command(session, args + 1, &size, &size_known);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	error = retr_file(session, args + 1, new_name, size_known ? size : -1, NULL);
+
+exit0:
+	return error;
+}
+
+status_t retr_file(session_t *session, string_t *file, char *new_name, off_t size,
+	off_t *received)
+{
+	char closing_message[] = "Closing data socket.\n";
+	status_t error = SUCCESS;
+
+	int data_socket; 
+	if (!session->passive_mode)
+	{
+		error = get_data_socket_active(session, &data_socket, send_retr_command,
+				file);
+	}
+	else
+	{
+		error = get_data_socket_passive(session, &data_socket,
+			send_retr_command, file);
+	}
+
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//The file is written as the data arrives, so that downloads don't have to
+	//fit in memory
+	int new_fd = open(new_name, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (new_fd < 0)
+	{
+		printf("Could not open %s for writing.\n", new_name);
+		error = NON_FATAL_ERROR;
+	}
+	else if (size > 0 && fallocate(new_fd, 0, 0, size) < 0 && errno == ENOSPC)
+	{
+		//Other failures just mean the file system can't preallocate
+		printf("Not enough space for %s.\n", new_name);
+		error = NON_FATAL_ERROR;
+	}
+	else if (session->compress_mode)
+	{
+		error = receive_data(data_socket, 1, write_to_file, &new_fd);
+	}
+	else
+	{
+		error = receive_file(data_socket, new_fd);
+	}
+
+	if (new_fd >= 0)
+	{
+		//Trim off whatever was preallocated but never arrived
+		off_t written = lseek(new_fd, 0, SEEK_CUR);
+		if (size > 0)
+		{
+			ftruncate(new_fd, written);
+		}
+		close(new_fd);
+
+		if (received != NULL)
+		{
+			*received = written;
+		}
+	}
+
+	if (error == FILE_WRITE_ERROR)
+	{
+		//e.g., the disk filled up; the session itself is still fine
+		printf("Could not write to %s.\n", new_name);
+		error = NON_FATAL_ERROR;
+	}
+
+	if (error && error != NON_FATAL_ERROR)
+	{
+		goto exit1;
+	}
+
+	//If the download was given up on, hang up so that the server finishes the
+	//transfer off, and then collect its reply like normal
+	shutdown(data_socket, SHUT_RDWR);
+
+	string_t response;
+	string_initialize(&response);
+	status_t response_error = read_entire_response(session, &response);
+	if (response_error)
+	{
+		error = response_error;
+		goto exit2;
+	}
+
+	if (!matches_code(&response, CONNECTION_OPEN_NO_TRANSFER) &&
+		!matches_code(&response, CLOSING_DATA_CONNECTION))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit2;
+	}
+
+exit2:
+	string_uninitialize(&response);
+exit1:
+	write_log(&session->log, closing_message , sizeof closing_message - 1);
+	close(data_socket);
+exit0:
+	return error;
+}
+
+status_t segmented_retr_command(session_t *session, string_t *args, size_t length,
+	int segments)
+{
+	status_t error = SUCCESS;
+	char *new_name = string_c_str(length > 2 ? args + 2 : args + 1);
+	if (segments == 1)
+	{
+		error = retr_command(session, args, length);
+		goto exit0;
+	}
+
+	off_t size;
+	uint8_t size_known;
+	error = size_command(session, args + 1, &size, &size_known);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	if (!size_known || size < segments)
+	{
+		printf("The file's size isn't known or is too small to split, so using one connection.\n");
+		error = retr_command(session, args, length);
+		goto exit0;
+	}
+
+	//Ranges after the first need REST; RETR would use it up if it were left
+	//over, but it would restart at 0 anyway
+	error = rest_command(session, 0);
+	if (error == NON_FATAL_ERROR)
+	{
+		printf("The server doesn't support REST, so using one connection.\n");
+		error = retr_command(session, args, length);
+		goto exit0;
+	}
+	else if (error)
+	{
+		goto exit0;
+	}
+
+	string_t directory;
+	string_initialize(&directory);
+	error = get_directory(session, &directory);
+	if (error && error != NON_FATAL_ERROR)
+	{
+		goto exit1;
+	}
+	uint8_t directory_known = !error;
+	error = SUCCESS;
+
+	int new_fd = open(new_name, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (new_fd < 0)
+	{
+		printf("Could not open %s for writing.\n", new_name);
+		error = NON_FATAL_ERROR;
+		goto exit1;
+	}
+
+	if (fallocate(new_fd, 0, 0, size) < 0 && errno == ENOSPC)
+	{
+		printf("Not enough space for %s.\n", new_name);
+		error = NON_FATAL_ERROR;
+		goto exit2;
+	}
+
+	segment_t *segment_array = calloc(segments, sizeof *segment_array);
+	if (segment_array == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit2;
+	}
+
+	struct timespec start_time, end_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	off_t range = size / segments;
+	int started;
+	for (started = 0; started < segments; started++)
+	{
+		segment_t *segment = segment_array + started;
+		segment->session = *session;
+		segment->session.quiet = 1;
+		segment->file = args + 1;
+		segment->directory = directory_known ? &directory : NULL;
+		segment->fd = new_fd;
+		segment->start = started * range;
+		segment->last = started == segments - 1;
+		segment->length = segment->last ? size - segment->start : range;
+		if (pthread_create(&segment->thread, NULL, segment_thread, segment) != 0)
+		{
+			error = PTHREAD_CREATE_ERROR;
+			break;
+		}
+	}
+
+	off_t received = 0;
+	int i;
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(segment_array[i].thread, NULL);
+		received += segment_array[i].received;
+		if (segment_array[i].error && !error)
+		{
+			printf("Segment %d of %s failed.\n", i + 1, new_name);
+			error = segment_array[i].error;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	free(segment_array);
+
+	if (error)
+	{
+		printf("Downloading %s again over one connection.\n", new_name);
+		close(new_fd);
+		string_uninitialize(&directory);
+		return retr_command(session, args, length);
+	}
+
+	double seconds = (end_time.tv_sec - start_time.tv_sec) +
+		(end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+	printf("Received %lld bytes in %.3f seconds over %d connections (%.2f MB/s).\n",
+		(long long) received, seconds, segments,
+		seconds > 0 ? received / seconds / (1024 * 1024) : 0.0);
+
+exit2:
+	close(new_fd);
+exit1:
+	string_uninitialize(&directory);
+exit0:
+	return error;
+}
+
+void *segment_thread(void *arg)
+{
+	segment_t *segment = arg;
+	segment->error = download_segment(segment);
+	return NULL;
+}
+
+status_t download_segment(segment_t *segment)
+{
+	char closing_message[] = "Closing data socket.\n";
+	status_t error;
+	session_t *session = &segment->session;
+
+	error = open_extra_session(session, segment->directory);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	if (segment->start > 0)
+	{
+		error = rest_command(session, segment->start);
+		if (error)
+		{
+			goto exit1;
+		}
+	}
+
+	int data_socket;
+	if (!session->passive_mode)
+	{
+		error = get_data_socket_active(session, &data_socket, send_retr_command,
+			segment->file);
+	}
+	else
+	{
+		error = get_data_socket_passive(session, &data_socket, send_retr_command,
+			segment->file);
+	}
+
+	if (error)
+	{
+		goto exit1;
+	}
+
+	error = receive_range(data_socket, segment->fd, segment->start, segment->length,
+		&segment->received);
+	if (!error && segment->received < segment->length)
+	{
+		//The server hung up before the end of the range
+		error = SOCKET_READ_ERROR;
+	}
+
+	//The server will go on sending past the end of the range, so hang up on it
+	write_log(&session->log, closing_message, sizeof closing_message - 1);
+	close(data_socket);
+	if (error || !segment->last)
+	{
+		goto exit1;
+	}
+
+	string_t response;
+	string_initialize(&response);
+	error = read_entire_response(session, &response);
+	if (!error && !matches_code(&response, CONNECTION_OPEN_NO_TRANSFER) &&
+		!matches_code(&response, CLOSING_DATA_CONNECTION))
+	{
+		error = NON_FATAL_ERROR;
+	}
+	string_uninitialize(&response);
+
+exit1:
+	close(session->command_socket);
+exit0:
+	return error;
+}
+
+status_t open_extra_session(session_t *session, string_t *directory)
+{
+	status_t error;
+
+	error = make_connection(&session->command_socket, session->host, session->port);
+	if (error)
+	{
+		goto exit0;
+	}
+	line_reader_initialize(&session->reader, session->command_socket);
+	//The server starts every connection uncompressed, whatever MODE Z the
+	//user's own connection has been put in
+	session->compress_mode = 0;
+
+	error = read_initial_response(session);
+	if (error)
+	{
+		goto exit_error1;
+	}
+
+	error = log_in(session);
+	if (error)
+	{
+		goto exit_error1;
+	}
+
+	if (directory != NULL)
+	{
+		//cwd_command takes the directory from the second argument
+		string_t cwd_args[2];
+		cwd_args[1] = *directory;
+		error = cwd_command(session, cwd_args, 2);
+		if (error)
+		{
+			goto exit_error1;
+		}
+	}
+
+	//equivalent to return SUCCESS (and keep the connection)
+	goto exit0;
+
+exit_error1:
+	close(session->command_socket);
+exit0:
+	return error;
+}
+
+status_t fetch_command(session_t *session, string_t *args, size_t length)
+{
+	status_t error = SUCCESS;
+
+	int sessions = DEFAULT_FETCH_SESSIONS;
+	string_t *list_arg = args + 1;
+	if (length > 1 && bool_strcmp(string_c_str(args + 1), "-p"))
+	{
+		sessions = length > 2 ? atoi(string_c_str(args + 2)) : 0;
+		list_arg = args + 3;
+		length -= 2;
+	}
+
+	if (length != 2 || sessions < 1 || sessions > MAX_FETCH_SESSIONS)
+	{
+		printf("Usage: fetch [-p N] list_file, with N from 1 to %d.\n", MAX_FETCH_SESSIONS);
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+	FILE *list = fopen(string_c_str(list_arg), "r");
+	if (list == NULL)
+	{
+		printf("Could not open %s.\n", string_c_str(list_arg));
+		error = NON_FATAL_ERROR;
+		goto exit0;
+	}
+
+	fetch_queue_t queue;
+	memset(&queue, 0, sizeof queue);
+	string_t line;
+	string_initialize(&line);
+	while (1)
+	{
+		string_getline(&line, list);
+		string_trim(&line);
+		if (feof(list) && string_length(&line) == 0)
+		{
+			break;
+		}
+
+		if (string_length(&line) == 0)
+		{
+			continue;
+		}
+
+		if (queue.count == queue.capacity)
+		{
+			size_t capacity = queue.capacity == 0 ? 64 : queue.capacity * 2;
+			fetch_item_t *items = realloc(queue.items, capacity * sizeof *items);
+			if (items == NULL)
+			{
+				error = MEMORY_ERROR;
+				goto exit2;
+			}
+			queue.items = items;
+			queue.capacity = capacity;
+		}
+
+		fetch_item_t *item = queue.items + queue.count++;
+		item->args = string_split_skip_consecutive(&line, ' ', &item->length, 1);
+		item->latency = -1;
+		item->received = 0;
+	}
+
+	if (queue.count == 0)
+	{
+		printf("%s names no files.\n", string_c_str(list_arg));
+		error = NON_FATAL_ERROR;
+		goto exit2;
+	}
+
+	//Relative names have to mean the same thing on every session
+	string_t directory;
+	string_initialize(&directory);
+	status_t directory_error = get_directory(session, &directory);
+	if (directory_error && directory_error != NON_FATAL_ERROR)
+	{
+		error = directory_error;
+		goto exit3;
+	}
+
+	if (pthread_mutex_init(&queue.lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit3;
+	}
+
+	//No more sessions than there are files
+	if ((size_t) sessions > queue.count)
+	{
+		sessions = queue.count;
+	}
+
+	fetch_worker_t *workers = calloc(sessions, sizeof *workers);
+	if (workers == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit4;
+	}
+
+	struct timespec start_time, end_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	int started;
+	for (started = 0; started < sessions; started++)
+	{
+		fetch_worker_t *worker = workers + started;
+		worker->session = *session;
+		worker->session.quiet = 1;
+		worker->queue = &queue;
+		worker->directory = directory_error ? NULL : &directory;
+		if (pthread_create(&worker->thread, NULL, fetch_thread, worker) != 0)
+		{
+			error = PTHREAD_CREATE_ERROR;
+			break;
+		}
+	}
+
+	int i;
+	int lost_sessions = 0;
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].error)
+		{
+			lost_sessions++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	free(workers);
+
+	print_fetch_summary(&queue, started, lost_sessions, (end_time.tv_sec - start_time.tv_sec) +
+		(end_time.tv_nsec - start_time.tv_nsec) / 1e9);
+
+	//A thread that couldn't be started is the only error that isn't the
+	//server's doing
+	if (!error && queue.failed > 0)
+	{
+		error = NON_FATAL_ERROR;
+	}
+
+exit4:
+	pthread_mutex_destroy(&queue.lock);
+exit3:
+	string_uninitialize(&directory);
+exit2:
+	for (i = 0; (size_t) i < queue.count; i++)
+	{
+		size_t j;
+		for (j = 0; j < queue.items[i].length; j++)
+		{
+			string_uninitialize(queue.items[i].args + j);
+		}
+		free(queue.items[i].args);
+	}
+	free(queue.items);
+	string_uninitialize(&line);
+	fclose(list);
+exit0:
+	return error;
+}
+
+void *fetch_thread(void *arg)
+{
+	fetch_worker_t *worker = arg;
+	fetch_queue_t *queue = worker->queue;
+	session_t *session = &worker->session;
+
+	worker->error = open_extra_session(session, worker->directory);
+	if (worker->error)
+	{
+		return NULL;
+	}
+
+	//Keep taking the next file until there are none left, so that a session
+	//that's done with a small file moves straight on
+	while (1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		size_t index = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (index >= queue->count)
+		{
+			break;
+		}
+
+		fetch_item_t *item = queue->items + index;
+		char *new_name = string_c_str(item->length > 1 ? item->args + 1 : item->args);
+
+		struct timespec start_time, end_time;
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		status_t error = retr_file(session, item->args, new_name, -1, &item->received);
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+		if (error)
+		{
+			printf("Could not fetch %s.\n", string_c_str(item->args));
+			pthread_mutex_lock(&queue->lock);
+			queue->failed++;
+			pthread_mutex_unlock(&queue->lock);
+
+			if (error != NON_FATAL_ERROR)
+			{
+				//The session can't be used any more; the others carry on
+				worker->error = error;
+				break;
+			}
+			continue;
+		}
+
+		item->latency = (end_time.tv_sec - start_time.tv_sec) +
+			(end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+	}
+
+	if (!worker->error)
+	{
+		quit_command(session);
+	}
+	close(session->command_socket);
+	return NULL;
+}
+
+void print_fetch_summary(fetch_queue_t *queue, int sessions, int lost_sessions,
+	double seconds)
+{
+	//Latencies of the files that made it, in order
+	double *latencies = malloc(queue->count * sizeof *latencies);
+	size_t fetched = 0;
+	off_t bytes = 0;
+	size_t i;
+	for (i = 0; i < queue->count; i++)
+	{
+		if (queue->items[i].latency >= 0)
+		{
+			if (latencies != NULL)
+			{
+				latencies[fetched] = queue->items[i].latency;
+			}
+			fetched++;
+			bytes += queue->items[i].received;
+		}
+	}
+
+	size_t skipped = queue->count - fetched - queue->failed;
+	printf("Fetched %zu of %zu files (%zu failed, %zu not tried) over %d sessions",
+		fetched, queue->count, queue->failed, skipped, sessions);
+	if (lost_sessions > 0)
+	{
+		printf(", %d of which were lost", lost_sessions);
+	}
+	printf(".\n");
+
+	if (seconds > 0)
+	{
+		printf("%lld bytes in %.3f seconds: %.2f MB/s, %.1f files/s.\n", (long long) bytes,
+			seconds, bytes / seconds / (1024 * 1024), fetched / seconds);
+	}
+
+	if (latencies != NULL && fetched > 0)
+	{
+		qsort(latencies, fetched, sizeof *latencies, compare_doubles);
+		double total = 0;
+		for (i = 0; i < fetched; i++)
+		{
+			total += latencies[i];
+		}
+		printf("Latency per file (ms): min %.2f, mean %.2f, p50 %.2f, p99 %.2f, max %.2f.\n",
+			latencies[0] * 1000, total / fetched * 1000, latencies[fetched / 2] * 1000,
+			latencies[(fetched * 99) / 100] * 1000, latencies[fetched - 1] * 1000);
+	}
+	free(latencies);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+status_t rest_command(session_t *session, off_t offset)
+{
+	status_t error;
+
+	char offset_str[sizeof "-9223372036854775808"];
+	sprintf(offset_str, "%lld", (long long) offset);
+
+	string_t args;
+	string_initialize(&args);
+	string_assign_from_char_array(&args, offset_str);
+
+	string_t response;
+	string_initialize(&response);
+
+	MAKE_COMMAND_FROM_LITERAL(command, "REST", &args);
 
 	error = send_command_read_response(session, &command, &response);
 	if (error)
@@ -711,18 +2031,13 @@ status_t send_list_command(session_t *session, string_t *args)
 		goto exit0;
 	}
 
-	//If not logged in, return an error to the caller to let them know.
 	if (matches_code(&response, NOT_LOGGED_IN))
 	{
 		error = LOG_IN_ERROR;
 		goto exit0;
 	}
 
-	//Otherwise, while not matching either of these means the command failed,
-	//the error is non-fatal (i.e., the program can keep executing), so indicate
-	//that
-	if (!matches_code(&response, TRANSFER_STARTING) &&
-		!matches_code(&response, FILE_STATUS_OKAY))
+	if (!matches_code(&response, PENDING_INFORMATION))
 	{
 		error = NON_FATAL_ERROR;
 		goto exit0;
@@ -730,74 +2045,38 @@ status_t send_list_command(session_t *session, string_t *args)
 
 exit0:
 	string_uninitialize(&response);
+	string_uninitialize(&args);
 	return error;
 }
 
-status_t retr_command(session_t *session, string_t *args, size_t length)
+status_t get_directory(session_t *session, string_t *directory)
 {
-	char closing_message[] = "Closing data socket.\n";
-	status_t error = SUCCESS;
+	status_t error;
 
-	if (length <= 1)
-	{
-		printf("Please supply a file to get.\n");
-		error = NON_FATAL_ERROR;
-		goto exit0;
-	}
+	string_t response;
+	string_initialize(&response);
 
-	int data_socket; 
-	if (!session->passive_mode)
-	{
-		error = get_data_socket_active(session, &data_socket, send_retr_command,
-				args + 1);
-	}
-	else
-	{
-		error = get_data_socket_passive(session, &data_socket,
-			send_retr_command, args + 1);
-	}
+	MAKE_COMMAND_FROM_LITERAL(command, "PWD", NULL);
 
+	error = send_command_read_response(session, &command, &response);
 	if (error)
 	{
 		goto exit0;
 	}
 
-	string_t data;
-	string_initialize(&data);
-	error = read_until_eof(data_socket, &data);
-	if (error)
-	{
-		goto exit1;
-	}
-
-	string_t response;
-	string_initialize(&response);
-	error = read_entire_response(session, &response);
-	if (error)
-	{
-		goto exit2;
-	}
-
-	if (!matches_code(&response, CONNECTION_OPEN_NO_TRANSFER) &&
-		!matches_code(&response, CLOSING_DATA_CONNECTION))
+	//The directory is the part of the reply between the quotes
+	char *start = strchr(string_c_str(&response), '"');
+	char *end = start == NULL ? NULL : strrchr(start + 1, '"');
+	if (!matches_code(&response, PATH_CREATED) || end == NULL)
 	{
 		error = NON_FATAL_ERROR;
-		goto exit2;
+		goto exit0;
 	}
 
-	error = retr_write_file(args, length, &data);
-	if (error)
-	{
-		goto exit2;
-	}
+	string_assign_from_char_array_with_size(directory, start + 1, end - start - 1);
 
-exit2:
-	string_uninitialize(&response);
-exit1:
-	string_uninitialize(&data);
-	error = write_log(&session->log, closing_message , sizeof closing_message - 1);
-	close(data_socket);
 exit0:
+	string_uninitialize(&response);
 	return error;
 }
 
@@ -835,47 +2114,40 @@ exit0:
 
 }
 
-status_t retr_write_file(string_t *args, size_t length, string_t *data)
+status_t size_command(session_t *session, string_t *args, off_t *size, uint8_t *known)
 {
-	status_t error = SUCCESS;
+	status_t error;
+	*known = 0;
 
-	char *new_name;
-	if (length > 2)
-	{
-		//if the user supplied a third argument, make that the name of the
-		//output file
-		new_name = string_c_str(args + 2);
-	}
-	else
+	string_t response;
+	string_initialize(&response);
+
+	MAKE_COMMAND_FROM_LITERAL(command, "SIZE", args);
+
+	error = send_command_read_response(session, &command, &response);
+	if (error)
 	{
-		//otherwise, default to the name of the server file
-		new_name = string_c_str(args + 1);
+		goto exit0;
 	}
 
-	int new_fd = open(new_name, O_CREAT | O_WRONLY, 0600);
-	if (new_fd < 0)
+	if (matches_code(&response, NOT_LOGGED_IN))
 	{
-		error = FILE_OPEN_ERROR;
+		error = LOG_IN_ERROR;
 		goto exit0;
 	}
 
-	char *c_str = string_c_str(data);
-	size_t data_size = string_length(data);
-	size_t total_written = 0;
-	while (total_written < data_size)
+	//Anything else just leaves the size unknown; RETR will report any real
+	//problem with the file
+	if (matches_code(&response, FILE_STATUS))
 	{
-		ssize_t written = write(new_fd, c_str + total_written, data_size - total_written);
-		if (written < 0)
-		{
-			error = FILE_WRITE_ERROR;
-			goto exit1;
-		}
-
-		total_written += data_size;
+		char *start = string_c_str(&response) + 4;
+		char *end;
+		*size = strtoll(start, &end, 10);
+		*known = end != start && *size >= 0;
 	}
-exit1:
-	close(new_fd);
+
 exit0:
+	string_uninitialize(&response);
 	return error;
 }
 
@@ -1178,6 +2450,71 @@ exit0:
 	return error;
 }
 
+status_t compress_command(session_t *session, string_t *args, size_t length)
+{
+	status_t error = SUCCESS;
+
+	//With a level, compression is left on at that level; otherwise it's toggled
+	uint8_t turn_on = length > 1 || !session->compress_mode;
+	if (length > 1)
+	{
+		char *level = string_c_str(args + 1);
+		if (string_length(args + 1) != 1 || level[0] < '0' || level[0] > '9')
+		{
+			printf("The compression level must be from 0 to 9.\n");
+			error = NON_FATAL_ERROR;
+			goto exit0;
+		}
+	}
+
+	string_t mode;
+	string_initialize(&mode);
+	string_assign_from_char_array(&mode, turn_on ? "Z" : "S");
+
+	string_t response;
+	string_initialize(&response);
+	MAKE_COMMAND_FROM_LITERAL(mode_command, "MODE", &mode);
+	error = send_command_read_response(session, &mode_command, &response);
+	if (error)
+	{
+		goto exit1;
+	}
+
+	if (!matches_code(&response, COMMAND_OKAY))
+	{
+		error = NON_FATAL_ERROR;
+		goto exit1;
+	}
+	session->compress_mode = turn_on;
+
+	if (length > 1)
+	{
+		string_t opts_response;
+		string_initialize(&opts_response);
+		string_assign_from_char_array(&mode, "MODE Z LEVEL ");
+		string_concatenate(&mode, args + 1);
+		MAKE_COMMAND_FROM_LITERAL(opts_command, "OPTS", &mode);
+		error = send_command_read_response(session, &opts_command, &opts_response);
+		if (!error && !matches_code(&opts_response, COMMAND_OKAY))
+		{
+			error = NON_FATAL_ERROR;
+		}
+		string_uninitialize(&opts_response);
+		if (error)
+		{
+			goto exit1;
+		}
+	}
+
+	printf("Compression is now %s.\n", turn_on ? "on" : "off");
+
+exit1:
+	string_uninitialize(&response);
+	string_uninitialize(&mode);
+exit0:
+	return error;
+}
+
 status_t get_data_socket_active(session_t *session, int *data_socket,
 	status_t (send_the_command)(session_t *, string_t *), string_t *args)
 {
@@ -1303,7 +2640,7 @@ status_t read_entire_response(session_t *session, string_t *response)
 	char c;
 	int i;
 
-	error = read_single_line(session->command_socket, response);
+	error = read_buffered_line(&session->reader, response);
 	if (error)
 	{
 		goto exit0;
@@ -1314,7 +2651,7 @@ status_t read_entire_response(session_t *session, string_t *response)
 		//if the fourth character (i.e. index 3) is a '-', then the response is
 		//multiline. Multiline responses are delineated in a special way, so
 		//pass them off here to read the rest of it
-		error = read_remaining_lines(session->command_socket, response);
+		error = read_remaining_lines(&session->reader, response);
 		if (error)
 		{
 			goto exit0;
@@ -1322,7 +2659,10 @@ status_t read_entire_response(session_t *session, string_t *response)
 	}
 
 	char *c_str = string_c_str(response);
-	printf("%s", c_str);
+	if (!session->quiet)
+	{
+		printf("%s", c_str);
+	}
 	
 	error = write_received_message_to_log(&session->log, response);
 	if (error)
@@ -1362,7 +2702,7 @@ exit0:
 	return error;
 }
 
-status_t read_remaining_lines(int socket, string_t *response)
+status_t read_remaining_lines(line_reader_t *reader, string_t *response)
 {
 	status_t error;
 	string_t line;
@@ -1372,7 +2712,7 @@ status_t read_remaining_lines(int socket, string_t *response)
 	do
 	{
 		char_vector_clear(&line);
-		error = read_single_line(socket, &line);
+		error = read_buffered_line(reader, &line);
 		if (error)
 		{
 			goto exit0;
@@ -1389,28 +2729,251 @@ exit0:
 	return error;
 }
 
-status_t read_until_eof(int socket, string_t *response)
+status_t read_until_eof(int socket, string_t *response, uint8_t compressed)
+{
+	return receive_data(socket, compressed, append_to_string, response);
+}
+
+status_t receive_data(int socket, uint8_t compressed, data_sink_t sink, void *target)
 {
 	status_t error = SUCCESS;
 
+	z_stream stream;
+	memset(&stream, 0, sizeof stream);
+	if (compressed && inflateInit(&stream) != Z_OK)
+	{
+		error = COMPRESSION_ERROR;
+		goto exit0;
+	}
+
 	//use a bigger buffer rather than reading single character at a time
 	//because:
 	//	A.) Not looking for specific character sequence to end at
 	//	B.) For efficiency's sake - data port might transfer much more data
-	char buff[512];
+	char buff[INFLATE_CHUNK_SIZE];
+	uint8_t finished = 0;
 	ssize_t bytes_read = read(socket, buff, sizeof buff);
 	while (bytes_read > 0)
 	{
-		string_concatenate_char_array_with_size(response, buff, bytes_read);
+		if (compressed)
+		{
+			error = inflate_data(&stream, buff, bytes_read, sink, target, &finished);
+		}
+		else
+		{
+			error = sink(target, buff, bytes_read);
+		}
+
+		if (error)
+		{
+			goto exit1;
+		}
 		bytes_read = read(socket, buff, sizeof buff);
 	}
 
 	if (bytes_read < 0)
 	{
 		error = SOCKET_READ_ERROR;
+		goto exit1;
+	}
+
+	//The connection closing before the end of the stream means data was lost
+	if (compressed && !finished)
+	{
+		error = COMPRESSION_ERROR;
+		goto exit1;
+	}
+
+exit1:
+	if (compressed)
+	{
+		inflateEnd(&stream);
+	}
+exit0:
+	return error;
+}
+
+status_t receive_file(int socket, int fd)
+{
+	status_t error = SUCCESS;
+
+	int pipe_fds[2];
+	if (pipe(pipe_fds) < 0)
+	{
+		//Copying through the program is slower, but still works
+		return receive_data(socket, 0, write_to_file, &fd);
+	}
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, RECEIVE_CHUNK_SIZE);
+
+	uint8_t started = 0;
+	while (1)
+	{
+		ssize_t in_pipe = splice(socket, NULL, pipe_fds[1], NULL, RECEIVE_CHUNK_SIZE,
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in_pipe == 0)
+		{
+			break;
+		}
+
+		if (in_pipe < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			if (errno == EINVAL && !started)
+			{
+				//The socket can't be spliced from, so read it the usual way
+				error = receive_data(socket, 0, write_to_file, &fd);
+				goto exit1;
+			}
+
+			error = SOCKET_READ_ERROR;
+			goto exit1;
+		}
+		started = 1;
+
+		while (in_pipe > 0)
+		{
+			ssize_t written = splice(pipe_fds[0], NULL, fd, NULL, in_pipe, SPLICE_F_MOVE);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				error = FILE_WRITE_ERROR;
+				goto exit1;
+			}
+
+			in_pipe -= written;
+		}
+	}
+
+exit1:
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return error;
+}
+
+status_t append_to_string(void *target, char *data, size_t length)
+{
+	string_concatenate_char_array_with_size(target, data, length);
+	return SUCCESS;
+}
+
+status_t write_to_file(void *target, char *data, size_t length)
+{
+	int fd = *(int *) target;
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			return FILE_WRITE_ERROR;
+		}
+
+		//A short write just means the rest has to go in another call
+		data += written;
+		length -= written;
+	}
+
+	return SUCCESS;
+}
+
+status_t receive_range(int socket, int fd, off_t offset, off_t length, off_t *received)
+{
+	status_t error = SUCCESS;
+
+	char *buff = malloc(RECEIVE_CHUNK_SIZE);
+	if (buff == NULL)
+	{
+		error = MEMORY_ERROR;
 		goto exit0;
 	}
 
+	while (*received < length)
+	{
+		off_t remaining = length - *received;
+		ssize_t bytes_read = read(socket, buff,
+			remaining < RECEIVE_CHUNK_SIZE ? remaining : RECEIVE_CHUNK_SIZE);
+		if (bytes_read == 0)
+		{
+			break;
+		}
+
+		if (bytes_read < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			error = SOCKET_READ_ERROR;
+			goto exit1;
+		}
+
+		ssize_t written_total = 0;
+		while (written_total < bytes_read)
+		{
+			ssize_t written = pwrite(fd, buff + written_total, bytes_read - written_total,
+				offset + *received + written_total);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				error = FILE_WRITE_ERROR;
+				goto exit1;
+			}
+
+			written_total += written;
+		}
+		*received += bytes_read;
+	}
+
+exit1:
+	free(buff);
+exit0:
+	return error;
+}
+
+status_t inflate_data(z_stream *stream, char *data, size_t length, data_sink_t sink,
+	void *target, uint8_t *finished)
+{
+	status_t error = SUCCESS;
+
+	char output[INFLATE_CHUNK_SIZE];
+	stream->next_in = (Bytef *) data;
+	stream->avail_in = length;
+	while (stream->avail_in > 0 && !*finished)
+	{
+		stream->next_out = (Bytef *) output;
+		stream->avail_out = sizeof output;
+		int result = inflate(stream, Z_NO_FLUSH);
+		if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+		{
+			error = COMPRESSION_ERROR;
+			goto exit0;
+		}
+
+		error = sink(target, output, sizeof output - stream->avail_out);
+		if (error)
+		{
+			goto exit0;
+		}
+		*finished = result == Z_STREAM_END;
+	}
+
 exit0:
 	return error;
 }
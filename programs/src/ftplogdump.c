@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "status_t.h"
+
+#define MIN_ARGC 2
+#define MAX_ARGC 4
+#define SESSION_FLAG "-s"
+#define ALL_SESSIONS -1
+
+//Longest a timestamp from ctime_r can be, with its '\0'
+#define TIME_STRING_LEN 26
+#define NANOSECONDS_PER_SECOND 1000000000
+
+/**
+  * Parses the command line, which is "ftplogdump [-s session] logfile"
+  * @param argc - the number of arguments
+  * @param argv - the arguments
+  * @param filename - out param; the binary log to read
+  * @param session_id - out param; the session to print entries for, or
+  *		ALL_SESSIONS
+  */
+status_t parse_command_line(int argc, char *argv[], char **filename, int64_t *session_id);
+
+/**
+  * Reads exactly length bytes from fd, unless the file ends first
+  * @param fd - the file to read from
+  * @param buffer - where to put the bytes
+  * @param length - how many bytes to read
+  * @param eof - out param; set if the file ended before anything was read
+  */
+status_t read_exactly(int fd, void *buffer, size_t length, uint8_t *eof);
+
+/**
+  * Prints one entry the way the text log format would have written it
+  * @param header - the entry's header
+  * @param payload - the entry's payload, header->length bytes of it
+  * @param clock_offset - what to add to a monotonic timestamp to get the wall
+  *		clock time, from the last LOG_EVENT_OPEN entry
+  */
+void print_entry(log_binary_header_t *header, char *payload, uint64_t clock_offset);
+
+int main(int argc, char *argv[])
+{
+	status_t error;
+
+	char *filename;
+	int64_t session_id;
+	error = parse_command_line(argc, argv, &filename, &session_id);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		error = FILE_OPEN_ERROR;
+		goto exit0;
+	}
+
+	//The length field is 16 bits, so no payload is ever bigger than this
+	char *payload = malloc(UINT16_MAX);
+	if (payload == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit1;
+	}
+
+	uint64_t clock_offset = 0;
+	uint8_t seen_open = 0;
+	while (1)
+	{
+		log_binary_header_t header;
+		uint8_t eof;
+		error = read_exactly(fd, &header, sizeof header, &eof);
+		if (error || eof)
+		{
+			goto exit2;
+		}
+
+		error = read_exactly(fd, payload, header.length, &eof);
+		if (error)
+		{
+			goto exit2;
+		}
+		if (eof && header.length > 0)
+		{
+			error = LOG_FORMAT_ERROR;
+			goto exit2;
+		}
+
+		if (header.event == LOG_EVENT_OPEN)
+		{
+			//Each open entry ties the monotonic clock back to the wall clock
+			log_binary_open_t open_entry;
+			if (header.length != sizeof open_entry)
+			{
+				error = LOG_FORMAT_ERROR;
+				goto exit2;
+			}
+			memcpy(&open_entry, payload, sizeof open_entry);
+			if (memcmp(open_entry.magic, LOG_BINARY_MAGIC, sizeof LOG_BINARY_MAGIC) != 0)
+			{
+				error = LOG_FORMAT_ERROR;
+				goto exit2;
+			}
+
+			clock_offset = open_entry.realtime - header.timestamp;
+			seen_open = 1;
+			continue;
+		}
+
+		if (!seen_open)
+		{
+			error = LOG_FORMAT_ERROR;
+			goto exit2;
+		}
+
+		if (session_id == ALL_SESSIONS || session_id == header.session_id)
+		{
+			print_entry(&header, payload, clock_offset);
+		}
+	}
+
+exit2:
+	free(payload);
+exit1:
+	close(fd);
+exit0:
+	print_error_message(error);
+	return error;
+}
+
+status_t parse_command_line(int argc, char *argv[], char **filename, int64_t *session_id)
+{
+	if (argc == MIN_ARGC)
+	{
+		*session_id = ALL_SESSIONS;
+		*filename = argv[1];
+		return SUCCESS;
+	}
+
+	if (argc == MAX_ARGC && strcmp(argv[1], SESSION_FLAG) == 0)
+	{
+		char *end;
+		errno = 0;
+		unsigned long tmp = strtoul(argv[2], &end, 10);
+		if (errno == 0 && *end == '\0' && *argv[2] != '\0' && tmp <= UINT32_MAX)
+		{
+			*session_id = tmp;
+			*filename = argv[3];
+			return SUCCESS;
+		}
+	}
+
+	printf("Usage: ftplogdump [-s session] logfile\n");
+	return BAD_COMMAND_LINE;
+}
+
+status_t read_exactly(int fd, void *buffer, size_t length, uint8_t *eof)
+{
+	size_t total = 0;
+	*eof = 0;
+	while (total < length)
+	{
+		ssize_t amount = read(fd, (char *) buffer + total, length - total);
+		if (amount < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			return FILE_READ_ERROR;
+		}
+
+		if (amount == 0)
+		{
+			//Stopping part way through something means the file was cut short
+			if (total > 0)
+			{
+				return LOG_FORMAT_ERROR;
+			}
+
+			*eof = 1;
+			return SUCCESS;
+		}
+
+		total += amount;
+	}
+
+	return SUCCESS;
+}
+
+void print_entry(log_binary_header_t *header, char *payload, uint64_t clock_offset)
+{
+	if (header->event == LOG_EVENT_DROPPED)
+	{
+		uint64_t dropped = 0;
+		if (header->length == sizeof dropped)
+		{
+			memcpy(&dropped, payload, sizeof dropped);
+		}
+		printf("%llu log messages dropped.\n", (unsigned long long) dropped);
+		return;
+	}
+
+	//Same layout as the text log: the ctime timestamp with its newline swapped
+	//for a space
+	time_t time_val = (header->timestamp + clock_offset) / NANOSECONDS_PER_SECOND;
+	char time_string[TIME_STRING_LEN];
+	if (ctime_r(&time_val, time_string) == NULL)
+	{
+		return;
+	}
+	size_t time_len = strlen(time_string);
+	time_string[time_len - 1] = ' ';
+	fwrite(time_string, 1, time_len, stdout);
+
+	if (header->event == LOG_EVENT_RECEIVED)
+	{
+		fputs("Received: ", stdout);
+	}
+	else if (header->event == LOG_EVENT_SENT)
+	{
+		fputs("Sent: ", stdout);
+	}
+
+	fwrite(payload, 1, header->length, stdout);
+	fputc('\n', stdout);
+}
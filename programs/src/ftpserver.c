@@ -1,53 +1,367 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <linux/openat2.h>
+#include <linux/stat.h>
+#include <zlib.h>
+
 #include "accounts.h"
+#include "connection_queue.h"
+#include "file_cache.h"
 #include "ftp.h"
 #include "log.h"
+#include "pasv_pool.h"
 #include "server.h"
 #include "status_t.h"
 #include "string_t.h"
 
 #define ARGC 2
 
-#define MAX_USERS 30
+#define HELP_VERBS_PER_LINE 4
+#define HELP_REPLY_SIZE 512
+
+#define DATA_CHUNK_SIZE (1 << 20)
+//How much of a directory LIST reads per getdents64 call; each batch becomes
+//one chunk of the listing sent on the data connection
+#define LIST_BATCH_SIZE (1 << 16)
+#define EVENT_BATCH_SIZE 64
+//Uploads are written back to disk a window at a time, so that a big one can't
+//fill the page cache with dirty pages
+#define STORE_SYNC_WINDOW (8 << 20)
+//STOU names files STOU_PREFIX followed by STOU_NAME_CHARS random characters,
+//trying another name up to STOU_ATTEMPTS times when one is taken
+#define STOU_PREFIX "stou."
+#define STOU_NAME_CHARS 6
+#define STOU_ATTEMPTS 100
+#define STOU_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"
+//How much MODE Z reads from a file, and deflates into, at a time
+#define ZLIB_CHUNK_SIZE (1 << 18)
+#define OPTS_MODE "MODE"
+//Comfortably more than twice the number of commands, so probes stay short
+#define COMMAND_TABLE_BITS 6
+#define COMMAND_TABLE_SIZE (1 << COMMAND_TABLE_BITS)
+//Room for every MLST fact, with its value, on one line
+#define MLST_FACTS_SIZE 256
+#define MLST_DEFAULT_FACTS ((1 << MLST_FACT_TYPE) | (1 << MLST_FACT_SIZE) | (1 << MLST_FACT_MODIFY))
+#define OPTS_MLST "MLST"
+
+/**
+  * The states a session moves through. A session reads commands until one of
+  * them needs to wait on the data connection, at which point it moves into one
+  * of the other states until that work is done. SESSION_ACCEPTING_DATA is
+  * only for a transfer waiting on the client to connect after a PASV;
+  * commands keep being read while nothing needs the connection yet.
+  */
+typedef enum
+{
+	SESSION_READING_COMMAND = 0,
+	SESSION_ACCEPTING_DATA,
+	SESSION_CONNECTING_DATA,
+	SESSION_TRANSFERRING,
+} session_state_t;
+
+/**
+  * The RFC 3659 facts that MLSD and MLST can give about a file, as bits in a
+  * session's set of facts
+  */
+typedef enum
+{
+	MLST_FACT_TYPE = 0,
+	MLST_FACT_SIZE,
+	MLST_FACT_MODIFY,
+	MLST_FACT_CREATE,
+	MLST_FACT_UNIQUE,
+	MLST_FACT_UNIX_MODE,
+	MLST_FACT_COUNT,
+} mlst_fact_t;
+
+/**
+  * What the server needs to know about each fact
+  * name - the fact's name, as FEAT and OPTS MLST give it
+  * statx_mask - what statx has to fill in for the fact to be given
+  */
+typedef struct
+{
+	char *name;
+	unsigned int statx_mask;
+} mlst_fact_entry_t;
+
+static mlst_fact_entry_t mlst_facts[MLST_FACT_COUNT] =
+{
+	[MLST_FACT_TYPE] = { "type", STATX_TYPE },
+	[MLST_FACT_SIZE] = { "size", STATX_SIZE },
+	[MLST_FACT_MODIFY] = { "modify", STATX_MTIME },
+	[MLST_FACT_CREATE] = { "create", STATX_BTIME },
+	[MLST_FACT_UNIQUE] = { "unique", STATX_INO },
+	[MLST_FACT_UNIX_MODE] = { "UNIX.mode", STATX_MODE },
+};
+
+struct user_session;
+
+/**
+  * The deflate state for MODE Z transfers, kept for the whole session so that
+  * each transfer only has to reset it
+  * stream - the zlib stream
+  * output - compressed data waiting to go out on the data connection
+  * output_start, output_end - the part of output not sent yet
+  * input - for RETR, what has been read from the file but not compressed yet
+  * input_start, input_end - the part of input not compressed yet
+  * finished - whether the end of the stream has been compressed
+  */
+typedef struct
+{
+	z_stream stream;
+	char *output;
+	size_t output_start;
+	size_t output_end;
+	char *input;
+	size_t input_start;
+	size_t input_end;
+	uint8_t finished;
+} compressor_t;
+
+/**
+  * Structure describing a data transfer that is in progress, so that it can be
+  * carried out one piece at a time
+  * step - sends the next piece of the transfer, setting *done when finished
+  * fd - the file being sent, or the directory being listed, or -1
+  * cached_file - the open file cache's entry for fd, when fd belongs to the
+  *		cache rather than to the transfer
+  * contents - the file being sent, when the open file cache has it in memory
+  * offset - how far into the file or data the transfer has gotten
+  * length - the total number of bytes to be sent
+  * data - the data being sent, for transfers that don't come from a file
+  * fill - for a LIST read straight from the directory, the copy being kept
+  *		for the listing cache
+  * filling - whether fill has been started and not yet finished
+  * machine_listing - whether the listing is for MLSD rather than LIST
+  * facts - for MLSD, the facts to give for each entry
+  * receiving - whether the transfer is an upload, coming in on the data
+  *		connection rather than going out
+  * pipe_fds - for an upload, the pipe that splice moves the data through on
+  *		its way from the data connection to fd
+  * allocated - how much of fd was preallocated for an upload
+  * synced - how far into fd writing back to disk has been started
+  * compressor - the session's compressor in MODE Z, or NULL
+  */
+typedef struct
+{
+	status_t (*step)(struct user_session *session, uint8_t *done);
+	int fd;
+	file_entry_t *cached_file;
+	char *contents;
+	off_t offset;
+	off_t length;
+	string_t data;
+	listing_fill_t fill;
+	uint8_t filling;
+	uint8_t machine_listing;
+	uint32_t facts;
+	uint8_t receiving;
+	int pipe_fds[2];
+	off_t allocated;
+	off_t synced;
+	compressor_t *compressor;
+} transfer_t;
+
+/**
+  * A directory entry as returned by the getdents64 system call
+  */
+typedef struct
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} directory_record_t;
+
+/**
+  * Structure holding the event loop state for event mode: one epoll instance
+  * per loop thread
+  * epoll_fd - the epoll instance driving this loop's sessions
+  * thread - the thread running the loop
+  * server - reference to the server configuration object
+  * accepting - list of this loop's sessions waiting for a client to connect
+  *		after a PASV, so that the ones that wait too long can be given up on
+  * incoming - sessions the acceptor has handed to this loop that it hasn't
+  *		started yet
+  * incoming_lock - protects incoming
+  * wake_fd - eventfd in the loop's epoll set that the acceptor writes to when
+  *		it adds to incoming
+  */
+typedef struct
+{
+	int epoll_fd;
+	pthread_t thread;
+	server_t *server;
+	struct user_session *accepting;
+	struct user_session *incoming;
+	pthread_mutex_t incoming_lock;
+	int wake_fd;
+} event_loop_t;
 
-#define HELP_STRING "CDUP CWD EPRT EPSV\r\n"\
-	"HELP LIST PASS PASV\r\n"\
-	"PORT PWD QUIT RETR USER"
+/**
+  * Structure holding the worker pool used in threaded mode: a fixed set of
+  * threads, started up front, that take accepted connections off a bounded
+  * queue and each run one session at a time
+  * queue - the accepted connections waiting for a worker
+  * threads - the worker threads
+  * server - reference to the server configuration object
+  */
+typedef struct
+{
+	connection_queue_t queue;
+	pthread_t *threads;
+	server_t *server;
+} worker_pool_t;
 
 /**
   * Structure for holding all the information a user thread needs for processing
   * command_sock - the socket over which the commands are sent
+  * reader - buffers the data read from command_sock
+  * reply_queue - replies, or the ends of replies, that command_sock wouldn't
+  *		take yet
+  * reply_queue_sent - how much of reply_queue has been sent already
+  * command - the command being read from reader
   * server - reference to the server configuration object
-  * account - the user's account structure
+  * username - the username given by a USER that named a known account, or
+  *		NULL; the account itself is looked up again by PASS, since the accounts
+  *		can be reloaded in between
   * logged_in - flag indicating whether user has successfully logged in
-  * directory - the representation of the user's current working directory
+  * directory - the real path of the user's current working directory, which is
+  *		always under the server's root
+  * directory_fd - an O_PATH descriptor for the current working directory, which
+  *		names in commands are looked up from
+  * directory_dev, directory_ino - the device and inode of the current working
+  *		directory, for finding its files in the open file cache
   * data_sock - the socket over which data will be sent
+  * pasv_sock - the socket listening for the data connection after a PASV
+  * pasv_lease - the lease on pasv_sock, when it came from the server's pool
+  * pasv_leased - whether pasv_sock came from the pool rather than being the
+  *		session's own
+  * accept_deadline - when, in CLOCK_MONOTONIC milliseconds, to stop waiting for
+  *		the client to connect to pasv_sock
+  * incoming_next - the next session in its loop's incoming list
+  * accept_prev, accept_next - the session's neighbours in its loop's
+  *		accepting list
+  * state - what the session is currently doing
+  * transfer - the transfer in progress, when state is SESSION_TRANSFERRING
+  * loop - the event loop driving the session, or NULL in threaded mode
+  * waiting_fd - the descriptor the session is registered on with loop
+  * id - the session's number, for tagging log entries
+  * mlst_facts - the facts MLSD and MLST give, as set by OPTS MLST
+  * restart_offset - where the next RETR starts in the file, as set by REST
+  * allocate_size - how much space to preallocate for the next upload, as set
+  *		by ALLO
+  * mode_z - whether transfers are deflated, as set by MODE
+  * compression_level - the zlib level for MODE Z, as set by OPTS MODE
+  * compressor - the deflate state, set up by the first MODE Z
   */
-typedef struct
+typedef struct user_session
 {
 	int command_sock;
+	line_reader_t reader;
+	string_t reply_queue;
+	size_t reply_queue_sent;
+	string_t command;
 	server_t *server;
-	account_t *account;
+	char *username;
 	uint8_t logged_in;
 	char *directory;
+	int directory_fd;
+	dev_t directory_dev;
+	ino_t directory_ino;
 	int data_sock;
+	int pasv_sock;
+	size_t pasv_lease;
+	uint8_t pasv_leased;
+	uint64_t accept_deadline;
+	struct user_session *accept_prev;
+	struct user_session *accept_next;
+	struct user_session *incoming_next;
+	session_state_t state;
+	transfer_t transfer;
+	event_loop_t *loop;
+	int waiting_fd;
+	uint32_t id;
+	uint32_t mlst_facts;
+	off_t restart_offset;
+	off_t allocate_size;
+	uint8_t mode_z;
+	int compression_level;
+	compressor_t *compressor;
 } user_session_t;
 
+/**
+  * Set by the SIGINT/SIGTERM handler to tell the acceptor to stop taking
+  * connections so the server can shut down cleanly
+  */
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+  * Set by the SIGHUP handler to tell the acceptor to reload the accounts file
+  */
+static volatile sig_atomic_t reload_requested = 0;
+
+/**
+  * Signal handler for SIGINT and SIGTERM; just asks for a shutdown
+  * @param signal_number - the signal that arrived
+  */
+void request_stop(int signal_number);
+
+/**
+  * Signal handler for SIGHUP; just asks for the accounts to be reloaded
+  * @param signal_number - the signal that arrived
+  */
+void request_reload(int signal_number);
+
+/**
+  * Sets up the shutdown signals, and SIGHUP. They're blocked in the calling
+  * thread (and so in every thread it starts) until unblock_stop_signals is
+  * called, so that they end up interrupting the acceptor's accept rather than
+  * some other thread
+  */
+status_t set_up_stop_signals(void);
+
+/**
+  * Lets the shutdown signals and SIGHUP through to the calling thread
+  */
+void unblock_stop_signals(void);
+
+/**
+  * Reloads the accounts if a SIGHUP has asked for it, logging how it went.
+  * Sessions carry on looking accounts up the whole time.
+  * @param server - the server whose accounts to reload
+  */
+void reload_if_requested(server_t *server);
+
 /**
   * Parses the command line, returning an error if there are any problems with
   * it, and otherwise placing the passed port number into *port
@@ -59,1038 +373,4107 @@ status_t parse_command_line(int argc, char *argv[], uint16_t *port);
 
 /**
   * Given a response code and a message to include with it, this function will
-  * stitch them up into the correct format to send over the socket sock. The
-  * sending will be recorded in the log file indicated by log, and a multiline
-  * is a flag with an obvious purpose
-  * @param sock - the socket over which to send the data
+  * stitch them up into the correct format to send to the session's client. The
+  * sending will be recorded in the server's log, and a multiline is a flag with
+  * an obvious purpose
+  * @param session - the session to which to send the response
   * @param code - the code to send in the response
   * @param message - the message to include with the response
-  * @param log - the log file to which to log the sending
-  * @param
+  * @param multiline - whether to send the response as a multiline reply
   */
-status_t send_response(int sock, char *code, char *message, log_t *log, uint8_t multiline);
+status_t send_response(user_session_t *session, char *code, char *message, uint8_t multiline);
 
 /**
-  * Sends pure data in the string over the socket, without adding line endings
-  * or anything else
-  * @param sock - the socket over which to send the data
-  * @param s - the string to send
-  * @param log - the log in which to log that data was sent
+  * Starts up the worker threads and then accepts connections on listen_sock
+  * forever, queueing them up for the workers. When the queue is full, the
+  * connection is turned away with a 421.
+  * @param server - the server configuration object
+  * @param listen_sock - the socket on which to accept connections
   */
-status_t send_data_string(int sock, string_t *s, log_t *log);
+status_t run_worker_pool(server_t *server, int listen_sock);
 
 /**
-  * The "thread" function for each client/user that connects. Continuously loops
-  * until an error is encountered or until the user enters the "quit" command
-  * @param void_args - pointer to the thread argument structure. Actually of
-  * 	type user_session_t *
+  * The thread function for each worker in the pool. Takes connections off the
+  * queue one at a time and runs a session on each.
+  * @param void_args - the pool. Actually of type worker_pool_t *
   */
-void *client_handler(void *void_args);
+void *worker_handler(void *void_args);
 
 /**
-  * These functions all serve the purpose of handling the commands from the user
-  * once they have been read and parsed.
-  * @param session - the current session for the user
-  * @param args - an array of arguments that arrived with the user's command
-  * @param len - the length of the args array
-  */
-status_t handle_user_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_pass_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_cwd_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_cdup_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_quit_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_pasv_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_epsv_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_port_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_eprt_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_retr_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_pwd_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_list_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_help_command(user_session_t *session, string_t *args, size_t len);
-status_t handle_unrecognized_command(user_session_t *session, string_t *args, size_t len);
+  * Runs the session for one client/user. Continuously loops until an error is
+  * encountered or until the user enters the "quit" command, and frees the
+  * session afterwards
+  * @param session - the session to run; command_sock and server must be set
+  */
+void client_handler(user_session_t *session);
 
 /**
-  * The following functions are all rather straightforward - in the current
-  * session for the user, they send a static (in all but one case) message back
-  * to the client. The one exception is send_257, which uses the directory
-  * information in session to send the current working directory to the client.
+  * Turns the connection away with a 421 and closes it, for when the server
+  * already has as many users as it can take
+  * @param server - the server configuration object
+  * @param sock - the connection to turn away
   */
-status_t send_125(user_session_t *session);
-status_t send_200(user_session_t *session);
-status_t send_214(user_session_t *session);
-status_t send_221(user_session_t *session);
-status_t send_226(user_session_t *session);
-status_t send_250(user_session_t *session);
-status_t send_257(user_session_t *session);
-status_t send_330(user_session_t *session);
-status_t send_331(user_session_t *session);
-status_t send_425(user_session_t *session);
-status_t send_451(user_session_t *session);
-status_t send_500(user_session_t *session);
-status_t send_501(user_session_t *session);
-status_t send_502(user_session_t *session);
-status_t send_503(user_session_t *session);
-status_t send_530(user_session_t *session);
-status_t send_550(user_session_t *session);
+void reject_connection(server_t *server, int sock);
 
 /**
-  * Determines whether a particular path is a directory or not
-  * @param dir - the path to check
+  * Sets up a freshly accepted session, finding its starting directory and
+  * setting up its command reader
+  * @param session - the session to set up; command_sock and server must be set
   */
-uint8_t is_directory(char *dir);
+status_t initialize_session(user_session_t *session);
 
-int main(int argc, char *argv[])
-{
-	status_t error;
+/**
+  * Closes every socket belonging to the session and frees it
+  * @param session - the session to free
+  */
+void free_session(user_session_t *session);
 
-	server_t server;
-	error = initialize_server(&server);
-	if (error)
-	{
-		goto exit0;
-	}
+/**
+  * Splits the command up, works out which command it is and calls the right
+  * handler for it
+  * @param session - the session in which the command arrived
+  * @param line - the command line, with the CRLF still on the end
+  * @param done - out param; set when the command ends the session
+  */
+status_t process_command(user_session_t *session, string_t *line, uint8_t *done);
 
-	char start_up_message[] = "Config file read. Starting rest of server up.\n";
-	error = write_log(server.log, start_up_message, sizeof start_up_message);
-	if (error)
-	{
-		goto exit0;
-	}
+/**
+  * Writes an error that ended a session out to the log
+  * @param session - the session in which the error happened
+  * @param error - the error that happened
+  */
+void log_session_error(user_session_t *session, status_t error);
 
-	uint16_t port;
-	error = parse_command_line(argc, argv, &port);
-	if (error)
-	{
-		goto exit0;
-	}
+/**
+  * Carries the session's data connection work (accepting, connecting or
+  * transferring) as far as it can go. In threaded mode the sockets are blocking,
+  * so this always runs to completion; in event mode it returns
+  * SOCKET_WOULD_BLOCK when it has to wait on a socket.
+  * @param session - the session to move along
+  */
+status_t advance_session(user_session_t *session);
 
-	char socket_message[] = "Setting up socket.\n";
-	error = write_log(server.log, socket_message, sizeof socket_message);
-	if (error)
-	{
-		goto exit0;
-	}
-	int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_sock < 0)
-	{
-		error = SOCKET_OPEN_ERROR;
-		goto exit0;
-	}
+/**
+  * Sets up the given number of event loops, each on its own thread, and then
+  * accepts connections on listen_sock forever, handing them out to the loops
+  * @param server - the server configuration object
+  * @param listen_sock - the socket on which to accept connections
+  */
+status_t run_event_loops(server_t *server, int listen_sock);
 
-	struct sockaddr_in sad;
-	memset(&sad, 0, sizeof sad);
-	sad.sin_family = AF_INET;
-	sad.sin_addr.s_addr = INADDR_ANY;
-	sad.sin_port = htons(port);
+/**
+  * The thread function for an event loop. Waits on every socket of every
+  * session belonging to the loop and moves each session along when one is
+  * ready.
+  * @param void_args - the loop. Actually of type event_loop_t *
+  */
+void *event_loop_handler(void *void_args);
 
-	if (bind(listen_sock, (struct sockaddr *) &sad, sizeof sad) < 0)
-	{
-		error = BIND_ERROR;
-		goto exit1;
-	}
+/**
+  * Starts every session the acceptor has handed to the loop since last time:
+  * sends each its 220 and registers it with the loop. Only ever run on the
+  * loop's own thread, so that nothing else touches a session once it is in
+  * the loop's epoll set.
+  * @param loop - the loop whose incoming sessions to start
+  */
+void start_incoming_sessions(event_loop_t *loop);
 
-	if (listen(listen_sock, MAX_USERS) < 0)
-	{
-		error = LISTEN_ERROR;
-		goto exit1;
-	}
+/**
+  * Reads and processes as many commands and as much data connection work as
+  * the session's sockets allow without blocking, and then either registers the
+  * session to wait on the right socket or ends it
+  * @param session - the session to drive
+  */
+void drive_session(user_session_t *session);
+
+/**
+  * Frees a session run by an event loop, making room for another user
+  * @param session - the session to end
+  */
+void end_event_session(user_session_t *session);
+
+/**
+  * Registers the session with its event loop on whichever socket its current
+  * state is waiting for
+  * @param session - the session to register
+  */
+status_t wait_on_session_socket(user_session_t *session);
+
+/**
+  * Threaded mode's wait for the next command while a PASV is waiting on the
+  * client to connect: watches pasv_sock as well as command_sock, taking the
+  * data connection as soon as it comes in and giving up on it once
+  * pasv_accept_timeout is up
+  * @param session - the session about to read a command
+  */
+status_t wait_for_command(user_session_t *session);
+
+/**
+  * Starts the clock on the client connecting to the session's pasv_sock, which
+  * it gets no longer than the server's pasv_accept_timeout to do. Commands
+  * keep being read in the meantime.
+  * @param session - the session whose pasv_sock has just been set up
+  */
+void start_accepting(user_session_t *session);
+
+/**
+  * Takes the data connection from pasv_sock, if the client has made it, and
+  * gets rid of pasv_sock
+  * @param session - the session waiting on its pasv_sock
+  * @return SOCKET_WOULD_BLOCK if the client hasn't connected yet
+  */
+status_t accept_data_connection(user_session_t *session);
+
+/**
+  * Stops waiting for the client to connect once the time for it is up. A
+  * transfer that was waiting on the connection is given up on with a 425.
+  * @param session - the session waiting on its pasv_sock
+  */
+status_t stop_accepting(user_session_t *session);
+
+/**
+  * Gets rid of the session's data connection, along with a passive mode socket
+  * the client hasn't connected to yet
+  * @param session - the session whose data connection to close
+  */
+void close_data_connection(user_session_t *session);
+
+/**
+  * Gets rid of the session's passive mode socket, giving it back to the pool if
+  * it was leased and closing it otherwise, and stops waiting on it
+  * @param session - the session whose pasv_sock to get rid of
+  */
+void release_pasv_socket(user_session_t *session);
+
+/**
+  * Works out how much longer the session should wait for the client to connect
+  * @param session - the session waiting on its pasv_sock
+  * @return the milliseconds left, or 0 if the time is up
+  */
+int accept_time_remaining(user_session_t *session);
+
+/**
+  * Gets the current CLOCK_MONOTONIC time in milliseconds
+  */
+uint64_t monotonic_ms(void);
+
+/**
+  * Works out how long an event loop can wait for events before one of its
+  * sessions' accepts runs out of time
+  * @param loop - the loop about to wait
+  * @return the milliseconds to wait, or -1 to wait as long as it takes
+  */
+int next_accept_timeout(event_loop_t *loop);
+
+/**
+  * Gives up on the accept of every session of the loop that has run out of
+  * time, unless the client has connected after all
+  * @param loop - the loop whose sessions to check
+  */
+void expire_accepting_sessions(event_loop_t *loop);
+
+/**
+  * Starts a transfer on the data connection of the current session with the
+  * given step function. The transfer then gets moved along by
+  * advance_session, once the client has connected if it hasn't yet.
+  * @param session - the session in which to transfer
+  * @param step - the function that sends each piece of the transfer
+  */
+void begin_transfer(user_session_t *session, status_t (*step)(user_session_t *, uint8_t *));
+
+/**
+  * Cleans up after the transfer in the current session, closing the data
+  * connection and sending back the final response
+  * @param session - the session whose transfer is finished
+  * @param transfer_error - the error the transfer ended with, if any
+  */
+status_t finish_transfer(user_session_t *session, status_t transfer_error);
+
+/**
+  * Closes everything the transfer in the current session had open, data
+  * connection included, and goes back to reading commands
+  * @param session - the session whose transfer is over
+  */
+void clean_up_transfer(user_session_t *session);
+
+/**
+  * Step functions for transfers. retr_transfer_step sends the next piece of a
+  * file using sendfile; contents_transfer_step sends the next piece of a file
+  * from its contents in memory; data_transfer_step sends the next piece of the
+  * data string; list_transfer_step sends a directory listing as it is read,
+  * one batch of entries at a time
+  * @param session - the session whose transfer is in progress
+  * @param done - out param; set once everything has been sent
+  */
+status_t retr_transfer_step(user_session_t *session, uint8_t *done);
+status_t contents_transfer_step(user_session_t *session, uint8_t *done);
+status_t data_transfer_step(user_session_t *session, uint8_t *done);
+status_t list_transfer_step(user_session_t *session, uint8_t *done);
+
+/**
+  * Sends the next piece of a transfer whose data is all in memory, deflating
+  * it in MODE Z
+  * @param session - the session whose transfer is in progress
+  * @param data - everything the transfer sends, transfer.length bytes long
+  * @param done - out param; set once everything has been sent
+  */
+status_t send_from_memory(user_session_t *session, char *data, uint8_t *done);
+
+/**
+  * Step function for RETR in MODE Z: reads the next piece of the file and
+  * sends it on deflated
+  * @param session - the session whose transfer is in progress
+  * @param done - out param; set once the whole compressed stream has been sent
+  */
+status_t retr_deflate_transfer_step(user_session_t *session, uint8_t *done);
+
+/**
+  * Moves a MODE Z transfer along by one piece: sends compressed data left over
+  * from before if there is any, and otherwise deflates up to ZLIB_CHUNK_SIZE
+  * more bytes of data
+  * @param session - the session whose transfer is in progress
+  * @param data - the data still to be sent
+  * @param length - the length of data
+  * @param last - whether data runs to the end of the transfer, so the stream
+  *		should be finished off once it has all been compressed
+  * @param consumed - out param; how much of data was taken
+  * @param finished - out param; set once the end of the stream has been sent
+  */
+status_t send_compressed(user_session_t *session, char *data, size_t length, uint8_t last,
+	size_t *consumed, uint8_t *finished);
+
+/**
+  * Sets up the deflate state for a session's MODE Z transfers
+  * @param compressor - out param; the new compressor
+  * @param level - the zlib compression level
+  */
+status_t create_compressor(compressor_t **compressor, int level);
+
+/**
+  * Frees a compressor made by create_compressor
+  * @param compressor - the compressor to free; may be NULL
+  */
+void free_compressor(compressor_t *compressor);
+
+/**
+  * Step function for uploads: splices whatever has arrived on the data
+  * connection into a pipe, and from the pipe into the file, so that the data
+  * never gets copied into user space. Starts writing the file back to disk as
+  * it goes and drops what has been written from the page cache.
+  * @param session - the session whose upload is in progress
+  * @param done - out param; set once the client has closed the data connection
+  */
+status_t store_transfer_step(user_session_t *session, uint8_t *done);
+
+/**
+  * Starts an upload into fd, which the session then owns: preallocates the
+  * file if ALLO gave a size, sets up the pipe for splicing, sends the 125 and
+  * begins the transfer. If anything goes wrong, the error reply is sent and
+  * fd and the data connection are closed.
+  * @param session - the session doing the upload
+  * @param fd - the file to store into, open for writing
+  * @param allocate_size - how much space to preallocate, or 0
+  * @param unique_name - for STOU, the name the file was given, to be sent back
+  *		with the 125; otherwise NULL
+  */
+status_t begin_upload(user_session_t *session, int fd, off_t allocate_size, char *unique_name);
+
+/**
+  * Closes the pipe used by an upload
+  * @param transfer - the upload's transfer
+  */
+void close_upload_pipe(transfer_t *transfer);
+
+/**
+  * Reads the next batch of entries from the directory being listed and renders
+  * them into the transfer's data, replacing the chunk that was just sent.
+  * Closes the directory once it has all been read.
+  * @param session - the session whose listing is in progress
+  */
+status_t read_listing_chunk(user_session_t *session);
+
+/**
+  * Appends the MLSD/MLST line for one file, facts first and then its name, to
+  * out. Only the facts asked for are looked up, and statx isn't called at all
+  * when getdents64 already said everything that is needed. A symbolic link is
+  * described as itself, never as the file it points to.
+  * @param out - the string onto which to append the line
+  * @param dir_fd - the directory that name is relative to
+  * @param name - the file's name in dir_fd, or "" if dir_fd is the file itself
+  * @param shown_name - the name to put on the line
+  * @param d_type - the file's type according to getdents64, or DT_UNKNOWN
+  * @param facts - the facts to give
+  * @return FILE_READ_ERROR if the file couldn't be looked up, in which case
+  *		nothing is appended
+  */
+status_t render_mlst_entry(string_t *out, int dir_fd, char *name, char *shown_name, unsigned char d_type, uint32_t facts);
+
+/**
+  * Writes out the names of facts, each followed by a ';', as FEAT and OPTS
+  * MLST give them
+  * @param buffer - where to write the names; MLST_FACTS_SIZE is enough
+  * @param facts - the facts to name
+  * @param enabled - if not 0, every fact is named, and the ones in enabled are
+  *		marked with a '*'
+  * @return the length of what was written
+  */
+size_t render_fact_names(char *buffer, uint32_t facts, uint32_t enabled);
+
+/**
+  * Opens a path named by a client. Relative paths are looked up from the
+  * session's directory and absolute ones (or ones starting with "~") from the
+  * server's root, both with openat2's RESOLVE_BENEATH, so neither ".." nor a
+  * symlink can lead outside the root.
+  * @param session - the session the path is for
+  * @param path - the path; an empty one names the session's directory
+  * @param flags - the open flags
+  * @param mode - the mode for a file that O_CREAT creates
+  * @return the descriptor, or -1 with errno set
+  */
+int open_in_session(user_session_t *session, char *path, int flags, mode_t mode);
+
+/**
+  * Determines whether any component of a path is ".."
+  * @param path - the path to check
+  */
+uint8_t has_parent_component(char *path);
+
+/**
+  * Makes a directory named by the client the session's current directory
+  * @param session - the session to move
+  * @param path - the directory, as for open_in_session
+  * @return DIR_OPEN_ERROR if it isn't a directory the session can get to
+  */
+status_t change_directory(user_session_t *session, char *path);
+
+/**
+  * Closes the file a transfer was sending, or gives it back to the open file
+  * cache if it came from there
+  * @param session - the session whose transfer it is
+  */
+void close_transfer_file(user_session_t *session);
+
+/**
+  * Finds the real path of an open directory, or file, from /proc, without
+  * walking anything
+  * @param fd - the directory
+  * @return the path, which the caller must free, or NULL
+  */
+char *directory_path(int fd);
+
+/**
+  * Determines whether an open file is one of the server's own: its
+  * configuration file, its accounts file, or anything in its log directory
+  * @param server - the server
+  * @param fd - the file
+  * @return 1 if it is, or if where the file is can't be worked out
+  */
+uint8_t is_server_file(server_t *server, int fd);
+
+/**
+  * Opens a file named by the client for STOR, emptying it if it already
+  * exists, unless it is one of the server's own files or isn't a regular file
+  * @param session - the session uploading the file
+  * @param path - the file, as for open_in_session
+  * @return the file, or -1 with errno set
+  */
+int open_upload_file(user_session_t *session, char *path);
+
+/**
+  * Gives the session's current directory as the client sees it, relative to
+  * the server's root
+  * @param session - the session
+  */
+char *visible_directory(user_session_t *session);
+
+/**
+  * These functions all serve the purpose of handling the commands from the user
+  * once they have been read and parsed.
+  * @param session - the current session for the user
+  * @param command - the command, with its verb and argument
+  */
+status_t handle_user_command(user_session_t *session, command_line_t *command);
+status_t handle_pass_command(user_session_t *session, command_line_t *command);
+status_t handle_cwd_command(user_session_t *session, command_line_t *command);
+status_t handle_cdup_command(user_session_t *session, command_line_t *command);
+status_t handle_quit_command(user_session_t *session, command_line_t *command);
+status_t handle_abor_command(user_session_t *session, command_line_t *command);
+status_t handle_pasv_command(user_session_t *session, command_line_t *command);
+status_t handle_epsv_command(user_session_t *session, command_line_t *command);
+status_t handle_port_command(user_session_t *session, command_line_t *command);
+status_t handle_eprt_command(user_session_t *session, command_line_t *command);
+status_t handle_retr_command(user_session_t *session, command_line_t *command);
+status_t handle_pwd_command(user_session_t *session, command_line_t *command);
+status_t handle_list_command(user_session_t *session, command_line_t *command);
+status_t handle_help_command(user_session_t *session, command_line_t *command);
+status_t handle_mlsd_command(user_session_t *session, command_line_t *command);
+status_t handle_mlst_command(user_session_t *session, command_line_t *command);
+status_t handle_opts_command(user_session_t *session, command_line_t *command);
+status_t handle_feat_command(user_session_t *session, command_line_t *command);
+status_t handle_rest_command(user_session_t *session, command_line_t *command);
+status_t handle_allo_command(user_session_t *session, command_line_t *command);
+status_t handle_stor_command(user_session_t *session, command_line_t *command);
+status_t handle_stou_command(user_session_t *session, command_line_t *command);
+status_t handle_mode_command(user_session_t *session, command_line_t *command);
+status_t handle_size_command(user_session_t *session, command_line_t *command);
+
+/**
+  * Handles "OPTS MODE Z LEVEL n", which sets the compression level for MODE Z
+  * @param session - the current session for the user
+  * @param options - what follows "MODE" in the argument
+  */
+status_t handle_opts_mode(user_session_t *session, char *options);
+status_t handle_unrecognized_command(user_session_t *session, command_line_t *command);
+
+/**
+  * An entry in the table of commands the server understands
+  * verb - the command's name
+  * handler - the function that carries the command out
+  * ends_session - whether the session is over once the command is done
+  */
+typedef struct
+{
+	char *verb;
+	status_t (*handler)(user_session_t *, command_line_t *);
+	uint8_t ends_session;
+} command_entry_t;
+
+static command_entry_t commands[] =
+{
+	{ "USER", handle_user_command, 0 },
+	{ "PASS", handle_pass_command, 0 },
+	{ "CWD", handle_cwd_command, 0 },
+	{ "CDUP", handle_cdup_command, 0 },
+	{ "QUIT", handle_quit_command, 1 },
+	{ "ABOR", handle_abor_command, 0 },
+	{ "PASV", handle_pasv_command, 0 },
+	{ "EPSV", handle_epsv_command, 0 },
+	{ "PORT", handle_port_command, 0 },
+	{ "EPRT", handle_eprt_command, 0 },
+	{ "RETR", handle_retr_command, 0 },
+	{ "PWD", handle_pwd_command, 0 },
+	{ "LIST", handle_list_command, 0 },
+	{ "HELP", handle_help_command, 0 },
+	{ "MLSD", handle_mlsd_command, 0 },
+	{ "MLST", handle_mlst_command, 0 },
+	{ "OPTS", handle_opts_command, 0 },
+	{ "FEAT", handle_feat_command, 0 },
+	{ "REST", handle_rest_command, 0 },
+	{ "ALLO", handle_allo_command, 0 },
+	{ "STOR", handle_stor_command, 0 },
+	{ "STOU", handle_stou_command, 0 },
+	{ "MODE", handle_mode_command, 0 },
+	{ "SIZE", handle_size_command, 0 },
+};
+
+/**
+  * Hash table from packed verbs (see pack_verb) to entries in commands, so that
+  * a command is found in one step. Filled in by build_command_table before any
+  * sessions start; a key of 0 marks an empty slot.
+  */
+static struct
+{
+	uint32_t key;
+	command_entry_t *entry;
+} command_table[COMMAND_TABLE_SIZE];
+
+/**
+  * Fills in command_table from commands
+  */
+void build_command_table(void);
+
+/**
+  * Looks a packed verb up in command_table
+  * @param key - the packed verb
+  * @return the command's entry, or NULL if there's no such command
+  */
+command_entry_t *find_command(uint32_t key);
+
+/**
+  * Works out which slot of command_table a packed verb starts looking from
+  * @param key - the packed verb
+  */
+size_t command_table_slot(uint32_t key);
+
+/**
+  * The replies the server sends that never change
+  */
+typedef enum
+{
+	REPLY_125,
+	REPLY_150,
+	REPLY_200,
+	REPLY_214,
+	REPLY_220,
+	REPLY_221,
+	REPLY_226,
+	REPLY_230,
+	REPLY_250,
+	REPLY_331,
+	REPLY_421_TOO_MANY_USERS,
+	REPLY_421_NO_CONNECTION,
+	REPLY_425,
+	REPLY_451,
+	REPLY_452,
+	REPLY_500,
+	REPLY_501,
+	REPLY_502,
+	REPLY_503,
+	REPLY_504,
+	REPLY_530,
+	REPLY_550,
+	REPLY_554,
+	REPLY_COUNT,
+} reply_id_t;
+
+/**
+  * A reply ready to go out on the wire exactly as it is
+  * text - the whole reply, code and CRLF included
+  * length - the length of text
+  */
+typedef struct
+{
+	char *text;
+	size_t length;
+} encoded_reply_t;
+
+#define ENCODE_REPLY(code, message) { code " " message "\r\n", sizeof (code " " message "\r\n") - 1 }
+
+/**
+  * Every constant reply, already encoded; the 214 is filled in by
+  * build_help_reply, since it lists the commands in command_table
+  */
+static encoded_reply_t replies[REPLY_COUNT] =
+{
+	[REPLY_125] = ENCODE_REPLY(TRANSFER_STARTING, "Connection open. Transfer starting."),
+	[REPLY_150] = ENCODE_REPLY(FILE_STATUS_OKAY, "About to open data connection."),
+	[REPLY_200] = ENCODE_REPLY(COMMAND_OKAY, "Command okay."),
+	[REPLY_220] = ENCODE_REPLY(SERVICE_READY, "Ready. Please send USER."),
+	[REPLY_221] = ENCODE_REPLY(CLOSING_CONNECTION, "Goodbye."),
+	[REPLY_226] = ENCODE_REPLY(CLOSING_DATA_CONNECTION, "Data transfer succesful. Closing connection."),
+	[REPLY_230] = ENCODE_REPLY(USER_LOGGED_IN, "Logged in."),
+	[REPLY_250] = ENCODE_REPLY(FILE_ACTION_COMPLETED, "Action successful."),
+	[REPLY_331] = ENCODE_REPLY(NEED_PASSWORD, "Username good. Please send password."),
+	[REPLY_421_TOO_MANY_USERS] = ENCODE_REPLY(SERVICE_NOT_AVAILABLE, "Too many users. Please try again later."),
+	[REPLY_421_NO_CONNECTION] = ENCODE_REPLY(SERVICE_NOT_AVAILABLE, "Could not connect to port"),
+	[REPLY_425] = ENCODE_REPLY(CANT_OPEN_DATA_CONNECTION, "Data connection not open."),
+	[REPLY_451] = ENCODE_REPLY(ACTION_ABORTED_LOCAL_ERROR, "Local error. Aborting."),
+	[REPLY_452] = ENCODE_REPLY(NOT_TAKEN_INSUFFICIENT_STORAGE, "Not enough storage space."),
+	[REPLY_500] = ENCODE_REPLY(COMMAND_UNRECOGNIZED, "Unrecognized command."),
+	[REPLY_501] = ENCODE_REPLY(SYNTAX_ERROR, "Error in command parameters."),
+	[REPLY_502] = ENCODE_REPLY(NOT_IMPLEMENTED, "Given command not implemented."),
+	[REPLY_503] = ENCODE_REPLY(BAD_SEQUENCE, "Please check the command sequence."),
+	[REPLY_504] = ENCODE_REPLY(NOT_IMPLEMENTED_FOR_PARAMETER, "Command not implemented for that parameter."),
+	[REPLY_530] = ENCODE_REPLY(NOT_LOGGED_IN, "Not logged in."),
+	[REPLY_550] = ENCODE_REPLY(ACTION_NOT_TAKEN_FILE_UNAVAILABLE2, "Requested action not completed."),
+	[REPLY_554] = ENCODE_REPLY(INVALID_REST_PARAMETER, "Restart point is past the end of the file."),
+};
+
+static char help_reply[HELP_REPLY_SIZE];
+
+/**
+  * Encodes the multiline 214 reply to HELP, listing every command in commands
+  * in alphabetical order
+  */
+void build_help_reply(void);
+
+/**
+  * qsort comparison function for putting verbs in alphabetical order
+  * @param a - the first verb. Actually of type char **
+  * @param b - the second verb. Actually of type char **
+  */
+int compare_verbs(const void *a, const void *b);
+
+/**
+  * Sends one of the constant replies to the session's client, and logs it
+  * @param session - the session to which to send the reply
+  * @param reply - which reply to send
+  */
+status_t send_reply(user_session_t *session, reply_id_t reply);
+
+/**
+  * Sends a reply put together from several pieces to the session's client with
+  * a single writev, and logs it, without copying the pieces together first.
+  * Whatever the socket won't take yet is queued up on the session: in threaded
+  * mode it is sent straight away, waiting as need be, and in event mode it
+  * goes out once the socket is writable again.
+  * @param session - the session to which to send the reply
+  * @param parts - the pieces of the reply, CRLF included
+  * @param count - the number of pieces
+  */
+status_t send_reply_parts(user_session_t *session, struct iovec *parts, int count);
+
+/**
+  * Sends as much of the session's queued replies as the command socket will
+  * take
+  * @param session - the session whose replies to send
+  * @return SOCKET_WOULD_BLOCK if some are still left to go out
+  */
+status_t flush_replies(user_session_t *session);
+
+/**
+  * The following functions are all rather straightforward - in the current
+  * session for the user, they send a static (in all but one case) message back
+  * to the client. The one exception is send_257, which uses the directory
+  * information in session to send the current working directory to the client.
+  */
+status_t send_125(user_session_t *session);
+status_t send_200(user_session_t *session);
+status_t send_214(user_session_t *session);
+status_t send_221(user_session_t *session);
+status_t send_226(user_session_t *session);
+status_t send_250(user_session_t *session);
+status_t send_257(user_session_t *session);
+status_t send_330(user_session_t *session);
+status_t send_331(user_session_t *session);
+status_t send_425(user_session_t *session);
+status_t send_451(user_session_t *session);
+status_t send_452(user_session_t *session);
+status_t send_500(user_session_t *session);
+status_t send_501(user_session_t *session);
+status_t send_502(user_session_t *session);
+status_t send_503(user_session_t *session);
+status_t send_504(user_session_t *session);
+status_t send_530(user_session_t *session);
+status_t send_550(user_session_t *session);
+status_t send_554(user_session_t *session);
+
+int main(int argc, char *argv[])
+{
+	status_t error;
+
+	//Done before anything starts a thread so that every thread inherits the
+	//blocked signals
+	error = set_up_stop_signals();
+	if (error)
+	{
+		return error;
+	}
+
+	build_command_table();
+	build_help_reply();
+
+	server_t server;
+	error = initialize_server(&server);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	char start_up_message[] = "Config file read. Starting rest of server up.\n";
+	error = write_log(server.log, start_up_message, sizeof start_up_message);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	uint16_t port;
+	error = parse_command_line(argc, argv, &port);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	char socket_message[] = "Setting up socket.\n";
+	error = write_log(server.log, socket_message, sizeof socket_message);
+	if (error)
+	{
+		goto exit0;
+	}
+	int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_sock < 0)
+	{
+		error = SOCKET_OPEN_ERROR;
+		goto exit0;
+	}
+
+	struct sockaddr_in sad;
+	memset(&sad, 0, sizeof sad);
+	sad.sin_family = AF_INET;
+	sad.sin_addr.s_addr = INADDR_ANY;
+	sad.sin_port = htons(port);
+
+	if (bind(listen_sock, (struct sockaddr *) &sad, sizeof sad) < 0)
+	{
+		error = BIND_ERROR;
+		goto exit1;
+	}
+
+	if (listen(listen_sock, server.max_users) < 0)
+	{
+		error = LISTEN_ERROR;
+		goto exit1;
+	}
+
+	if (server.event_mode)
+	{
+		error = run_event_loops(&server, listen_sock);
+	}
+	else
+	{
+		error = run_worker_pool(&server, listen_sock);
+	}
+
+	char closing_message[] = "Server closing down.\n";
+	if (!error)
+	{
+		//A shutdown was asked for. Sessions may still be running on other
+		//threads, so don't free anything out from under them; just make sure
+		//everything logged makes it to the file before the process goes away
+		write_log(server.log, closing_message, sizeof closing_message);
+		close(listen_sock);
+		close_log_file(server.log);
+		return error;
+	}
+
+exit1:
+	write_log(server.log, closing_message, sizeof closing_message);
+	close(listen_sock);
+exit0:
+	free_server(&server);
+	print_error_message(error);
+	return error;
+}
+
+void request_stop(int signal_number)
+{
+	stop_requested = 1;
+}
+
+void request_reload(int signal_number)
+{
+	reload_requested = 1;
+}
+
+void reload_if_requested(server_t *server)
+{
+	if (!reload_requested)
+	{
+		return;
+	}
+	reload_requested = 0;
+
+	if (server->accounts == NULL)
+	{
+		return;
+	}
+
+	status_t error = reload_accounts(server->accounts);
+	if (error)
+	{
+		//The accounts that were there before stay in use
+		char *error_str = get_error_message(error);
+		write_log(server->log, error_str, strlen(error_str));
+		printf("%s", error_str);
+		return;
+	}
+
+	char reloaded_message[] = "Accounts reloaded.\n";
+	write_log(server->log, reloaded_message, sizeof reloaded_message);
+}
+
+status_t set_up_stop_signals(void)
+{
+	//No SA_RESTART, so that a blocked accept gets interrupted
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = request_stop;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGINT, &action, NULL) < 0 || sigaction(SIGTERM, &action, NULL) < 0)
+	{
+		return SIGNAL_ERROR;
+	}
+
+	action.sa_handler = request_reload;
+	if (sigaction(SIGHUP, &action, NULL) < 0)
+	{
+		return SIGNAL_ERROR;
+	}
+
+	//Writing to a client that has gone away shouldn't kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+	return SUCCESS;
+}
+
+void unblock_stop_signals(void)
+{
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGHUP);
+	pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+}
+
+status_t parse_command_line(int argc, char *argv[], uint16_t *port)
+{
+	if (argc != ARGC)
+	{
+		printf("Usage: ftpserver port\n");
+		return BAD_COMMAND_LINE;
+	}
+
+	int tmp = atoi(argv[1]);
+	if (tmp <= 0 || tmp > UINT16_MAX)
+	{
+		printf("Port number must be positive and less than or equal to %u.\n", UINT16_MAX);
+		return BAD_COMMAND_LINE;
+	}
+	*port = tmp;
+
+	return SUCCESS;
+}
+
+status_t run_worker_pool(server_t *server, int listen_sock)
+{
+	status_t error = SUCCESS;
+
+	char pool_message[] = "Starting worker threads.\n";
+	write_log(server->log, pool_message, sizeof pool_message);
+
+	//Allocated rather than kept on the stack, since the workers are still
+	//using it when a shutdown makes this function return
+	worker_pool_t *pool = malloc(sizeof *pool);
+	if (pool == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
+	pool->server = server;
+
+	error = connection_queue_initialize(&pool->queue, server->accept_queue_size);
+	if (error)
+	{
+		goto exit1;
+	}
+
+	pool->threads = malloc(server->max_users * sizeof *pool->threads);
+	if (pool->threads == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit2;
+	}
+
+	int i;
+	for (i = 0; i < server->max_users; i++)
+	{
+		if (pthread_create(pool->threads + i, NULL, worker_handler, pool) != 0)
+		{
+			error = PTHREAD_CREATE_ERROR;
+			goto exit3;
+		}
+	}
+
+	unblock_stop_signals();
+	while (!stop_requested)
+	{
+		reload_if_requested(server);
+
+		int connection_sock = accept(listen_sock, NULL, NULL);
+		if (connection_sock < 0)
+		{
+			if (errno != EINTR)
+			{
+				char *error_str = get_error_message(ACCEPT_ERROR);
+				write_log(server->log, error_str, strlen(error_str));
+				printf("%s", error_str);
+			}
+			continue;
+		}
+
+		char join_message[] = "Client joined.\n";
+		write_log(server->log, join_message, sizeof join_message);
+		printf("%s", join_message);
+
+		if (connection_queue_try_push(&pool->queue, connection_sock) != SUCCESS)
+		{
+			reject_connection(server, connection_sock);
+		}
+	}
+
+	//equivalent to return SUCCESS (and leave the pool to the workers)
+	goto exit0;
+
+	//Only get here if starting the workers failed part way through
+exit3:
+	while (i-- > 0)
+	{
+		pthread_cancel(pool->threads[i]);
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+exit2:
+	connection_queue_free(&pool->queue);
+exit1:
+	free(pool);
+exit0:
+	return error;
+}
+
+void *worker_handler(void *void_args)
+{
+	worker_pool_t *pool = (worker_pool_t *) void_args;
+
+	while (1)
+	{
+		int connection_sock;
+		connection_queue_pop(&pool->queue, &connection_sock);
+
+		//use calloc to make sure the state flags are all set to 0.
+		user_session_t *session = calloc(1, sizeof *session);
+		if (session == NULL)
+		{
+			reject_connection(pool->server, connection_sock);
+			continue;
+		}
+		session->command_sock = connection_sock;
+		session->server = pool->server;
+
+		client_handler(session);
+	}
+
+	return NULL;
+}
+
+void client_handler(user_session_t *session)
+{
+	status_t error;
+	char quitting_message[] = "Client quitting.\n";
+
+	error = initialize_session(session);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	error = send_reply(session, REPLY_220);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	uint8_t done = 0;
+	do
+	{
+		char_vector_clear(&session->command);
+		error = wait_for_command(session);
+		if (!error)
+		{
+			error = read_buffered_line(&session->reader, &session->command);
+		}
+		if (!error)
+		{
+			error = process_command(session, &session->command, &done);
+		}
+
+		//Any data connection work the command started happens here; the sockets
+		//are blocking, so this doesn't come back until it's all done
+		if (!error)
+		{
+			error = advance_session(session);
+		}
+
+		if (error)
+		{
+			log_session_error(session, error);
+		}
+	} while (!error && !done);
+
+exit0:
+	write_log(session->server->log, quitting_message, sizeof quitting_message);
+	printf("%s", quitting_message);
+	free_session(session);
+	set_log_session(0);
+}
+
+void reject_connection(server_t *server, int sock)
+{
+	char *error_str = get_error_message(QUEUE_FULL_ERROR);
+	write_log(server->log, error_str, strlen(error_str));
+	//There's no session to queue the reply on, but the socket is still a
+	//blocking one here
+	encoded_reply_t *encoded = replies + REPLY_421_TOO_MANY_USERS;
+	send(sock, encoded->text, encoded->length, 0);
+	write_log_event(server->log, LOG_EVENT_SENT, encoded->text, encoded->length);
+	close(sock);
+}
+
+status_t initialize_session(user_session_t *session)
+{
+	status_t error = SUCCESS;
+
+	//Set these first so that free_session is safe no matter what
+	session->data_sock = -1;
+	session->pasv_sock = -1;
+	session->pasv_leased = 0;
+	session->accept_prev = NULL;
+	session->accept_next = NULL;
+	session->waiting_fd = -1;
+	session->state = SESSION_READING_COMMAND;
+	session->transfer.fd = -1;
+	session->transfer.cached_file = NULL;
+	session->transfer.contents = NULL;
+	session->transfer.filling = 0;
+	session->mlst_facts = MLST_DEFAULT_FACTS;
+	session->restart_offset = 0;
+	session->allocate_size = 0;
+	session->mode_z = 0;
+	session->compression_level = Z_DEFAULT_COMPRESSION;
+	session->compressor = NULL;
+	session->transfer.compressor = NULL;
+	session->transfer.receiving = 0;
+	session->transfer.pipe_fds[0] = -1;
+	session->transfer.pipe_fds[1] = -1;
+	session->directory_fd = -1;
+	string_initialize(&session->transfer.data);
+	string_initialize(&session->command);
+	string_initialize(&session->reply_queue);
+	session->reply_queue_sent = 0;
+	line_reader_initialize(&session->reader, session->command_sock);
+
+	//Every reply goes out in a single write, so Nagle only holds replies back:
+	//a 226 would wait for the client's delayed ACK of the 125 before it
+	int on = 1;
+	setsockopt(session->command_sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+	//Everything this thread logs from here on is for the new session
+	session->id = __atomic_add_fetch(&session->server->next_session_id, 1, __ATOMIC_RELAXED);
+	set_log_session(session->id);
+
+	//Every session starts out in the root
+	session->directory = strdup(session->server->root);
+	if (session->directory == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
+
+	session->directory_fd = dup(session->server->root_fd);
+	struct stat directory_stat;
+	if (session->directory_fd < 0 || fstat(session->directory_fd, &directory_stat) < 0)
+	{
+		error = DIR_OPEN_ERROR;
+		goto exit0;
+	}
+	session->directory_dev = directory_stat.st_dev;
+	session->directory_ino = directory_stat.st_ino;
+
+exit0:
+	return error;
+}
+
+void free_session(user_session_t *session)
+{
+	free(session->username);
+	close_upload_pipe(&session->transfer);
+	free_compressor(session->compressor);
+	close_transfer_file(session);
+
+	if (session->transfer.filling)
+	{
+		listing_fill_finish(session->server->listing_cache, &session->transfer.fill, 0);
+	}
+
+	close_data_connection(session);
+
+	close(session->command_sock);
+	string_uninitialize(&session->transfer.data);
+	string_uninitialize(&session->command);
+	string_uninitialize(&session->reply_queue);
+	if (session->directory_fd >= 0)
+	{
+		close(session->directory_fd);
+	}
+	free(session->directory);
+	free(session);
+}
+
+status_t process_command(user_session_t *session, string_t *line, uint8_t *done)
+{
+	status_t error;
+
+	error = write_received_message_to_log(session->server->log, line);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	//The verb and argument point straight into line, so nothing gets copied
+	command_line_t command;
+	parse_command(line, &command);
+
+	command_entry_t *entry = find_command(command.key);
+	if (entry == NULL)
+	{
+		error = handle_unrecognized_command(session, &command);
+		goto exit0;
+	}
+
+	*done = entry->ends_session;
+	error = entry->handler(session, &command);
+
+exit0:
+	return error;
+}
+
+void build_command_table(void)
+{
+	size_t i;
+	for (i = 0; i < sizeof commands / sizeof *commands; i++)
+	{
+		uint32_t key = pack_verb(commands[i].verb, strlen(commands[i].verb));
+		size_t slot = command_table_slot(key);
+		while (command_table[slot].key != 0)
+		{
+			slot = (slot + 1) % COMMAND_TABLE_SIZE;
+		}
+
+		command_table[slot].key = key;
+		command_table[slot].entry = commands + i;
+	}
+}
+
+command_entry_t *find_command(uint32_t key)
+{
+	if (key == 0)
+	{
+		return NULL;
+	}
+
+	size_t slot = command_table_slot(key);
+	while (command_table[slot].key != 0)
+	{
+		if (command_table[slot].key == key)
+		{
+			return command_table[slot].entry;
+		}
+		slot = (slot + 1) % COMMAND_TABLE_SIZE;
+	}
+
+	return NULL;
+}
+
+size_t command_table_slot(uint32_t key)
+{
+	//Multiplicative hashing; the top bits of the product are the best mixed
+	return (uint32_t) (key * 2654435761u) >> (32 - COMMAND_TABLE_BITS);
+}
+
+void log_session_error(user_session_t *session, status_t error)
+{
+	char message[] = "Error encountered while processing: ";
+	string_t error_message;
+	string_initialize(&error_message);
+	char *error_string = get_error_message(error);
+	string_assign_from_char_array(&error_message, error_string);
+	prepend_and_write_to_log(session->server->log, &error_message, message, sizeof message);
+	string_uninitialize(&error_message);
+}
+
+status_t advance_session(user_session_t *session)
+{
+	status_t error = SUCCESS;
+
+	//In threaded mode the sockets block, so wait on them as long as it takes;
+	//in event mode just check whether they're ready
+	int timeout = session->loop == NULL ? -1 : 0;
+
+	while (session->state != SESSION_READING_COMMAND)
+	{
+		if (session->state == SESSION_ACCEPTING_DATA)
+		{
+			//pasv_sock is always nonblocking, so this never waits
+			error = accept_data_connection(session);
+			if (error == SUCCESS)
+			{
+				session->state = SESSION_TRANSFERRING;
+				continue;
+			}
+
+			if (error != SOCKET_WOULD_BLOCK)
+			{
+				goto exit0;
+			}
+
+			int remaining = accept_time_remaining(session);
+			if (remaining == 0)
+			{
+				//The client never connected; don't hold on to the session (or
+				//the port) waiting for it any longer
+				error = stop_accepting(session);
+				if (error)
+				{
+					goto exit0;
+				}
+
+				continue;
+			}
+
+			if (session->loop != NULL)
+			{
+				goto exit0;
+			}
+
+			error = SUCCESS;
+			struct pollfd poll_fd = { session->pasv_sock, POLLIN, 0 };
+			poll(&poll_fd, 1, remaining);
+		}
+		else if (session->state == SESSION_CONNECTING_DATA)
+		{
+			//The connection is done once the socket becomes writable
+			struct pollfd poll_fd = { session->data_sock, POLLOUT, 0 };
+			int ready = poll(&poll_fd, 1, timeout);
+			if (ready == 0 || (ready < 0 && errno == EINTR))
+			{
+				error = ready == 0 ? SOCKET_WOULD_BLOCK : SUCCESS;
+				if (error)
+				{
+					goto exit0;
+				}
+
+				continue;
+			}
+
+			session->state = SESSION_READING_COMMAND;
+			error = finish_connection(session->data_sock);
+			if (error)
+			{
+				close_data_connection(session);
+				error = send_reply(session, REPLY_421_NO_CONNECTION);
+				goto exit0;
+			}
+
+			if (session->loop == NULL)
+			{
+				//Go back to a plain blocking socket for threaded mode
+				fcntl(session->data_sock, F_SETFL, fcntl(session->data_sock, F_GETFL) & ~O_NONBLOCK);
+			}
+
+			error = send_200(session);
+			if (error)
+			{
+				goto exit0;
+			}
+		}
+		else if (session->state == SESSION_TRANSFERRING)
+		{
+			uint8_t done = 0;
+			error = session->transfer.step(session, &done);
+			if (error == SOCKET_WOULD_BLOCK)
+			{
+				goto exit0;
+			}
+
+			if (error || done)
+			{
+				error = finish_transfer(session, error);
+				if (error)
+				{
+					goto exit0;
+				}
+			}
+		}
+	}
+
+exit0:
+	return error;
+}
+
+status_t run_event_loops(server_t *server, int listen_sock)
+{
+	status_t error = SUCCESS;
+
+	char event_message[] = "Starting event loops.\n";
+	write_log(server->log, event_message, sizeof event_message);
+
+	event_loop_t *loops = calloc(server->event_threads, sizeof *loops);
+	if (loops == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit0;
+	}
+
+	int i;
+	for (i = 0; i < server->event_threads; i++)
+	{
+		loops[i].server = server;
+		loops[i].accepting = NULL;
+		loops[i].incoming = NULL;
+		pthread_mutex_init(&loops[i].incoming_lock, NULL);
+		loops[i].epoll_fd = epoll_create1(0);
+		if (loops[i].epoll_fd < 0)
+		{
+			pthread_mutex_destroy(&loops[i].incoming_lock);
+			error = EPOLL_ERROR;
+			goto exit1;
+		}
+
+		//Registered with no session, which is how the loop tells it apart
+		struct epoll_event wake_event;
+		wake_event.events = EPOLLIN;
+		wake_event.data.ptr = NULL;
+		loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (loops[i].wake_fd < 0 ||
+			epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &wake_event) < 0)
+		{
+			if (loops[i].wake_fd >= 0)
+			{
+				close(loops[i].wake_fd);
+			}
+			close(loops[i].epoll_fd);
+			pthread_mutex_destroy(&loops[i].incoming_lock);
+			error = EPOLL_ERROR;
+			goto exit1;
+		}
+
+		if (pthread_create(&loops[i].thread, NULL, event_loop_handler, loops + i) != 0)
+		{
+			close(loops[i].wake_fd);
+			close(loops[i].epoll_fd);
+			pthread_mutex_destroy(&loops[i].incoming_lock);
+			error = PTHREAD_CREATE_ERROR;
+			goto exit1;
+		}
+	}
+
+	//Hand the connections out to the loops in turn
+	unblock_stop_signals();
+	int next_loop = 0;
+	while (!stop_requested)
+	{
+		reload_if_requested(server);
+
+		int connection_sock = accept(listen_sock, NULL, NULL);
+		if (connection_sock < 0)
+		{
+			if (errno != EINTR)
+			{
+				char *error_str = get_error_message(ACCEPT_ERROR);
+				write_log(server->log, error_str, strlen(error_str));
+				printf("%s", error_str);
+			}
+			continue;
+		}
+
+		char join_message[] = "Client joined.\n";
+		write_log(server->log, join_message, sizeof join_message);
+
+		//Only the acceptor adds sessions, so nothing can slip in between the
+		//check and the increment
+		if (__atomic_load_n(&server->active_sessions, __ATOMIC_ACQUIRE) >= server->max_users)
+		{
+			reject_connection(server, connection_sock);
+			continue;
+		}
+
+		//use calloc to make sure the state flags are all set to 0.
+		user_session_t *session = calloc(1, sizeof *session);
+		if (session == NULL)
+		{
+			reject_connection(server, connection_sock);
+			continue;
+		}
+		__atomic_add_fetch(&server->active_sessions, 1, __ATOMIC_ACQ_REL);
+		session->command_sock = connection_sock;
+		session->server = server;
+		event_loop_t *loop = loops + next_loop;
+		session->loop = loop;
+		next_loop = (next_loop + 1) % server->event_threads;
+
+		if (initialize_session(session) != SUCCESS)
+		{
+			end_event_session(session);
+			continue;
+		}
+
+		//Nothing on the command socket waits: reads come back empty handed and
+		//replies the socket won't take are queued, to be sent on EPOLLOUT
+		fcntl(connection_sock, F_SETFL, fcntl(connection_sock, F_GETFL) | O_NONBLOCK);
+		session->reader.read_flags = MSG_DONTWAIT;
+		set_log_session(0);
+
+		//The loop's thread does everything else, so the session is never touched
+		//from two threads at once; once it's handed over, it's gone from here
+		pthread_mutex_lock(&loop->incoming_lock);
+		session->incoming_next = loop->incoming;
+		loop->incoming = session;
+		pthread_mutex_unlock(&loop->incoming_lock);
+
+		uint64_t one = 1;
+		write(loop->wake_fd, &one, sizeof one);
+	}
+
+	//equivalent to return SUCCESS (and leave the loops running their sessions)
+	goto exit0;
+
+	//Only get here if setting up the loops failed part way through
+exit1:
+	while (i-- > 0)
+	{
+		pthread_cancel(loops[i].thread);
+		pthread_join(loops[i].thread, NULL);
+		close(loops[i].wake_fd);
+		close(loops[i].epoll_fd);
+		pthread_mutex_destroy(&loops[i].incoming_lock);
+	}
+	free(loops);
+exit0:
+	return error;
+}
+
+void *event_loop_handler(void *void_args)
+{
+	event_loop_t *loop = (event_loop_t *) void_args;
+	struct epoll_event events[EVENT_BATCH_SIZE];
+
+	while (1)
+	{
+		int ready = epoll_wait(loop->epoll_fd, events, EVENT_BATCH_SIZE, next_accept_timeout(loop));
+		if (ready < 0)
+		{
+			if (errno != EINTR)
+			{
+				char *error_str = get_error_message(EPOLL_ERROR);
+				write_log(loop->server->log, error_str, strlen(error_str));
+			}
+			continue;
+		}
+
+		//A session is only ever registered on one of its sockets at a time, so
+		//each session shows up at most once in a batch
+		int i;
+		for (i = 0; i < ready; i++)
+		{
+			user_session_t *session = events[i].data.ptr;
+			if (session == NULL)
+			{
+				start_incoming_sessions(loop);
+				continue;
+			}
+
+			set_log_session(session->id);
+			drive_session(session);
+			set_log_session(0);
+		}
+
+		expire_accepting_sessions(loop);
+	}
+
+	return NULL;
+}
+
+void start_incoming_sessions(event_loop_t *loop)
+{
+	uint64_t count;
+	read(loop->wake_fd, &count, sizeof count);
+
+	pthread_mutex_lock(&loop->incoming_lock);
+	user_session_t *session = loop->incoming;
+	loop->incoming = NULL;
+	pthread_mutex_unlock(&loop->incoming_lock);
+
+	while (session != NULL)
+	{
+		user_session_t *next = session->incoming_next;
+		set_log_session(session->id);
+		if (send_reply(session, REPLY_220) != SUCCESS ||
+			wait_on_session_socket(session) != SUCCESS)
+		{
+			end_event_session(session);
+		}
+		set_log_session(0);
+		session = next;
+	}
+}
+
+void drive_session(user_session_t *session)
+{
+	status_t error;
+	uint8_t done = 0;
+
+	while (1)
+	{
+		//Don't take on any more work while the client is behind on reading
+		//its replies
+		error = flush_replies(session);
+		if (error)
+		{
+			break;
+		}
+
+		error = advance_session(session);
+		if (error)
+		{
+			break;
+		}
+
+		//Keep whatever has been read of the command so far if the rest of it
+		//hasn't arrived yet
+		error = read_buffered_line(&session->reader, &session->command);
+		if (error)
+		{
+			break;
+		}
+
+		error = process_command(session, &session->command, &done);
+		char_vector_clear(&session->command);
+		if (error || done)
+		{
+			break;
+		}
+	}
+
+	if (error == SOCKET_WOULD_BLOCK && !done)
+	{
+		error = wait_on_session_socket(session);
+		if (!error)
+		{
+			return;
+		}
+	}
+
+	if (error && error != SOCKET_WOULD_BLOCK)
+	{
+		log_session_error(session, error);
+	}
+
+	//Give a goodbye that didn't fit a last chance to go out, but don't wait
+	//on it
+	flush_replies(session);
+
+	char quitting_message[] = "Client quitting.\n";
+	write_log(session->server->log, quitting_message, sizeof quitting_message);
+
+	//Closing the sockets takes them out of the epoll set as well
+	end_event_session(session);
+}
+
+void end_event_session(user_session_t *session)
+{
+	server_t *server = session->server;
+	free_session(session);
+	__atomic_sub_fetch(&server->active_sessions, 1, __ATOMIC_ACQ_REL);
+}
+
+status_t wait_on_session_socket(user_session_t *session)
+{
+	status_t error = SUCCESS;
+
+	struct epoll_event event;
+	event.data.ptr = session;
+	int fd;
+	if (string_length(&session->reply_queue) > 0)
+	{
+		//Nothing else happens until the replies have gone out; see drive_session
+		fd = session->command_sock;
+		event.events = EPOLLOUT;
+	}
+	else if (session->state == SESSION_ACCEPTING_DATA)
+	{
+		fd = session->pasv_sock;
+		event.events = EPOLLIN;
+	}
+	else if (session->state == SESSION_TRANSFERRING && session->transfer.receiving)
+	{
+		fd = session->data_sock;
+		event.events = EPOLLIN | EPOLLRDHUP;
+	}
+	else if (session->state == SESSION_CONNECTING_DATA || session->state == SESSION_TRANSFERRING)
+	{
+		fd = session->data_sock;
+		event.events = EPOLLOUT;
+	}
+	else
+	{
+		fd = session->command_sock;
+		event.events = EPOLLIN | EPOLLRDHUP;
+	}
+
+	if (fd != session->waiting_fd && session->waiting_fd >= 0)
+	{
+		//The old descriptor may well be closed already, which takes it out of
+		//the set on its own, so don't worry if this fails
+		epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_DEL, session->waiting_fd, NULL);
+	}
+
+	//Descriptor numbers get reused, so whether or not fd is already registered
+	//can't be known for sure; try one and fall back to the other
+	int op = fd == session->waiting_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(session->loop->epoll_fd, op, fd, &event) < 0)
+	{
+		op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		if (epoll_ctl(session->loop->epoll_fd, op, fd, &event) < 0)
+		{
+			error = EPOLL_ERROR;
+			goto exit0;
+		}
+	}
+	session->waiting_fd = fd;
+
+exit0:
+	return error;
+}
+
+status_t wait_for_command(user_session_t *session)
+{
+	status_t error = SUCCESS;
+
+	//Whatever is buffered already might well be a whole command
+	while (session->pasv_sock >= 0 && session->reader.start == session->reader.end)
+	{
+		struct pollfd poll_fds[] =
+		{
+			{ session->command_sock, POLLIN, 0 },
+			{ session->pasv_sock, POLLIN, 0 },
+		};
+		int ready = poll(poll_fds, 2, accept_time_remaining(session));
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			//Leave it to the read to find out what's wrong
+			break;
+		}
+
+		if (ready == 0)
+		{
+			//No transfer is waiting on the connection, so there's nothing to
+			//answer; a transfer command from here on just gets a 425
+			error = stop_accepting(session);
+			goto exit0;
+		}
+
+		if (poll_fds[1].revents != 0)
+		{
+			error = accept_data_connection(session);
+			if (error == SOCKET_WOULD_BLOCK)
+			{
+				error = SUCCESS;
+			}
+			else if (error)
+			{
+				goto exit0;
+			}
+		}
+
+		if (poll_fds[0].revents != 0)
+		{
+			break;
+		}
+	}
+
+exit0:
+	return error;
+}
+
+void start_accepting(user_session_t *session)
+{
+	session->accept_deadline = monotonic_ms() + (uint64_t) session->server->pasv_accept_timeout * 1000;
+
+	//Threaded sessions keep track of the time themselves while they wait
+	event_loop_t *loop = session->loop;
+	if (loop != NULL)
+	{
+		session->accept_prev = NULL;
+		session->accept_next = loop->accepting;
+		if (loop->accepting != NULL)
+		{
+			loop->accepting->accept_prev = session;
+		}
+		loop->accepting = session;
+	}
+}
+
+status_t accept_data_connection(user_session_t *session)
+{
+	status_t error = SUCCESS;
+
+	int sock;
+	do
+	{
+		sock = accept(session->pasv_sock, NULL, NULL);
+	} while (sock < 0 && errno == EINTR);
+
+	if (sock < 0)
+	{
+		error = errno == EAGAIN || errno == EWOULDBLOCK ? SOCKET_WOULD_BLOCK : ACCEPT_ERROR;
+		goto exit0;
+	}
+
+	//Accepted sockets don't inherit O_NONBLOCK, which suits threaded mode
+	if (session->loop != NULL)
+	{
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	}
+
+	session->data_sock = sock;
+	release_pasv_socket(session);
+
+exit0:
+	return error;
+}
+
+status_t stop_accepting(user_session_t *session)
+{
+	release_pasv_socket(session);
+	if (session->state != SESSION_ACCEPTING_DATA)
+	{
+		return SUCCESS;
+	}
+
+	clean_up_transfer(session);
+	return send_425(session);
+}
+
+void close_data_connection(user_session_t *session)
+{
+	if (session->data_sock >= 0)
+	{
+		close(session->data_sock);
+		session->data_sock = -1;
+	}
+
+	release_pasv_socket(session);
+}
+
+void release_pasv_socket(user_session_t *session)
+{
+	if (session->pasv_sock < 0)
+	{
+		return;
+	}
+
+	event_loop_t *loop = session->loop;
+	if (loop != NULL)
+	{
+		if (session->accept_prev != NULL)
+		{
+			session->accept_prev->accept_next = session->accept_next;
+		}
+		else
+		{
+			loop->accepting = session->accept_next;
+		}
+
+		if (session->accept_next != NULL)
+		{
+			session->accept_next->accept_prev = session->accept_prev;
+		}
+		session->accept_prev = NULL;
+		session->accept_next = NULL;
+
+		//A pooled socket stays open after this, so it won't drop out of the
+		//epoll set on its own
+		if (session->waiting_fd == session->pasv_sock)
+		{
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, session->pasv_sock, NULL);
+			session->waiting_fd = -1;
+		}
+	}
+
+	if (session->pasv_leased)
+	{
+		pasv_pool_release(session->server->pasv_pool, session->pasv_lease);
+		session->pasv_leased = 0;
+	}
+	else
+	{
+		close(session->pasv_sock);
+	}
+	session->pasv_sock = -1;
+}
+
+int accept_time_remaining(user_session_t *session)
+{
+	uint64_t now = monotonic_ms();
+	if (now >= session->accept_deadline)
+	{
+		return 0;
+	}
+
+	return session->accept_deadline - now;
+}
+
+uint64_t monotonic_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int next_accept_timeout(event_loop_t *loop)
+{
+	int timeout = -1;
+	user_session_t *session;
+	for (session = loop->accepting; session != NULL; session = session->accept_next)
+	{
+		int remaining = accept_time_remaining(session);
+		if (timeout < 0 || remaining < timeout)
+		{
+			timeout = remaining;
+		}
+	}
+
+	return timeout;
+}
+
+void expire_accepting_sessions(event_loop_t *loop)
+{
+	user_session_t *session = loop->accepting;
+	while (session != NULL)
+	{
+		//Either way the session comes out of the list, and driving it might
+		//even free it
+		user_session_t *next = session->accept_next;
+		if (accept_time_remaining(session) == 0)
+		{
+			set_log_session(session->id);
+			if (accept_data_connection(session) == SUCCESS)
+			{
+				if (session->state == SESSION_ACCEPTING_DATA)
+				{
+					session->state = SESSION_TRANSFERRING;
+				}
+			}
+			else
+			{
+				//A 425 that can't be sent shows up as soon as the session is
+				//driven
+				stop_accepting(session);
+			}
+			drive_session(session);
+			set_log_session(0);
+		}
+		session = next;
+	}
+}
+
+status_t handle_user_command(user_session_t *session, command_line_t *command)
+{
+	status_t error;
+
+	if (session->logged_in)
+	{
+		error = send_330(session);
+		goto exit0;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit0;
+	}
+
+	//A new USER starts over, whether or not the account exists
+	free(session->username);
+	session->username = NULL;
+
+	size_t epoch;
+	accounts_table_t *accounts = accounts_read_begin(session->server->accounts, &epoch);
+	account_t account;
+	get_account_by_username(accounts, command->argument.start, &account);
+	if (account.username != NULL)
+	{
+		session->username = strdup(account.username);
+	}
+	accounts_read_end(session->server->accounts, epoch);
+
+	if (session->username == NULL)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	error = send_331(session);
+	if (error)
+	{
+		goto exit0;
+	}
+
+exit0:
+	return error;
+}
+
+status_t handle_pass_command(user_session_t *session, command_line_t *command)
+{
+	status_t error;
+
+	//Make sure that a USER command has already been executed by checking this
+	//pointer value
+	if (session->username == NULL)
+	{
+		error = send_503(session);
+		goto exit0;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit0;
+	}
+
+	//The account might have changed, or gone, since the USER
+	size_t epoch;
+	accounts_table_t *accounts = accounts_read_begin(session->server->accounts, &epoch);
+	account_t account;
+	get_account_by_username(accounts, session->username, &account);
+	uint8_t matches = account.username != NULL && bool_strcmp(command->argument.start, account.password);
+	accounts_read_end(session->server->accounts, epoch);
+
+	if (!matches)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	error = send_330(session);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	session->logged_in = 1;
+
+exit0:
+	return error;
+}
+
+status_t handle_cwd_command(user_session_t *session, command_line_t *command)
+{
+	status_t error;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit0;
+	}
+
+	if (change_directory(session, command->argument.start))
+	{
+		error = send_550(session);
+		goto exit0;
+	}
+
+	error = send_250(session);
+
+exit0:
+	return error;
+}
+
+status_t handle_cdup_command(user_session_t *session, command_line_t *command)
+{
+	status_t error;
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	//There's nothing above the root, so CDUP there fails
+	if (change_directory(session, ".."))
+	{
+		error = send_550(session);
+		goto exit0;
+	}
+
+	error = send_200(session);
+
+exit0:
+	return error;
+}
+
+status_t handle_quit_command(user_session_t *session, command_line_t *command)
+{
+	session->logged_in = 0;
+	return send_221(session);
+}
+
+status_t handle_abor_command(user_session_t *session, command_line_t *command)
+{
+	//Commands are only read between transfers, so there's never one to abort;
+	//just drop whatever data connection a PASV or PORT has set up
+	close_data_connection(session);
+	return send_226(session);
+}
+
+status_t handle_pasv_command(user_session_t *session, command_line_t *command)
+{
+	status_t error = SUCCESS;
+	if (!session->server->pasv_enabled)
+	{
+		error = send_502(session);
+		goto exit0;
+	}
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	//A new PASV replaces any data connection set up before it, including an
+	//earlier PASV the client never connected to
+	close_data_connection(session);
+
+	int listen_sock;
+	uint16_t listen_port;
+	if (session->server->pasv_pool != NULL)
+	{
+		error = pasv_pool_lease(session->server->pasv_pool, &session->pasv_lease, &listen_sock, &listen_port);
+		if (error)
+		{
+			error = send_425(session);
+			goto exit0;
+		}
+		session->pasv_leased = 1;
+	}
+	else
+	{
+		error = set_up_listen_socket(&listen_sock, &listen_port, AF_INET, session->server->ip4);
+		if (error)
+		{
+			goto exit0;
+		}
+
+		//The accept only happens once the client is known to have connected
+		fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+	}
+	session->pasv_sock = listen_sock;
+
+	string_t message;
+	string_initialize(&message);
+	string_assign_from_char_array(&message, "Entering passive mode (");
+	create_comma_delimited_address(&message, session->server->ip4, listen_port);
+	char_vector_push_back(&message, ')');
+
+	error = send_response(session, ENTERING_PASSIVE_MODE, string_c_str(&message), 0);
+	if (error)
+	{
+		release_pasv_socket(session);
+		goto exit1;
+	}
+
+	//Commands go on being read while the client connects; the first transfer
+	//command waits for the connection if it hasn't come in yet. See
+	//begin_transfer and advance_session.
+	start_accepting(session);
+
+exit1:
+	string_uninitialize(&message);
+exit0:
+	return error;
+}
+
+status_t handle_epsv_command(user_session_t *session, command_line_t *command)
+{
+	return handle_unrecognized_command(session, command);
+}
+
+status_t handle_port_command(user_session_t *session, command_line_t *command)
+{
+	status_t error;
+	if (!session->server->port_enabled)
+	{
+		//This command can't actually send back a 'not implemented' response, so
+		//approximate it with an "unrecognized command" response
+		error = send_500(session);
+		goto exit0;
+	}
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit0;
+	}
+
+	string_t argument;
+	string_initialize(&argument);
+	string_assign_from_char_array_with_size(&argument, command->argument.start, command->argument.length);
+	size_t ip_len;
+	string_t *split = string_split(&argument, ',', &ip_len);
+	string_uninitialize(&argument);
+
+	string_t host;
+	string_initialize(&host);
+	uint16_t port;
+	error = parse_ip_and_port(split, ip_len, &host, &port);
+	if (error)
+	{
+		error = send_501(session);
+		goto exit1;
+	}
+
+	//A new PORT replaces any data connection set up before it, including a
+	//PASV the client hasn't connected to yet
+	close_data_connection(session);
+
+	error = start_connection(&session->data_sock, string_c_str(&host), port);
+	if (error)
+	{
+		error = send_reply(session, REPLY_421_NO_CONNECTION);
+		goto exit1;
+	}
+
+	//The 200 goes out once the connection has been made; see advance_session
+	session->state = SESSION_CONNECTING_DATA;
+
+exit1:
+	string_uninitialize(&host);
+exit0:
+	return error;
+}
+
+status_t handle_eprt_command(user_session_t *session, command_line_t *command)
+{
+	return handle_unrecognized_command(session, command);
+}
+
+status_t handle_retr_command(user_session_t *session, command_line_t *command)
+{
+	/**
+	  * Possible codes:
+	  *		125: transfer_starting
+	  *		150: about to open data connection
+	  *		226: Completed successfully; closing
+	  *		250: Requested file action completed
+	  *		425: Can't open data connection
+	  *		426: Connection closed
+	  *		451: Action aborted; local error
+	  *		450: File unavailable (busy)
+	  *		550: File unavailable (doesn't exit)
+	  *		554: Restart point past the end of the file
+	  *		500, 501, 421
+	  */
+	status_t error;
+
+	//A restart point only ever applies to the transfer right after the REST
+	off_t restart_offset = session->restart_offset;
+	session->restart_offset = 0;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (session->data_sock < 0 && session->pasv_sock < 0)
+	{
+		error = send_425(session);
+		goto exit0;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit1;
+	}
+
+	//A name right in the current directory can come straight out of the open
+	//file cache, shared with every other session sending it, without being
+	//opened or even looked at
+	char *name = command->argument.start;
+	uint8_t in_directory = strchr(name, '/') == NULL && strcmp(name, "..") != 0 && strcmp(name, "~") != 0;
+	file_cache_t *file_cache = in_directory ? session->server->file_cache : NULL;
+
+	file_entry_t *cached = file_cache_acquire(file_cache, session->directory_dev, session->directory_ino, name);
+	if (cached == NULL)
+	{
+		uint64_t generation = file_cache_generation(file_cache);
+		int fd = open_in_session(session, name, O_RDONLY, 0);
+		if (fd < 0)
+		{
+			error = send_550(session);
+			goto exit1;
+		}
+
+		cached = file_cache_insert(file_cache, session->directory_fd, session->directory_dev,
+			session->directory_ino, name, fd, generation);
+		session->transfer.fd = cached == NULL ? fd : cached->fd;
+	}
+	else
+	{
+		session->transfer.fd = cached->fd;
+	}
+	session->transfer.cached_file = cached;
+
+	//Only regular files can be streamed; don't let directories and the like
+	//through to the data connection
+	struct stat file_stat;
+	if (cached != NULL)
+	{
+		file_stat = cached->stat;
+		//Small files are sent straight from memory, without touching the disk
+		session->transfer.contents = file_cache_contents(file_cache, cached);
+	}
+	else if (fstat(session->transfer.fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+	{
+		error = send_550(session);
+		goto exit2;
+	}
+
+	if (restart_offset > file_stat.st_size)
+	{
+		error = send_554(session);
+		goto exit2;
+	}
+
+	error = send_125(session);
+	if (error)
+	{
+		//let the first error supercede any that might occur here,
+		//so don't save to error
+		send_451(session);
+		goto exit2;
+	}
+
+	//The transfer itself gets carried out by advance_session, which takes care
+	//of the file and the data connection from here on
+	session->transfer.length = file_stat.st_size;
+	//sendfile can't compress, so MODE Z has to read the file itself, unless
+	//it's already in memory
+	if (session->transfer.contents != NULL)
+	{
+		begin_transfer(session, contents_transfer_step);
+	}
+	else
+	{
+		begin_transfer(session, session->mode_z ? retr_deflate_transfer_step : retr_transfer_step);
+	}
+	//sendfile reads from the offset it's given, so resuming is just a matter
+	//of starting the transfer part way in
+	session->transfer.offset = restart_offset;
+	goto exit0;
+
+exit2:
+	close_transfer_file(session);
+exit1:
+	close_data_connection(session);
+exit0:
+	return error;
+}
+
+status_t handle_pwd_command(user_session_t *session, command_line_t *command)
+{
+	//This command cannot return "not logged in" error messages, and the only
+	//other errors are "syntax errors." Ignore any possible "syntax errors" in
+	//the argument and just send the PWD
+	return send_257(session);
+}
+
+status_t handle_list_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			125: Data connection already open; transfer starting
+			150: File status okay; about to open data connection
+				226: Closing data connection; success
+				250: File action okay, completed
+				425: Can't open data connection
+				426: Connection closed
+				451: Aborted; local error
+			450: Requested file action not taken
+			500: Syntax error; command unrecognized
+			501: Syntax error in params
+			502: Not implemented
+			421: Service connection closing
+			530: Not logged in
+	*/
+
+	status_t error;
+
+	//Any other transfer throws away a restart point that RETR didn't use
+	session->restart_offset = 0;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (session->data_sock < 0 && session->pasv_sock < 0)
+	{
+		error = send_425(session);
+		goto exit0;
+	}
+
+	//Cached listings, and the listing of a single file, go straight into the
+	//transfer
+	string_t *listing = &session->transfer.data;
+	char_vector_clear(listing);
+
+	//The directory to read, if the listing isn't cached. The cache is keyed by
+	//real path, so that every way of naming a directory shares the one
+	//listing.
+	char *resolved = NULL;
+	if (command->argument.length == 0)
+	{
+		if (!listing_cache_lookup(session->server->listing_cache, session->directory, listing))
+		{
+			resolved = strdup(session->directory);
+			if (resolved == NULL)
+			{
+				error = send_451(session);
+				goto exit1;
+			}
+
+			//Stream the directory rather than reading all of it up front, so
+			//that neither memory nor the wait for the first entry grows with
+			//its size
+			session->transfer.fd = openat(session->directory_fd, ".", O_RDONLY | O_DIRECTORY);
+			if (session->transfer.fd < 0)
+			{
+				free(resolved);
+				error = send_451(session);
+				goto exit1;
+			}
+		}
+	}
+	else
+	{
+		session->transfer.fd = open_in_session(session, command->argument.start, O_RDONLY | O_DIRECTORY, 0);
+		if (session->transfer.fd < 0)
+		{
+			//If it exists but isn't a directory, assume that it's a regular
+			//file and just list it
+			int fd = errno == ENOTDIR ? open_in_session(session, command->argument.start, O_PATH, 0) : -1;
+			if (fd < 0)
+			{
+				error = send_501(session);
+				goto exit1;
+			}
+			close(fd);
+
+			string_concatenate_char_array(listing, command->argument.start);
+			char_vector_push_back(listing, '\n');
+		}
+		else
+		{
+			resolved = directory_path(session->transfer.fd);
+			if (resolved == NULL)
+			{
+				error = send_451(session);
+				goto exit1;
+			}
+
+			if (listing_cache_lookup(session->server->listing_cache, resolved, listing))
+			{
+				free(resolved);
+				resolved = NULL;
+				close(session->transfer.fd);
+				session->transfer.fd = -1;
+			}
+		}
+	}
+
+	error = send_125(session);
+	if (error)
+	{
+		free(resolved);
+		send_451(session);
+		goto exit1;
+	}
+
+	if (resolved != NULL)
+	{
+		listing_fill_begin(session->server->listing_cache, &session->transfer.fill, resolved);
+		session->transfer.filling = 1;
+		free(resolved);
+
+		session->transfer.length = 0;
+		session->transfer.machine_listing = 0;
+		begin_transfer(session, list_transfer_step);
+	}
+	else
+	{
+		session->transfer.length = string_length(listing);
+		begin_transfer(session, data_transfer_step);
+	}
+	goto exit0;
+
+exit1:
+	if (session->transfer.fd >= 0)
+	{
+		close(session->transfer.fd);
+		session->transfer.fd = -1;
+	}
+	close_data_connection(session);
+exit0:
+	return error;
+}
+
+status_t handle_help_command(user_session_t *session, command_line_t *command)
+{
+	//This command cannot return "not logged in" error messages, and the only
+	//other errors are "syntax errors." Ignore any possible "syntax errors" in
+	//the argument and just send the HELP
+	return send_214(session);
+}
+
+status_t handle_mlsd_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			125, 150, 226, 250, 425, 426, 451: as for LIST
+			501: Syntax error in params, including naming something other
+				than a directory
+			530: Not logged in
+			550: Directory doesn't exist
+	*/
+
+	status_t error;
+
+	//Any other transfer throws away a restart point that RETR didn't use
+	session->restart_offset = 0;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (session->data_sock < 0 && session->pasv_sock < 0)
+	{
+		error = send_425(session);
+		goto exit0;
+	}
+
+	//Every entry gets looked up relative to the directory, rather than by a
+	//full path that has to be walked again each time
+	session->transfer.fd = open_in_session(session, command->argument.start, O_RDONLY | O_DIRECTORY, 0);
+	if (session->transfer.fd < 0)
+	{
+		error = errno == ENOTDIR ? send_501(session) : send_550(session);
+		goto exit1;
+	}
+
+	error = send_125(session);
+	if (error)
+	{
+		send_451(session);
+		goto exit2;
+	}
+
+	//Facts can change without any name in the directory changing, so these
+	//listings don't go through the listing cache
+	char_vector_clear(&session->transfer.data);
+	session->transfer.length = 0;
+	session->transfer.machine_listing = 1;
+	session->transfer.facts = session->mlst_facts;
+	begin_transfer(session, list_transfer_step);
+	goto exit0;
+
+exit2:
+	close(session->transfer.fd);
+	session->transfer.fd = -1;
+exit1:
+	close_data_connection(session);
+exit0:
+	return error;
+}
+
+status_t handle_mlst_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			250: Facts follow
+			501: Syntax error in params
+			530: Not logged in
+			550: File doesn't exist
+	*/
+
+	status_t error;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	//A link is described as it is in MLSD, rather than as its target
+	int fd = open_in_session(session, command->argument.start, O_PATH | O_NOFOLLOW, 0);
+	if (fd < 0)
+	{
+		error = send_550(session);
+		goto exit0;
+	}
+
+	//The file is named the way the client named it
+	char *shown_name = command->argument.length == 0 ? visible_directory(session) : command->argument.start;
+
+	//The facts go on a line of their own, which has to start with a space
+	string_t line;
+	string_initialize(&line);
+	char_vector_push_back(&line, ' ');
+	if (render_mlst_entry(&line, fd, "", shown_name, DT_UNKNOWN, session->mlst_facts))
+	{
+		error = send_550(session);
+		goto exit1;
+	}
+
+	struct iovec parts[] =
+	{
+		{ FILE_ACTION_COMPLETED "-Listing ", sizeof FILE_ACTION_COMPLETED "-Listing " - 1 },
+		{ shown_name, strlen(shown_name) },
+		{ "\r\n", 2 },
+		{ (char *) string_c_str(&line), string_length(&line) },
+		{ FILE_ACTION_COMPLETED " End\r\n", sizeof FILE_ACTION_COMPLETED " End\r\n" - 1 },
+	};
+	error = send_reply_parts(session, parts, 5);
+
+exit1:
+	string_uninitialize(&line);
+	close(fd);
+exit0:
+	return error;
+}
+
+status_t handle_size_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			213: File size follows
+			501: Syntax error in params
+			530: Not logged in
+			550: File doesn't exist or isn't a regular file
+	*/
+
+	if (!session->logged_in)
+	{
+		return send_530(session);
+	}
+
+	if (command->argument.length == 0)
+	{
+		return send_501(session);
+	}
+
+	int fd = open_in_session(session, command->argument.start, O_PATH, 0);
+	struct stat file_stat;
+	uint8_t found = fd >= 0 && fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	if (!found)
+	{
+		return send_550(session);
+	}
+
+	//Always the size of the file itself, whatever MODE says
+	char size[sizeof "18446744073709551615"];
+	sprintf(size, "%llu", (unsigned long long) file_stat.st_size);
+	return send_response(session, FILE_STATUS, size, 0);
+}
+
+status_t handle_opts_command(user_session_t *session, command_line_t *command)
+{
+	char *argument = command->argument.start;
+	size_t option_len = strcspn(argument, " ");
+	if (option_len == sizeof OPTS_MODE - 1 && strncasecmp(argument, OPTS_MODE, option_len) == 0)
+	{
+		return handle_opts_mode(session, argument + option_len);
+	}
+
+	if (option_len != sizeof OPTS_MLST - 1 || strncasecmp(argument, OPTS_MLST, option_len) != 0)
+	{
+		return send_501(session);
+	}
+
+	//Facts the server doesn't know are just left out, as RFC 3659 says, and
+	//naming none at all turns them all off
+	uint32_t facts = 0;
+	char *fact = argument + option_len;
+	while (*fact == ' ')
+	{
+		fact++;
+	}
+	while (*fact != '\0')
+	{
+		size_t fact_len = strcspn(fact, ";");
+		size_t i;
+		for (i = 0; i < MLST_FACT_COUNT; i++)
+		{
+			if (strlen(mlst_facts[i].name) == fact_len && strncasecmp(fact, mlst_facts[i].name, fact_len) == 0)
+			{
+				facts |= 1 << i;
+			}
+		}
+
+		fact += fact_len;
+		if (*fact == ';')
+		{
+			fact++;
+		}
+	}
+	session->mlst_facts = facts;
+
+	char names[MLST_FACTS_SIZE];
+	size_t names_len = render_fact_names(names, facts, 0);
+	struct iovec parts[] =
+	{
+		{ COMMAND_OKAY " " OPTS_MLST " OPTS ", sizeof COMMAND_OKAY " " OPTS_MLST " OPTS " - 1 },
+		{ names, names_len },
+		{ "\r\n", 2 },
+	};
+
+	return send_reply_parts(session, parts, 3);
+}
+
+status_t handle_opts_mode(user_session_t *session, char *options)
+{
+	char mode[2];
+	char keyword[8];
+	int level;
+	char extra;
+	if (sscanf(options, "%1s %7s %d %c", mode, keyword, &level, &extra) != 3 ||
+		strcasecmp(mode, "Z") != 0 || strcasecmp(keyword, "LEVEL") != 0 ||
+		level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION)
+	{
+		return send_501(session);
+	}
+	session->compression_level = level;
+
+	char message[sizeof "MODE Z LEVEL set to 9."];
+	sprintf(message, "MODE Z LEVEL set to %d.", level);
+	return send_response(session, COMMAND_OKAY, message, 0);
+}
+
+status_t handle_mode_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			200: Mode set
+			451: Couldn't set up compression
+			501: Syntax error in params
+			504: Mode not supported
+	*/
+
+	char *mode = command->argument.start;
+	if (command->argument.length != 1)
+	{
+		return send_501(session);
+	}
+
+	if (*mode == 'S' || *mode == 's')
+	{
+		session->mode_z = 0;
+		return send_200(session);
+	}
+
+	if (*mode == 'Z' || *mode == 'z')
+	{
+		if (session->compressor == NULL &&
+			create_compressor(&session->compressor, session->compression_level) != SUCCESS)
+		{
+			return send_451(session);
+		}
+
+		session->mode_z = 1;
+		return send_200(session);
+	}
+
+	if (*mode == 'B' || *mode == 'b' || *mode == 'C' || *mode == 'c')
+	{
+		return send_504(session);
+	}
+
+	return send_501(session);
+}
+
+status_t handle_feat_command(user_session_t *session, command_line_t *command)
+{
+	char names[MLST_FACTS_SIZE];
+	size_t names_len = render_fact_names(names, (1 << MLST_FACT_COUNT) - 1, session->mlst_facts);
+	struct iovec parts[] =
+	{
+		{ SYSTEM_STATUS "-Features:\r\n", sizeof SYSTEM_STATUS "-Features:\r\n" - 1 },
+		{ " MLST ", 6 },
+		{ names, names_len },
+		{ "\r\n", 2 },
+		{ " REST STREAM\r\n", 14 },
+		{ " MODE Z\r\n", 9 },
+		{ " SIZE\r\n", 7 },
+		{ SYSTEM_STATUS " End\r\n", sizeof SYSTEM_STATUS " End\r\n" - 1 },
+	};
+
+	return send_reply_parts(session, parts, 8);
+}
+
+status_t handle_rest_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			350: Restart point stored; send the transfer command
+			501: Syntax error in params
+			530: Not logged in
+	*/
+
+	if (!session->logged_in)
+	{
+		return send_530(session);
+	}
+
+	//Only STREAM mode is supported, where the marker is just a byte offset
+	char *argument = command->argument.start;
+	char *end;
+	errno = 0;
+	unsigned long long offset = strtoull(argument, &end, 10);
+	if (errno != 0 || *argument < '0' || *argument > '9' || *end != '\0' || offset > INT64_MAX)
+	{
+		return send_501(session);
+	}
+	session->restart_offset = offset;
+
+	struct iovec parts[] =
+	{
+		{ PENDING_INFORMATION " Restarting at ", sizeof PENDING_INFORMATION " Restarting at " - 1 },
+		{ argument, command->argument.length },
+		{ ". Send RETR to resume.\r\n", sizeof ". Send RETR to resume.\r\n" - 1 },
+	};
+
+	return send_reply_parts(session, parts, 3);
+}
+
+status_t handle_allo_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			200: Size noted for the next upload
+			501: Syntax error in params
+			530: Not logged in
+	*/
+
+	if (!session->logged_in)
+	{
+		return send_530(session);
+	}
+
+	//The optional " R <record size>" part means nothing for stream files, so
+	//anything after the size is left alone
+	char *argument = command->argument.start;
+	char *end;
+	errno = 0;
+	unsigned long long size = strtoull(argument, &end, 10);
+	if (errno != 0 || *argument < '0' || *argument > '9' || (*end != '\0' && *end != ' ') || size > INT64_MAX)
+	{
+		return send_501(session);
+	}
+	session->allocate_size = size;
+
+	return send_200(session);
+}
+
+status_t handle_stor_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			125: Data connection already open; transfer starting
+			226: Closing data connection; success
+			425: Can't open data connection
+			451: Aborted; local error
+			452: Not enough storage space
+			501: Syntax error in params
+			530: Not logged in
+			550: File can't be created
+	*/
+
+	status_t error;
+
+	//Uploads don't resume, so a restart point is thrown away like for any
+	//other transfer, and the ALLO size only ever applies to this one
+	session->restart_offset = 0;
+	off_t allocate_size = session->allocate_size;
+	session->allocate_size = 0;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (session->data_sock < 0 && session->pasv_sock < 0)
+	{
+		error = send_425(session);
+		goto exit0;
+	}
+
+	//Compressed uploads aren't supported
+	if (session->mode_z)
+	{
+		error = send_504(session);
+		goto exit1;
+	}
+
+	if (command->argument.length == 0)
+	{
+		error = send_501(session);
+		goto exit1;
+	}
+
+	int fd = open_upload_file(session, command->argument.start);
+	if (fd < 0)
+	{
+		error = send_550(session);
+		goto exit1;
+	}
+
+	//begin_upload takes care of fd and the data connection from here on
+	error = begin_upload(session, fd, allocate_size, NULL);
+	goto exit0;
+
+exit1:
+	close_data_connection(session);
+exit0:
+	return error;
+}
+
+status_t handle_stou_command(user_session_t *session, command_line_t *command)
+{
+	/*
+		Possible codes:
+			As for STOR, with the 125 giving the name chosen for the file
+	*/
+
+	status_t error;
+
+	session->restart_offset = 0;
+	off_t allocate_size = session->allocate_size;
+	session->allocate_size = 0;
+
+	if (!session->logged_in)
+	{
+		error = send_530(session);
+		goto exit0;
+	}
+
+	if (session->data_sock < 0 && session->pasv_sock < 0)
+	{
+		error = send_425(session);
+		goto exit0;
+	}
+
+	//Compressed uploads aren't supported
+	if (session->mode_z)
+	{
+		error = send_504(session);
+		goto exit1;
+	}
+
+	//The server picks the name, in the current directory, so any argument is
+	//ignored. The file is made relative to the directory the session has open,
+	//with O_EXCL, so a name that turns out to be taken is just passed over and
+	//nothing can be swapped in underneath it.
+	char name[sizeof STOU_PREFIX + STOU_NAME_CHARS] = STOU_PREFIX;
+	char *random_part = name + sizeof STOU_PREFIX - 1;
+	int fd = -1;
+	int attempt;
+	for (attempt = 0; attempt < STOU_ATTEMPTS && fd < 0; attempt++)
+	{
+		unsigned char random_bytes[STOU_NAME_CHARS];
+		if (getrandom(random_bytes, sizeof random_bytes, 0) != sizeof random_bytes)
+		{
+			break;
+		}
+
+		int i;
+		for (i = 0; i < STOU_NAME_CHARS; i++)
+		{
+			random_part[i] = STOU_ALPHABET[random_bytes[i] % (sizeof STOU_ALPHABET - 1)];
+		}
+
+		fd = open_in_session(session, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0 && errno != EEXIST)
+		{
+			break;
+		}
+	}
+
+	if (fd < 0)
+	{
+		error = send_550(session);
+		goto exit1;
+	}
+
+	error = begin_upload(session, fd, allocate_size, name);
+	goto exit0;
+
+exit1:
+	close_data_connection(session);
+exit0:
+	return error;
+}
+
+status_t render_mlst_entry(string_t *out, int dir_fd, char *name, char *shown_name, unsigned char d_type, uint32_t facts)
+{
+	unsigned int mask = 0;
+	size_t i;
+	for (i = 0; i < MLST_FACT_COUNT; i++)
+	{
+		if (facts & (1 << i))
+		{
+			mask |= mlst_facts[i].statx_mask;
+		}
+	}
+
+	if (d_type != DT_UNKNOWN)
+	{
+		mask &= ~STATX_TYPE;
+	}
+
+	//A link's target can lie anywhere, even outside the root directory, so
+	//links aren't followed and nothing is said about what they point to
+	struct statx file_stat;
+	file_stat.stx_mask = 0;
+	int flags = AT_SYMLINK_NOFOLLOW | (name[0] == '\0' ? AT_EMPTY_PATH : 0);
+	if (mask != 0 && syscall(SYS_statx, dir_fd, name, flags, mask, &file_stat) < 0)
+	{
+		return FILE_READ_ERROR;
+	}
+
+	if (file_stat.stx_mask & STATX_TYPE)
+	{
+		d_type = IFTODT(file_stat.stx_mode);
+	}
+
+	uint8_t is_dir = d_type == DT_DIR;
+	char *type = d_type == DT_REG ? "file" : is_dir ? "dir" : d_type == DT_LNK ? "OS.unix=slink" : "OS.unix=other";
+	if (is_dir && strcmp(name, ".") == 0)
+	{
+		type = "cdir";
+	}
+	else if (is_dir && strcmp(name, "..") == 0)
+	{
+		type = "pdir";
+	}
+
+	char text[MLST_FACTS_SIZE];
+	size_t length = 0;
+	for (i = 0; i < MLST_FACT_COUNT; i++)
+	{
+		//Leave out facts the file system couldn't give, like a creation time
+		//where none is kept
+		if (!(facts & (1 << i)) || (mlst_facts[i].statx_mask & mask & ~file_stat.stx_mask))
+		{
+			continue;
+		}
+
+		char *fact = mlst_facts[i].name;
+		struct tm time_parts;
+		switch (i)
+		{
+			case MLST_FACT_TYPE:
+				length += sprintf(text + length, "%s=%s;", fact, type);
+				break;
+			case MLST_FACT_SIZE:
+				length += sprintf(text + length, "%s=%llu;", fact, (unsigned long long) file_stat.stx_size);
+				break;
+			case MLST_FACT_MODIFY:
+			case MLST_FACT_CREATE:
+			{
+				time_t seconds = i == MLST_FACT_MODIFY ? file_stat.stx_mtime.tv_sec : file_stat.stx_btime.tv_sec;
+				gmtime_r(&seconds, &time_parts);
+				length += sprintf(text + length, "%s=%04d%02d%02d%02d%02d%02d;", fact,
+					time_parts.tm_year + 1900, time_parts.tm_mon + 1, time_parts.tm_mday,
+					time_parts.tm_hour, time_parts.tm_min, time_parts.tm_sec);
+				break;
+			}
+			case MLST_FACT_UNIQUE:
+				length += sprintf(text + length, "%s=%x.%x.%llx;", fact, file_stat.stx_dev_major,
+					file_stat.stx_dev_minor, (unsigned long long) file_stat.stx_ino);
+				break;
+			case MLST_FACT_UNIX_MODE:
+				length += sprintf(text + length, "%s=%04o;", fact, file_stat.stx_mode & 07777);
+				break;
+		}
+	}
+
+	string_concatenate_char_array_with_size(out, text, length);
+	char_vector_push_back(out, ' ');
+	string_concatenate_char_array(out, shown_name);
+	string_concatenate_char_array_with_size(out, "\r\n", 2);
+
+	return SUCCESS;
+}
+
+size_t render_fact_names(char *buffer, uint32_t facts, uint32_t enabled)
+{
+	size_t length = 0;
+	size_t i;
+	for (i = 0; i < MLST_FACT_COUNT; i++)
+	{
+		if (facts & (1 << i))
+		{
+			length += sprintf(buffer + length, "%s%s;", mlst_facts[i].name, enabled & (1 << i) ? "*" : "");
+		}
+	}
+
+	buffer[length] = '\0';
+	return length;
+}
+
+int open_in_session(user_session_t *session, char *path, int flags, mode_t mode)
+{
+	struct open_how how;
+	memset(&how, 0, sizeof how);
+	how.flags = flags;
+	how.mode = flags & O_CREAT ? mode : 0;
+	how.resolve = RESOLVE_BENEATH;
+
+	uint8_t from_root = path[0] == '/' || (path[0] == '~' && (path[1] == '\0' || path[1] == '/'));
+	if (!from_root && !has_parent_component(path))
+	{
+		//Most names are in the current directory, or below it, so they are
+		//looked up from there without walking down from the root again
+		int fd = syscall(SYS_openat2, session->directory_fd, path[0] == '\0' ? "." : path, &how, sizeof how);
+		//A symlink out of the current directory might still stay in the root
+		if (fd >= 0 || errno != EXDEV)
+		{
+			return fd;
+		}
+	}
+
+	//Anything else goes from the root, by way of the current directory's path
+	//under it if the path is relative
+	string_t full;
+	string_initialize(&full);
+	if (from_root)
+	{
+		if (path[0] == '~')
+		{
+			path++;
+		}
+	}
+	else
+	{
+		string_assign_from_char_array(&full, session->directory + session->server->root_length);
+		char_vector_push_back(&full, '/');
+	}
+	string_concatenate_char_array(&full, path);
+
+	char *relative = (char *) string_c_str(&full);
+	while (*relative == '/')
+	{
+		relative++;
+	}
+
+	int fd = syscall(SYS_openat2, session->server->root_fd, *relative == '\0' ? "." : relative, &how, sizeof how);
+	int saved_errno = errno;
+	string_uninitialize(&full);
+	errno = saved_errno;
+	return fd;
+}
 
-	struct sockaddr_in cad;
-	socklen_t clilen = sizeof cad;
-	while (1)
+uint8_t has_parent_component(char *path)
+{
+	char *component = path;
+	while (*component != '\0')
 	{
-		int connection_sock = accept(listen_sock, (struct sockaddr *) &cad, &clilen);
-		if (connection_sock < 0)
+		size_t length = strcspn(component, "/");
+		if (length == 2 && component[0] == '.' && component[1] == '.')
 		{
-			char *error_str = get_error_message(ACCEPT_ERROR);
-			write_log(server.log, error_str, strlen(error_str));
-			printf("%s", error_str);
+			return 1;
 		}
-		else
-		{
-			char join_message[] = "Client joined.\n";
-			write_log(server.log, join_message, sizeof join_message);
-			printf("%s", join_message);
-
-			//use calloc to make sure the state flags are all set to 0.
-			user_session_t *args = calloc(1, sizeof *args);
-			args->command_sock = connection_sock;
-			args->server = &server;
-
-			pthread_t thread;
-			if (pthread_create(&thread, NULL, client_handler, args) != 0)
-			{
-				error = send_response(connection_sock, SERVICE_NOT_AVAILABLE, "Could not establish a session.", server.log, 0);
 
-				char *error_str = get_error_message(PTHREAD_CREATE_ERROR);
-				write_log(server.log, error_str, strlen(error_str));
-				printf("%s", error_str);
-			}
-			else
-				pthread_detach(thread);
+		component += length;
+		while (*component == '/')
+		{
+			component++;
 		}
 	}
 
-	char closing_message[] = "Server closing down.\n";
-exit1:
-	write_log(server.log, closing_message, sizeof closing_message);
-	close(listen_sock);
-exit0:
-	free_server(&server);
-	print_error_message(error);
-	return error;
+	return 0;
 }
 
-status_t parse_command_line(int argc, char *argv[], uint16_t *port)
+status_t change_directory(user_session_t *session, char *path)
 {
-	if (argc != ARGC)
+	int fd = open_in_session(session, path, O_PATH | O_DIRECTORY, 0);
+	struct stat directory_stat;
+	if (fd < 0 || fstat(fd, &directory_stat) < 0)
 	{
-		printf("Usage: ftpserver port\n");
-		return BAD_COMMAND_LINE;
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return DIR_OPEN_ERROR;
 	}
 
-	int tmp = atoi(argv[1]);
-	if (tmp <= 0 || tmp > UINT16_MAX)
+	//The real path is only worked out here, once per change, for PWD and for
+	//keying the listing cache
+	char *directory = directory_path(fd);
+	if (directory == NULL)
 	{
-		printf("Port number must be positive and less than or equal to %u.\n", UINT16_MAX);
-		return BAD_COMMAND_LINE;
+		close(fd);
+		return DIR_OPEN_ERROR;
 	}
-	*port = tmp;
 
+	close(session->directory_fd);
+	session->directory_fd = fd;
+	session->directory_dev = directory_stat.st_dev;
+	session->directory_ino = directory_stat.st_ino;
+	free(session->directory);
+	session->directory = directory;
 	return SUCCESS;
 }
 
-void *client_handler(void *void_args)
+void close_transfer_file(user_session_t *session)
 {
-	user_session_t *session = (user_session_t *) void_args;
-	status_t error;
+	if (session->transfer.cached_file != NULL)
+	{
+		file_cache_release(session->server->file_cache, session->transfer.cached_file);
+		session->transfer.cached_file = NULL;
+		session->transfer.contents = NULL;
+	}
+	else if (session->transfer.fd >= 0)
+	{
+		close(session->transfer.fd);
+	}
+	session->transfer.fd = -1;
+}
 
-	//Finish session initialization
-	session->directory = realpath(".", NULL);
-	if (session->directory == NULL)
+char *directory_path(int fd)
+{
+	char link[sizeof "/proc/self/fd/" + 10];
+	sprintf(link, "/proc/self/fd/%d", fd);
+
+	char *path = malloc(PATH_MAX);
+	if (path == NULL)
 	{
-		error = REALPATH_ERROR;
-		goto exit0;
+		return NULL;
 	}
-	session->data_sock = -1;
-	//End session initialization
 
-	error = send_response(session->command_sock, SERVICE_READY, "Ready. Please send USER.", session->server->log, 0);
-	if (error)
+	ssize_t length = readlink(link, path, PATH_MAX - 1);
+	if (length <= 0 || path[0] != '/')
 	{
-		goto exit1;
+		free(path);
+		return NULL;
 	}
+	path[length] = '\0';
 
-	string_t command;
-	string_initialize(&command);
+	return path;
+}
 
-	uint8_t done = 0;
-	do
+uint8_t is_server_file(server_t *server, int fd)
+{
+	char *path = directory_path(fd);
+	if (path == NULL)
 	{
-		char_vector_clear(&command);
-		error = read_single_line(session->command_sock, &command);
-		if (!error)
-		{
-			error = write_received_message_to_log(session->server->log, &command);
-			if (!error)
-			{
-				//Remove the CRLF from the command
-				char_vector_pop_back(&command);
-				char_vector_pop_back(&command);
+		return 1;
+	}
 
-				//Split the string up by spaces
-				size_t len;
-				string_t *split = string_split_skip_consecutive(&command, ' ', &len, 1);
-				char *c_str = string_c_str(split + 0);
+	size_t log_length = strlen(server->log_path);
+	uint8_t found = strcmp(path, server->config_path) == 0 ||
+		(server->accounts_path != NULL && strcmp(path, server->accounts_path) == 0) ||
+		(strncmp(path, server->log_path, log_length) == 0 && path[log_length] == '/');
+	free(path);
+	return found;
+}
 
-				//Determine which command has been sent
-				if (bool_strcmp(c_str, "USER"))
-				{
-					error = handle_user_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "PASS"))
-				{
-					error = handle_pass_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "CWD"))
-				{
-					error = handle_cwd_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "CDUP"))
-				{
-					error = handle_cdup_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "QUIT"))
-				{
-					done = 1;
-					error = handle_quit_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "PASV"))
-				{
-					error = handle_pasv_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "EPSV"))
-				{
-					error = handle_epsv_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "PORT"))
-				{
-					error = handle_port_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "EPRT"))
-				{
-					error = handle_eprt_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "RETR"))
-				{
-					error = handle_retr_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "PWD"))
-				{
-					error = handle_pwd_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "LIST"))
-				{
-					error = handle_list_command(session, split, len);
-				}
-				else if (bool_strcmp(c_str, "HELP"))
-				{
-					error = handle_help_command(session, split, len);
-				}
-				else
-				{
-					error = handle_unrecognized_command(session, split, len);
-				}
+int open_upload_file(user_session_t *session, char *path)
+{
+	//Only a file that is already there can be one of the server's own, so
+	//look for one first, before anything has been truncated. A file that
+	//turns up between the two opens gets looked at again. O_NONBLOCK keeps
+	//a FIFO from holding up the open until something reads from it.
+	int fd = -1;
+	int attempt;
+	for (attempt = 0; attempt < 2 && fd < 0; attempt++)
+	{
+		fd = open_in_session(session, path, O_WRONLY | O_NONBLOCK, 0);
+		if (fd >= 0)
+		{
+			struct stat file_stat;
+			if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) ||
+				is_server_file(session->server, fd))
+			{
+				close(fd);
+				errno = EACCES;
+				return -1;
+			}
 
-				size_t i;
-				for (i = 0; i < len; i++)
-				{
-					string_uninitialize(split + i);
-				}
-				free(split);
+			if (ftruncate(fd, 0) < 0)
+			{
+				goto exit1;
 			}
+			break;
 		}
 
-		if (error)
+		if (errno != ENOENT)
 		{
-			char message[] = "Error encountered while processing: ";
-			string_t error_message;
-			string_initialize(&error_message);
-			char *error_string = get_error_message(error);
-			string_assign_from_char_array(&error_message, error_string);
-			prepend_and_write_to_log(session->server->log, &error_message, message, sizeof message);
-			string_uninitialize(&error_message);
+			return -1;
 		}
-	} while (!error && !done);
 
-	char quitting_message[] = "Client quitting.\n";
+		//A file made here can only be a new, regular one
+		fd = open_in_session(session, path, O_WRONLY | O_CREAT | O_EXCL | O_NONBLOCK, 0644);
+		if (fd < 0 && errno != EEXIST)
+		{
+			return -1;
+		}
+	}
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	//The upload itself is spliced into the file, which should block as usual
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)
+	{
+		goto exit1;
+	}
+	return fd;
 
-exit2:
-	string_uninitialize(&command);
 exit1:
-	free(session->directory);
-exit0:
-	write_log(session->server->log, quitting_message, sizeof quitting_message);
-	printf("%s", quitting_message);
-	free(session);
-	pthread_exit(NULL);
+	{
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return -1;
 }
 
-status_t handle_user_command(user_session_t *session, string_t *args, size_t len)
+char *visible_directory(user_session_t *session)
 {
-	status_t error;
+	char *visible = session->directory + session->server->root_length;
+	return *visible == '\0' ? "/" : visible;
+}
 
-	if (session->logged_in)
+status_t send_response(user_session_t *session, char *code, char *message, uint8_t multiline)
+{
+	struct iovec parts[] =
 	{
-		error = send_330(session);
-		goto exit0;
-	}
+		{ code, 3 },
+		{ multiline ? "-" : " ", 1 },
+		{ message, strlen(message) },
+		{ "\r\n", 2 },
+		//Only sent for multiline replies
+		{ code, 3 },
+		{ " \r\n", 3 },
+	};
+
+	return send_reply_parts(session, parts, multiline ? 6 : 4);
+}
 
-	if (len < 2)
-	{
-		error = send_501(session);
-		goto exit0;
-	}
+status_t send_reply(user_session_t *session, reply_id_t reply)
+{
+	encoded_reply_t *encoded = replies + reply;
+	struct iovec part = { encoded->text, encoded->length };
+	return send_reply_parts(session, &part, 1);
+}
 
-	string_t username;
-	string_initialize(&username);
-	size_t i;
-	for (i = 1; i < len; i++)
+status_t send_reply_parts(user_session_t *session, struct iovec *parts, int count)
+{
+	status_t error = SUCCESS;
+
+	//A reply can't overtake the ones still waiting to go out
+	ssize_t sent = 0;
+	if (string_length(&session->reply_queue) == 0)
 	{
-		string_concatenate(&username, args + i);
+		do
+		{
+			sent = writev(session->command_sock, parts, count);
+		} while (sent < 0 && errno == EINTR);
+
+		if (sent < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				error = SOCKET_WRITE_ERROR;
+				goto exit0;
+			}
+			sent = 0;
+		}
 	}
 
-	get_account_by_username(session->server->accounts, string_c_str(&username), &session->account);
-	if (session->account == NULL)
+	//Queue up whatever didn't make it into the socket
+	int i;
+	for (i = 0; i < count; i++)
 	{
-		error = send_530(session);
-		goto exit1;
+		size_t skip = (size_t) sent < parts[i].iov_len ? (size_t) sent : parts[i].iov_len;
+		sent -= skip;
+		if (skip < parts[i].iov_len)
+		{
+			string_concatenate_char_array_with_size(&session->reply_queue,
+				(char *) parts[i].iov_base + skip, parts[i].iov_len - skip);
+		}
 	}
 
-	error = send_331(session);
-	if (error)
+	//The socket blocks in threaded mode, so the rest can just be sent now
+	if (session->loop == NULL)
 	{
-		goto exit1;
+		error = flush_replies(session);
+		if (error)
+		{
+			goto exit0;
+		}
 	}
 
-exit1:
-	string_uninitialize(&username);
+	error = write_log_event_parts(session->server->log, LOG_EVENT_SENT, parts, count);
+
 exit0:
 	return error;
 }
 
-status_t handle_pass_command(user_session_t *session, string_t *args, size_t len)
+status_t flush_replies(user_session_t *session)
 {
-	status_t error;
+	status_t error = SUCCESS;
 
-	//Make sure that a USER command has already been executed by checking this
-	//pointer value
-	if (session->account == NULL)
+	size_t length = string_length(&session->reply_queue);
+	while (session->reply_queue_sent < length)
 	{
-		error = send_503(session);
-		goto exit0;
-	}
+		ssize_t sent = send(session->command_sock, string_c_str(&session->reply_queue) + session->reply_queue_sent,
+			length - session->reply_queue_sent, 0);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
 
-	if (len < 2)
-	{
-		error = send_501(session);
-		goto exit0;
+			error = errno == EAGAIN || errno == EWOULDBLOCK ? SOCKET_WOULD_BLOCK : SOCKET_WRITE_ERROR;
+			goto exit0;
+		}
+		session->reply_queue_sent += sent;
 	}
 
-	string_t password;
-	string_initialize(&password);
+	char_vector_clear(&session->reply_queue);
+	session->reply_queue_sent = 0;
+
+exit0:
+	return error;
+}
 
+void build_help_reply(void)
+{
+	size_t count = sizeof commands / sizeof *commands;
+	char *verbs[sizeof commands / sizeof *commands];
 	size_t i;
-	for (i = 1; i < len; i++)
+	for (i = 0; i < count; i++)
 	{
-		string_concatenate(&password, args + i);
+		verbs[i] = commands[i].verb;
 	}
+	qsort(verbs, count, sizeof *verbs, compare_verbs);
 
-	if (!bool_strcmp(string_c_str(&password), session->account->password))
+	size_t length = sprintf(help_reply, "%s-", HELP_MESSAGE);
+	for (i = 0; i < count; i++)
 	{
-		error = send_530(session);
+		char *separator = " ";
+		if (i == 0)
+		{
+			separator = "";
+		}
+		else if (i % HELP_VERBS_PER_LINE == 0)
+		{
+			separator = "\r\n";
+		}
+		length += sprintf(help_reply + length, "%s%s", separator, verbs[i]);
 	}
+	length += sprintf(help_reply + length, "\r\n%s \r\n", HELP_MESSAGE);
 
-	error = send_330(session);
-	if (error)
+	replies[REPLY_214].text = help_reply;
+	replies[REPLY_214].length = length;
+}
+
+int compare_verbs(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+void begin_transfer(user_session_t *session, status_t (*step)(user_session_t *, uint8_t *))
+{
+	char sending_data[] = "Sending data.\n";
+	write_log(session->server->log, sending_data, sizeof sending_data);
+
+	session->transfer.step = step;
+	session->transfer.offset = 0;
+	session->transfer.receiving = step == store_transfer_step;
+	session->transfer.compressor = NULL;
+	if (session->mode_z && !session->transfer.receiving)
 	{
-		goto exit1;
+		//Every transfer is a zlib stream of its own
+		compressor_t *compressor = session->compressor;
+		deflateReset(&compressor->stream);
+		deflateParams(&compressor->stream, session->compression_level, Z_DEFAULT_STRATEGY);
+		compressor->output_start = 0;
+		compressor->output_end = 0;
+		compressor->input_start = 0;
+		compressor->input_end = 0;
+		compressor->finished = 0;
+		session->transfer.compressor = compressor;
 	}
 
-	session->logged_in = 1;
-
-exit1:
-	string_uninitialize(&password);
-exit0:
-	return error;
+	//After a PASV, the client may not have connected yet
+	session->state = session->data_sock >= 0 ? SESSION_TRANSFERRING : SESSION_ACCEPTING_DATA;
 }
 
-status_t handle_cwd_command(user_session_t *session, string_t *args, size_t len)
+status_t finish_transfer(user_session_t *session, status_t transfer_error)
 {
 	status_t error;
 
-	if (!session->logged_in)
-	{
-		error = send_530(session);
-		goto exit0;
-	}
+	clean_up_transfer(session);
 
-	if (len < 2)
+	if (transfer_error)
 	{
-		error = send_501(session);
+		char error_sending[] = "Error sending data.\n";
+		char error_receiving[] = "Error receiving data.\n";
+		if (session->transfer.receiving)
+		{
+			write_log(session->server->log, error_receiving, sizeof error_receiving);
+		}
+		else
+		{
+			write_log(session->server->log, error_sending, sizeof error_sending);
+		}
+
+		//let the transfer's error supercede any that might occur here
+		send_451(session);
+		error = transfer_error;
 		goto exit0;
 	}
 
-	string_t new_dir;
-	string_initialize(&new_dir);
-
-	char *first_c_str = string_c_str(args + 1);
-	if (first_c_str[0] != '/' && first_c_str[0] != '~')
+	char data_sent[] = "Data sent.\n";
+	char data_received[] = "Data received.\n";
+	if (session->transfer.receiving)
 	{
-		string_assign_from_char_array(&new_dir, session->directory);
-		char_vector_push_back(&new_dir, '/');
+		write_log(session->server->log, data_received, sizeof data_received);
 	}
-
-	size_t i;
-	for (i = 1; i < len; i++)
+	else
 	{
-		string_concatenate(&new_dir, args + i);
+		write_log(session->server->log, data_sent, sizeof data_sent);
 	}
 
-	char *resolved_dir = realpath(string_c_str(&new_dir), NULL);
-	if (resolved_dir == NULL || !is_directory(resolved_dir))
+	error = send_226(session);
+
+exit0:
+	return error;
+}
+
+void clean_up_transfer(user_session_t *session)
+{
+	if (session->transfer.receiving && session->transfer.allocated > session->transfer.offset)
 	{
-		error = send_550(session);
-		goto exit1;
+		//Don't leave the unused part of the preallocation on the end of the file
+		ftruncate(session->transfer.fd, session->transfer.offset);
 	}
+	close_upload_pipe(&session->transfer);
+	close_transfer_file(session);
+	char_vector_clear(&session->transfer.data);
 
-	free(session->directory);
-	session->directory = resolved_dir;
-
-	error = send_250(session);
-	if (error)
+	if (session->transfer.filling)
 	{
-		goto exit1;
+		//Only a listing that got read to the end has been cached already
+		listing_fill_finish(session->server->listing_cache, &session->transfer.fill, 0);
+		session->transfer.filling = 0;
 	}
 
-exit1:
-	string_uninitialize(&new_dir);
-exit0:
-	return error;
+	close_data_connection(session);
+	session->state = SESSION_READING_COMMAND;
 }
 
-status_t handle_cdup_command(user_session_t *session, string_t *args, size_t len)
+status_t retr_transfer_step(user_session_t *session, uint8_t *done)
 {
-	status_t error;
-	if (!session->logged_in)
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
+
+	off_t remaining = transfer->length - transfer->offset;
+	if (remaining <= 0)
 	{
-		error = send_530(session);
+		*done = 1;
 		goto exit0;
 	}
 
-	string_t s;
-	string_initialize(&s);
-	string_assign_from_char_array(&s, session->directory);
-	string_concatenate_char_array_with_size(&s, "/..", 3);
-
-	char *resolved_dir = realpath(string_c_str(&s), NULL);
-	if (resolved_dir == NULL || !is_directory(resolved_dir))
+	//sendfile advances the offset itself and may send less than was asked for;
+	//cap each piece so that one big file can't hog an event loop
+	ssize_t sent = sendfile(session->data_sock, transfer->fd, &transfer->offset,
+		remaining < DATA_CHUNK_SIZE ? remaining : DATA_CHUNK_SIZE);
+	if (sent < 0)
 	{
-		error = send_550(session);
-		goto exit1;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			error = SOCKET_WOULD_BLOCK;
+		}
+		else if (errno != EINTR)
+		{
+			error = SOCKET_WRITE_ERROR;
+		}
 	}
-
-	free(session->directory);
-	session->directory = resolved_dir;
-
-	error = send_200(session);
-	if (error)
+	else if (sent == 0)
 	{
-		goto exit1;
+		//The file shrank underneath us; send what there was
+		*done = 1;
 	}
 
-exit1:
-	string_uninitialize(&s);
 exit0:
 	return error;
 }
 
-status_t handle_quit_command(user_session_t *session, string_t *args, size_t len)
+status_t contents_transfer_step(user_session_t *session, uint8_t *done)
 {
-	session->logged_in = 0;
-	return send_221(session);
+	return send_from_memory(session, session->transfer.contents, done);
 }
 
-status_t handle_pasv_command(user_session_t *session, string_t *args, size_t len)
+status_t data_transfer_step(user_session_t *session, uint8_t *done)
 {
-	status_t error = SUCCESS;
-	if (!session->server->pasv_enabled)
-	{
-		error = send_502(session);
-		goto exit0;
-	}
+	return send_from_memory(session, (char *) string_c_str(&session->transfer.data), done);
+}
+
+status_t send_from_memory(user_session_t *session, char *data, uint8_t *done)
+{
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
 
-	if (!session->logged_in)
+	off_t remaining = transfer->length - transfer->offset;
+	if (transfer->compressor != NULL)
 	{
-		error = send_530(session);
+		//The data is everything there is to send, so the stream ends with it
+		size_t consumed;
+		error = send_compressed(session, data + transfer->offset, remaining, 1, &consumed, done);
+		transfer->offset += consumed;
 		goto exit0;
 	}
 
-	int listen_sock;
-	uint16_t listen_port;
-	error = set_up_listen_socket(&listen_sock, &listen_port, AF_INET, session->server->ip4);
-	if (error)
+	if (remaining <= 0)
 	{
+		*done = 1;
 		goto exit0;
 	}
 
-	string_t message;
-	string_initialize(&message);
-	string_assign_from_char_array(&message, "Entering passive mode (");
-	create_comma_delimited_address(&message, session->server->ip4, listen_port);
-	char_vector_push_back(&message, ')');
-
-	error = send_response(session->command_sock, ENTERING_PASSIVE_MODE, string_c_str(&message), session->server->log, 0);
-	if (error)
+	ssize_t sent = write(session->data_sock, data + transfer->offset,
+		remaining < DATA_CHUNK_SIZE ? remaining : DATA_CHUNK_SIZE);
+	if (sent < 0)
 	{
-		goto exit2;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			error = SOCKET_WOULD_BLOCK;
+		}
+		else if (errno != EINTR)
+		{
+			error = SOCKET_WRITE_ERROR;
+		}
+		goto exit0;
 	}
 
-	struct sockaddr_in cad;
-	socklen_t clilen = sizeof cad;
-	session->data_sock = accept(listen_sock, (struct sockaddr *) &cad, &clilen);
-	if (session->data_sock < 0)
-	{
-		error = ACCEPT_ERROR;
-		goto exit2;
-	}
+	transfer->offset += sent;
 
-exit2:
-	close(listen_sock);
-exit1:
-	string_uninitialize(&message);
 exit0:
 	return error;
 }
 
-status_t handle_epsv_command(user_session_t *session, string_t *args, size_t len)
+status_t list_transfer_step(user_session_t *session, uint8_t *done)
 {
-	return handle_unrecognized_command(session, args, len);
-}
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
 
-status_t handle_port_command(user_session_t *session, string_t *args, size_t len)
-{
-	status_t error;
-	if (!session->server->port_enabled)
+	if (transfer->offset >= transfer->length && transfer->fd >= 0)
 	{
-		//This command can't actually send back a 'not implemented' response, so
-		//approximate it with an "unrecognized command" response
-		error = send_500(session);
+		//The last chunk has all gone out
+		error = read_listing_chunk(session);
 		goto exit0;
 	}
 
-	if (!session->logged_in)
+	if (transfer->compressor != NULL)
 	{
-		error = send_530(session);
+		//The stream can only be finished off once the directory has run out
+		size_t consumed;
+		error = send_compressed(session, (char *) string_c_str(&transfer->data) + transfer->offset,
+			transfer->length - transfer->offset, transfer->fd < 0, &consumed, done);
+		transfer->offset += consumed;
 		goto exit0;
 	}
 
-	size_t ip_len;
-	string_t *split = string_split(args + 1, ',', &ip_len);
+	error = data_transfer_step(session, done);
 
-	string_t host;
-	string_initialize(&host);
-	uint16_t port;
-	error = parse_ip_and_port(split, ip_len, &host, &port);
-	if (error)
-	{
-		error = send_501(session);
-		goto exit1;
-	}
+exit0:
+	return error;
+}
 
-	error = make_connection(&session->data_sock, string_c_str(&host), port);
-	if (error)
-	{
-		send_response(session->command_sock, SERVICE_NOT_AVAILABLE, "Could not connect to port", session->server->log, 0);
-		goto exit1;
-	}
+status_t retr_deflate_transfer_step(user_session_t *session, uint8_t *done)
+{
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
+	compressor_t *compressor = transfer->compressor;
 
-	error = send_200(session);
-	if (error)
+	if (compressor->input_start == compressor->input_end && transfer->offset < transfer->length)
 	{
-		goto exit1;
+		off_t remaining = transfer->length - transfer->offset;
+		ssize_t amount = pread(transfer->fd, compressor->input,
+			remaining < ZLIB_CHUNK_SIZE ? remaining : ZLIB_CHUNK_SIZE, transfer->offset);
+		if (amount < 0)
+		{
+			if (errno != EINTR)
+			{
+				error = FILE_READ_ERROR;
+			}
+			goto exit0;
+		}
+
+		if (amount == 0)
+		{
+			//The file shrank underneath us; send what there was
+			transfer->length = transfer->offset;
+		}
+
+		compressor->input_start = 0;
+		compressor->input_end = amount;
+		transfer->offset += amount;
 	}
 
-exit1:
-	string_uninitialize(&host);
+	size_t consumed;
+	error = send_compressed(session, compressor->input + compressor->input_start,
+		compressor->input_end - compressor->input_start, transfer->offset >= transfer->length,
+		&consumed, done);
+	compressor->input_start += consumed;
+
 exit0:
 	return error;
 }
 
-status_t handle_eprt_command(user_session_t *session, string_t *args, size_t len)
+status_t send_compressed(user_session_t *session, char *data, size_t length, uint8_t last,
+	size_t *consumed, uint8_t *finished)
 {
-	return handle_unrecognized_command(session, args, len);
-}
+	status_t error = SUCCESS;
+	compressor_t *compressor = session->transfer.compressor;
+	*consumed = 0;
 
-status_t handle_retr_command(user_session_t *session, string_t *args, size_t len)
-{
-	/**
-	  * Possible codes:
-	  *		125: transfer_starting
-	  *		150: about to open data connection
-	  *		226: Completed successfully; closing
-	  *		250: Requested file action completed
-	  *		425: Can't open data connection
-	  *		426: Connection closed
-	  *		451: Action aborted; local error
-	  *		450: File unavailable (busy)
-	  *		550: File unavailable (doesn't exit)
-	  *		500, 501, 421
-	  */
-	status_t error;
-	if (!session->logged_in)
+	//Get out what was compressed last time before compressing any more
+	if (compressor->output_start < compressor->output_end)
 	{
-		error = send_530(session);
+		ssize_t sent = write(session->data_sock, compressor->output + compressor->output_start,
+			compressor->output_end - compressor->output_start);
+		if (sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				error = SOCKET_WOULD_BLOCK;
+			}
+			else if (errno != EINTR)
+			{
+				error = SOCKET_WRITE_ERROR;
+			}
+			goto exit0;
+		}
+
+		compressor->output_start += sent;
 		goto exit0;
 	}
 
-	if (session->data_sock < 0)
+	if (compressor->finished)
 	{
-		error = send_425(session);
+		*finished = 1;
 		goto exit0;
 	}
 
-	if (len < 2)
+	z_stream *stream = &compressor->stream;
+	size_t offered = length < ZLIB_CHUNK_SIZE ? length : ZLIB_CHUNK_SIZE;
+	stream->next_in = (Bytef *) data;
+	stream->avail_in = offered;
+	stream->next_out = (Bytef *) compressor->output;
+	stream->avail_out = ZLIB_CHUNK_SIZE;
+
+	//A Z_BUF_ERROR just means there was nothing to do this time
+	int result = deflate(stream, last && offered == length ? Z_FINISH : Z_NO_FLUSH);
+	if (result == Z_STREAM_ERROR)
 	{
-		error = send_501(session);
-		goto exit1;
+		error = COMPRESSION_ERROR;
+		goto exit0;
 	}
 
-	string_t path;
-	string_initialize(&path);
-	string_assign_from_char_array(&path, session->directory);
-	char_vector_push_back(&path, '/');
-	string_concatenate(&path, args + 1);
+	*consumed = offered - stream->avail_in;
+	compressor->output_start = 0;
+	compressor->output_end = ZLIB_CHUNK_SIZE - stream->avail_out;
+	compressor->finished = result == Z_STREAM_END;
 
-	int fd = open(string_c_str(&path), O_RDONLY, 0);
-	if (fd < 0)
-	{
-		error = send_550(session);
-		goto exit2;
-	}
+exit0:
+	return error;
+}
 
-	string_t file_string;
-	string_initialize(&file_string);
-	ssize_t chars_read;
-	char buff[512];
-	while ((chars_read = read(fd, buff, sizeof buff)) > 0)
-	{
-		string_concatenate_char_array_with_size(&file_string, buff, sizeof buff);
-	}
+status_t create_compressor(compressor_t **compressor, int level)
+{
+	status_t error = SUCCESS;
 
-	if (chars_read < 0)
+	compressor_t *new_compressor = calloc(1, sizeof *new_compressor);
+	if (new_compressor == NULL)
 	{
-		error = send_451(session);
-		goto exit3;
+		error = MEMORY_ERROR;
+		goto exit0;
 	}
 
-	error = send_125(session);
-	if (error)
+	new_compressor->output = malloc(ZLIB_CHUNK_SIZE);
+	new_compressor->input = malloc(ZLIB_CHUNK_SIZE);
+	if (new_compressor->output == NULL || new_compressor->input == NULL)
 	{
-		//let the first error supercede any that might occur here,
-		//so don't save to error
-		send_451(session);
-		goto exit3;
+		error = MEMORY_ERROR;
+		goto exit_error1;
 	}
 
-	error = send_data_string(session->data_sock, &file_string, session->server->log);
-	if (error)
+	if (deflateInit(&new_compressor->stream, level) != Z_OK)
 	{
-		send_451(session);
-	}
-	else
-	{
-		error = send_226(session);
+		error = COMPRESSION_ERROR;
+		goto exit_error1;
 	}
 
-exit3:
-	string_uninitialize(&file_string);
-exit2:
-	string_uninitialize(&path);
-exit1:
-	close(session->data_sock);
-	session->data_sock = -1;
+	*compressor = new_compressor;
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit_error1:
+	free(new_compressor->output);
+	free(new_compressor->input);
+	free(new_compressor);
 exit0:
 	return error;
 }
 
-status_t handle_pwd_command(user_session_t *session, string_t *args, size_t len)
+void free_compressor(compressor_t *compressor)
 {
-	//This command cannot return "not logged in" error messages, and the only
-	//other errors are "syntax errors." Ignore any possible "syntax errors" in
-	//the args > 0 and just send the PWD
-	return send_257(session);
+	if (compressor == NULL)
+	{
+		return;
+	}
+
+	deflateEnd(&compressor->stream);
+	free(compressor->output);
+	free(compressor->input);
+	free(compressor);
 }
 
-status_t handle_list_command(user_session_t *session, string_t *args, size_t len)
+status_t read_listing_chunk(user_session_t *session)
 {
-	/*
-		Possible codes:
-			125: Data connection already open; transfer starting
-			150: File status okay; about to open data connection
-				226: Closing data connection; success
-				250: File action okay, completed
-				425: Can't open data connection
-				426: Connection closed
-				451: Aborted; local error
-			450: Requested file action not taken
-			500: Syntax error; command unrecognized
-			501: Syntax error in params
-			502: Not implemented
-			421: Service connection closing
-			530: Not logged in
-	*/
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
+	char batch[LIST_BATCH_SIZE] __attribute__ ((aligned(__alignof__(directory_record_t))));
 
-	status_t error;
+	char_vector_clear(&transfer->data);
+	transfer->offset = 0;
+	transfer->length = 0;
 
-	if (!session->logged_in)
+	long amount = syscall(SYS_getdents64, transfer->fd, batch, sizeof batch);
+	if (amount < 0)
 	{
-		error = send_530(session);
+		error = FILE_READ_ERROR;
 		goto exit0;
 	}
 
-	if (session->data_sock < 0)
+	if (amount == 0)
 	{
-		error = send_425(session);
+		close(transfer->fd);
+		transfer->fd = -1;
+
+		//Every entry has been read, so the listing can go in the cache
+		if (transfer->filling)
+		{
+			listing_fill_finish(session->server->listing_cache, &transfer->fill, 1);
+			transfer->filling = 0;
+		}
 		goto exit0;
 	}
 
-	string_t listing;
-	string_initialize(&listing);
+	long position = 0;
+	while (position < amount)
+	{
+		directory_record_t *record = (directory_record_t *) (batch + position);
+		position += record->d_reclen;
+		if (transfer->machine_listing)
+		{
+			//An entry that's gone by the time it's looked up is just left out
+			render_mlst_entry(&transfer->data, transfer->fd, record->d_name, record->d_name, record->d_type, transfer->facts);
+			continue;
+		}
+
+		string_concatenate_char_array(&transfer->data, record->d_name);
+		char_vector_push_back(&transfer->data, '\n');
+	}
 
-	string_t tmp;
-	string_initialize(&tmp);
+	transfer->length = string_length(&transfer->data);
+	if (transfer->filling)
+	{
+		listing_fill_append(session->server->listing_cache, &transfer->fill,
+			string_c_str(&transfer->data), transfer->length);
+	}
 
-	DIR *directory;
+exit0:
+	return error;
+}
 
+status_t store_transfer_step(user_session_t *session, uint8_t *done)
+{
+	status_t error = SUCCESS;
+	transfer_t *transfer = &session->transfer;
 
-	if (len < 2)
+	ssize_t received = splice(session->data_sock, NULL, transfer->pipe_fds[1], NULL,
+		DATA_CHUNK_SIZE, SPLICE_F_MOVE);
+	if (received < 0)
 	{
-		directory = opendir(session->directory);
-		if (directory == NULL)
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
 		{
-			error = send_451(session);
-			goto exit1;
+			error = SOCKET_WOULD_BLOCK;
 		}
-
-		struct dirent *entry;
-		while ((entry = readdir(directory)))
+		else if (errno != EINTR)
 		{
-			string_concatenate_char_array(&listing, entry->d_name);
-			char_vector_push_back(&listing, '\n');
+			error = SOCKET_READ_ERROR;
 		}
-
-		closedir(directory);
+		goto exit0;
 	}
-	else
-	{
-		string_assign_from_char_array(&tmp, session->directory);
-		char_vector_push_back(&tmp, '/');
-		string_concatenate(&tmp, args + 1);
-		if (access(string_c_str(&tmp), F_OK) < 0)
-		{
-			error = send_501(session);
-			goto exit1;
-		}
 
-		directory = opendir(string_c_str(&tmp));
-		if (directory == NULL)
-		{
-			if (errno != ENOTDIR)
-			{
-				error = send_451(session);
-				goto exit1;
-			}
+	if (received == 0)
+	{
+		//The client closes the data connection to say the file is finished
+		*done = 1;
+		goto exit0;
+	}
 
-			//Already know that the file exists because of the call to access,
-			//so if the file is not a directory, assuming that it's a regular
-			//file, so just list it. This could also be checked using the stat
-			//function.
-			string_concatenate(&listing, args + 1);
-			char_vector_push_back(&listing, '\n');
-		}
-		else
+	//Empty the pipe every time, so that filling it never has to wait
+	while (received > 0)
+	{
+		ssize_t written = splice(transfer->pipe_fds[0], NULL, transfer->fd, &transfer->offset,
+			received, SPLICE_F_MOVE);
+		if (written <= 0)
 		{
-			struct dirent *entry;
-			while ((entry = readdir(directory)))
+			if (written < 0 && errno == EINTR)
 			{
-				string_concatenate_char_array(&listing, entry->d_name);
-				char_vector_push_back(&listing, '\n');
+				continue;
 			}
 
-			closedir(directory);
+			error = FILE_WRITE_ERROR;
+			goto exit0;
 		}
+		received -= written;
 	}
 
-	error = send_125(session);
-	if (error)
-	{
-		send_451(session);
-		goto exit1;
-	}
-
-	error = send_data_string(session->data_sock, &listing, session->server->log);
-	if (error)
-	{
-		send_451(session);
-	}
-	else
+	//Kick off writeback of each window as soon as it's full, then wait for the
+	//window before it, which has had a whole window's time to get written, and
+	//drop it from the page cache
+	while (transfer->offset - transfer->synced >= STORE_SYNC_WINDOW)
 	{
-		error = send_226(session);
+		sync_file_range(transfer->fd, transfer->synced, STORE_SYNC_WINDOW, SYNC_FILE_RANGE_WRITE);
+		if (transfer->synced >= STORE_SYNC_WINDOW)
+		{
+			off_t previous = transfer->synced - STORE_SYNC_WINDOW;
+			sync_file_range(transfer->fd, previous, STORE_SYNC_WINDOW,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(transfer->fd, previous, STORE_SYNC_WINDOW, POSIX_FADV_DONTNEED);
+		}
+		transfer->synced += STORE_SYNC_WINDOW;
 	}
 
-exit1:
-	string_uninitialize(&tmp);
-	string_uninitialize(&listing);
-	close(session->data_sock);
-	session->data_sock = -1;
 exit0:
 	return error;
 }
 
-status_t handle_help_command(user_session_t *session, string_t *args, size_t len)
-{
-	//This command cannot return "not logged in" error messages, and the only
-	//other errors are "syntax errors." Ignore any possible "syntax errors" in
-	//the args > 0 and just send the HELP
-	return send_214(session);
-}
-
-status_t send_response(int sock, char *code, char *message, log_t *log, uint8_t multiline)
+status_t begin_upload(user_session_t *session, int fd, off_t allocate_size, char *unique_name)
 {
 	status_t error;
+	transfer_t *transfer = &session->transfer;
 
-	char sep;
-	if (multiline)
+	transfer->allocated = 0;
+	if (allocate_size > 0)
 	{
-		sep = '-';
+		//File systems that can't preallocate just do without; running out of
+		//space is worth telling the client about up front, though
+		if (fallocate(fd, 0, 0, allocate_size) == 0)
+		{
+			transfer->allocated = allocate_size;
+		}
+		else if (errno == ENOSPC || errno == EFBIG)
+		{
+			error = send_452(session);
+			goto exit_error1;
+		}
 	}
-	else
+
+	if (pipe(transfer->pipe_fds) < 0)
 	{
-		sep = ' ';
+		error = send_451(session);
+		goto exit_error1;
 	}
+	//A bigger pipe moves more per splice; the system might not allow it, which
+	//is fine
+	fcntl(transfer->pipe_fds[1], F_SETPIPE_SZ, DATA_CHUNK_SIZE);
 
-	string_t response;
-	string_initialize(&response);
-	string_assign_from_char_array_with_size(&response, code, 3);
-	char_vector_push_back(&response, sep);
-	string_concatenate_char_array(&response, message);
-	string_concatenate_char_array(&response, "\r\n");
-
-	if (multiline)
+	if (unique_name == NULL)
 	{
-		string_concatenate_char_array_with_size(&response, code, 3);
-		string_concatenate_char_array_with_size(&response, " \r\n", 3);
+		error = send_125(session);
+	}
+	else
+	{
+		char *code = session->data_sock >= 0 ? TRANSFER_STARTING : FILE_STATUS_OKAY;
+		struct iovec parts[] =
+		{
+			{ code, 3 },
+			{ " FILE: ", sizeof " FILE: " - 1 },
+			{ unique_name, strlen(unique_name) },
+			{ "\r\n", 2 },
+		};
+		error = send_reply_parts(session, parts, 4);
 	}
-
-	error = send_string(sock, &response, log);
 	if (error)
 	{
-		goto exit0;
+		//let the first error supercede any that might occur here,
+		//so don't save to error
+		send_451(session);
+		goto exit_error2;
 	}
 
+	transfer->fd = fd;
+	transfer->synced = 0;
+	begin_transfer(session, store_transfer_step);
+	goto exit0;
+
+exit_error2:
+	close_upload_pipe(transfer);
+exit_error1:
+	if (transfer->allocated > 0)
+	{
+		ftruncate(fd, 0);
+	}
+	close(fd);
+	close_data_connection(session);
 exit0:
-	string_uninitialize(&response);
 	return error;
 }
 
-status_t send_data_string(int sock, string_t *s, log_t *log)
+void close_upload_pipe(transfer_t *transfer)
 {
-	status_t error = SUCCESS;
-	char sending_data[] = "Sending data.\n";
-	write_log(log, sending_data, sizeof sending_data);
-
-	if (write(sock, string_c_str(s), string_length(s)) < 0)
+	if (transfer->pipe_fds[0] >= 0)
 	{
-		char error_sending[] = "Error sending data.\n";
-		write_log(log, error_sending, sizeof error_sending);
-		error = SOCKET_WRITE_ERROR;
-		goto exit0;
+		close(transfer->pipe_fds[0]);
+		close(transfer->pipe_fds[1]);
+		transfer->pipe_fds[0] = -1;
+		transfer->pipe_fds[1] = -1;
 	}
-
-	char data_sent[] = "Data sent.\n";
-	write_log(log, data_sent, sizeof data_sent);
-
-exit0:
-	return error;
 }
 
-status_t handle_unrecognized_command(user_session_t *session, string_t *args, size_t len)
+status_t handle_unrecognized_command(user_session_t *session, command_line_t *command)
 {
 	return send_502(session);
 }
 
 status_t send_125(user_session_t *session)
 {
-	return send_response(session->command_sock, TRANSFER_STARTING, "Connection open. Transfer starting.", session->server->log, 0);
+	//Until the client connects after a PASV, the connection isn't open yet
+	return send_reply(session, session->data_sock >= 0 ? REPLY_125 : REPLY_150);
 }
 
 status_t send_200(user_session_t *session)
 {
-	return send_response(session->command_sock, COMMAND_OKAY, "Command okay.", session->server->log, 0);
+	return send_reply(session, REPLY_200);
 }
 
 status_t send_214(user_session_t *session)
 {
-	return send_response(session->command_sock, HELP_MESSAGE, HELP_STRING, session->server->log, 1);
+	return send_reply(session, REPLY_214);
 }
 
 status_t send_221(user_session_t *session)
 {
-	return send_response(session->command_sock, CLOSING_CONNECTION, "Goodbye.", session->server->log, 0);
+	return send_reply(session, REPLY_221);
 }
 
 status_t send_226(user_session_t *session)
 {
-	return send_response(session->command_sock, CLOSING_DATA_CONNECTION, "Data transfer succesful. Closing connection.", session->server->log, 0);
+	return send_reply(session, REPLY_226);
 }
 
 status_t send_250(user_session_t *session)
 {
-	return send_response(session->command_sock, FILE_ACTION_COMPLETED, "Action successful.", session->server->log, 0);
+	return send_reply(session, REPLY_250);
 }
 
 status_t send_257(user_session_t *session)
 {
-	string_t wd;
-	string_initialize(&wd);
-	string_assign_from_char_array(&wd, "\"");
-	string_concatenate_char_array(&wd, session->directory);
-	string_concatenate_char_array(&wd, "\"");
-
-	status_t error = send_response(session->command_sock, PATH_CREATED, string_c_str(&wd), session->server->log, 0);
+	struct iovec parts[] =
+	{
+		{ PATH_CREATED " \"", sizeof PATH_CREATED " \"" - 1 },
+		{ visible_directory(session), strlen(visible_directory(session)) },
+		{ "\"\r\n", 3 },
+	};
 
-	string_uninitialize(&wd);
-	return error;
+	return send_reply_parts(session, parts, 3);
 }
 
 status_t send_330(user_session_t *session)
 {
-	return send_response(session->command_sock, USER_LOGGED_IN, "Logged in.", session->server->log, 0);
+	return send_reply(session, REPLY_230);
 }
 
 status_t send_331(user_session_t *session)
 {
-	return send_response(session->command_sock, NEED_PASSWORD, "Username good. Please send password.", session->server->log, 0);
+	return send_reply(session, REPLY_331);
 }
 
 status_t send_425(user_session_t *session)
 {
-	return send_response(session->command_sock, CANT_OPEN_DATA_CONNECTION, "Data connection not open.", session->server->log, 0);
+	return send_reply(session, REPLY_425);
 }
 
 status_t send_451(user_session_t *session)
 {
-	return send_response(session->command_sock, ACTION_ABORTED_LOCAL_ERROR, "Local error. Aborting.", session->server->log, 0);
+	return send_reply(session, REPLY_451);
+}
+
+status_t send_452(user_session_t *session)
+{
+	return send_reply(session, REPLY_452);
 }
 
 status_t send_500(user_session_t *session)
 {
-	return send_response(session->command_sock, COMMAND_UNRECOGNIZED, "Unrecognized command.", session->server->log, 0);
+	return send_reply(session, REPLY_500);
 }
 
 status_t send_501(user_session_t *session)
 {
-	return send_response(session->command_sock, SYNTAX_ERROR, "Error in command parameters.", session->server->log, 0);
+	return send_reply(session, REPLY_501);
 }
 
 status_t send_502(user_session_t *session)
 {
-	return send_response(session->command_sock, NOT_IMPLEMENTED, "Given command not implemented.", session->server->log, 0);
+	return send_reply(session, REPLY_502);
 }
 
 status_t send_503(user_session_t *session)
 {
-	return send_response(session->command_sock, BAD_SEQUENCE, "Please check the command sequence.", session->server->log, 0);
+	return send_reply(session, REPLY_503);
+}
+
+status_t send_504(user_session_t *session)
+{
+	return send_reply(session, REPLY_504);
 }
 
 status_t send_530(user_session_t *session)
 {
-	return send_response(session->command_sock, NOT_LOGGED_IN, "Not logged in.", session->server->log, 0);
+	return send_reply(session, REPLY_530);
 }
 
 status_t send_550(user_session_t *session)
 {
-	return send_response(session->command_sock, ACTION_NOT_TAKEN_FILE_UNAVAILABLE2, "Requested action not completed.", session->server->log, 0);
+	return send_reply(session, REPLY_550);
 }
 
-uint8_t is_directory(char *dir)
+status_t send_554(user_session_t *session)
 {
-	struct stat dirstat;
-	if (stat(dir, &dirstat) != 0)
-	{
-		return 0;
-	}
-
-	return S_ISDIR(dirstat.st_mode);
+	return send_reply(session, REPLY_554);
 }
@@ -0,0 +1,473 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "listing_cache.h"
+#include "status_t.h"
+#include "string_t.h"
+
+//Anything that changes which names are in the directory, or the directory
+//itself going away
+#define LISTING_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define INOTIFY_BUFFER_SIZE 4096
+
+/**
+  * FNV-1a hash of a path, for picking its bucket
+  * @param path - the path to hash
+  */
+size_t hash_path(char *path);
+
+/**
+  * Finds the entry for path. The lock must be held.
+  * @param cache - the cache to search
+  * @param path - the path to look for
+  * @return the entry, or NULL if path isn't cached
+  */
+listing_entry_t *find_listing_entry(listing_cache_t *cache, char *path);
+
+/**
+  * Determines whether any entry is still using the given watch. The lock must
+  * be held.
+  * @param cache - the cache to search
+  * @param watch - the watch descriptor
+  */
+uint8_t watch_in_use(listing_cache_t *cache, int watch);
+
+/**
+  * Removes a watch that no entry is using any more, and bumps the generation
+  * so that no listing rendered under the watch gets cached. The lock must be
+  * held.
+  * @param cache - the cache owning the watch
+  * @param watch - the watch descriptor
+  */
+void drop_watch_if_unused(listing_cache_t *cache, int watch);
+
+/**
+  * Adds an entry to the cache as the most recently used, throwing away the
+  * least recently used entries to make room for it. The lock must be held.
+  * @param cache - the cache to add to
+  * @param entry - the entry to add; must fit within the capacity
+  */
+void insert_listing_entry(listing_cache_t *cache, listing_entry_t *entry);
+
+/**
+  * Takes an entry out of the cache and frees it, dropping its watch if nothing
+  * else uses it. The lock must be held.
+  * @param cache - the cache holding the entry
+  * @param entry - the entry to remove
+  */
+void remove_listing_entry(listing_cache_t *cache, listing_entry_t *entry);
+
+/**
+  * Frees an entry that isn't in the cache
+  * @param entry - the entry to free
+  */
+void free_listing_entry(listing_entry_t *entry);
+
+/**
+  * The number of bytes an entry counts for against the capacity
+  * @param path_len - the length of the entry's path
+  * @param length - the length of the entry's listing
+  */
+size_t listing_entry_size(size_t path_len, size_t length);
+
+/**
+  * The thread function for the watcher; throws away the listings of
+  * directories as inotify reports changes to them
+  * @param void_args - the cache. Actually of type listing_cache_t *
+  */
+void *listing_watcher(void *void_args);
+
+status_t listing_cache_initialize(listing_cache_t *cache, size_t capacity)
+{
+	status_t error = SUCCESS;
+
+	memset(cache->path_buckets, 0, sizeof cache->path_buckets);
+	memset(cache->watch_buckets, 0, sizeof cache->watch_buckets);
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	cache->size = 0;
+	cache->capacity = capacity;
+	cache->generation = 0;
+
+	cache->inotify_fd = inotify_init();
+	if (cache->inotify_fd < 0)
+	{
+		error = FILE_OPEN_ERROR;
+		goto exit0;
+	}
+
+	if (pthread_mutex_init(&cache->lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit_error1;
+	}
+
+	if (pthread_create(&cache->watcher, NULL, listing_watcher, cache) != 0)
+	{
+		error = PTHREAD_CREATE_ERROR;
+		goto exit_error2;
+	}
+
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit_error2:
+	pthread_mutex_destroy(&cache->lock);
+exit_error1:
+	close(cache->inotify_fd);
+exit0:
+	return error;
+}
+
+uint8_t listing_cache_lookup(listing_cache_t *cache, char *path, string_t *listing)
+{
+	if (cache == NULL)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	listing_entry_t *entry = find_listing_entry(cache, path);
+	if (entry != NULL)
+	{
+		//Move it to the front of the least recently used order
+		if (entry != cache->lru_head)
+		{
+			entry->lru_prev->lru_next = entry->lru_next;
+			if (entry->lru_next != NULL)
+			{
+				entry->lru_next->lru_prev = entry->lru_prev;
+			}
+			else
+			{
+				cache->lru_tail = entry->lru_prev;
+			}
+
+			entry->lru_prev = NULL;
+			entry->lru_next = cache->lru_head;
+			cache->lru_head->lru_prev = entry;
+			cache->lru_head = entry;
+		}
+
+		string_concatenate_char_array_with_size(listing, entry->listing, entry->length);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return entry != NULL;
+}
+
+void listing_fill_begin(listing_cache_t *cache, listing_fill_t *fill, char *path)
+{
+	string_initialize(&fill->listing);
+	fill->path = NULL;
+	fill->watch = -1;
+	fill->abandoned = 1;
+
+	if (cache == NULL)
+	{
+		return;
+	}
+
+	fill->path = strdup(path);
+	if (fill->path == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	fill->generation = cache->generation;
+	pthread_mutex_unlock(&cache->lock);
+
+	//Watch before reading, so that any change made after the read is caught.
+	//Without a watch there would be no telling when the listing goes stale, so
+	//it just doesn't get cached.
+	fill->watch = inotify_add_watch(cache->inotify_fd, path, LISTING_WATCH_EVENTS);
+	fill->abandoned = fill->watch < 0;
+}
+
+void listing_fill_append(listing_cache_t *cache, listing_fill_t *fill, char *data, size_t length)
+{
+	if (fill->abandoned)
+	{
+		return;
+	}
+
+	//Past its share of the cache the listing would only push everything else
+	//out, so stop holding on to it
+	size_t size = listing_entry_size(strlen(fill->path), string_length(&fill->listing) + length);
+	if (size > cache->capacity / LISTING_CACHE_MAX_SHARE)
+	{
+		fill->abandoned = 1;
+		char_vector_clear(&fill->listing);
+		return;
+	}
+
+	string_concatenate_char_array_with_size(&fill->listing, data, length);
+}
+
+void listing_fill_finish(listing_cache_t *cache, listing_fill_t *fill, uint8_t complete)
+{
+	if (cache == NULL || fill->path == NULL)
+	{
+		goto exit0;
+	}
+
+	listing_entry_t *entry = NULL;
+	size_t length = string_length(&fill->listing);
+	if (complete && !fill->abandoned)
+	{
+		entry = calloc(1, sizeof *entry);
+		if (entry != NULL)
+		{
+			entry->path = fill->path;
+			fill->path = NULL;
+			entry->listing = malloc(length);
+			entry->length = length;
+			entry->watch = fill->watch;
+			if (entry->listing == NULL)
+			{
+				free_listing_entry(entry);
+				entry = NULL;
+			}
+			else
+			{
+				memcpy(entry->listing, string_c_str(&fill->listing), length);
+			}
+		}
+	}
+
+	if (fill->watch < 0)
+	{
+		goto exit0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	//Something changed or was evicted while the directory was being read, or
+	//another session got there first
+	if (entry != NULL && (cache->generation != fill->generation || find_listing_entry(cache, entry->path) != NULL))
+	{
+		free_listing_entry(entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL)
+	{
+		insert_listing_entry(cache, entry);
+	}
+	else
+	{
+		drop_watch_if_unused(cache, fill->watch);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+exit0:
+	free(fill->path);
+	fill->path = NULL;
+	string_uninitialize(&fill->listing);
+}
+
+void listing_cache_free(listing_cache_t *cache)
+{
+	pthread_cancel(cache->watcher);
+	pthread_join(cache->watcher, NULL);
+
+	while (cache->lru_head != NULL)
+	{
+		remove_listing_entry(cache, cache->lru_head);
+	}
+
+	close(cache->inotify_fd);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+size_t hash_path(char *path)
+{
+	size_t hash = 2166136261u;
+	for (; *path != '\0'; path++)
+	{
+		hash ^= (unsigned char) *path;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+listing_entry_t *find_listing_entry(listing_cache_t *cache, char *path)
+{
+	listing_entry_t *entry = cache->path_buckets[hash_path(path) % LISTING_CACHE_BUCKETS];
+	while (entry != NULL && strcmp(entry->path, path) != 0)
+	{
+		entry = entry->path_next;
+	}
+
+	return entry;
+}
+
+uint8_t watch_in_use(listing_cache_t *cache, int watch)
+{
+	listing_entry_t *entry = cache->watch_buckets[watch % LISTING_CACHE_BUCKETS];
+	while (entry != NULL && entry->watch != watch)
+	{
+		entry = entry->watch_next;
+	}
+
+	return entry != NULL;
+}
+
+void drop_watch_if_unused(listing_cache_t *cache, int watch)
+{
+	if (watch_in_use(cache, watch))
+	{
+		return;
+	}
+
+	//Another session might have been handed the same watch descriptor for a
+	//listing it is rendering right now; the new generation keeps that listing
+	//out of the cache, since the watch is about to disappear
+	inotify_rm_watch(cache->inotify_fd, watch);
+	cache->generation++;
+}
+
+void insert_listing_entry(listing_cache_t *cache, listing_entry_t *entry)
+{
+	size_t size = listing_entry_size(strlen(entry->path), entry->length);
+	while (cache->size + size > cache->capacity && cache->lru_tail != NULL)
+	{
+		remove_listing_entry(cache, cache->lru_tail);
+	}
+
+	listing_entry_t **path_bucket = cache->path_buckets + hash_path(entry->path) % LISTING_CACHE_BUCKETS;
+	entry->path_next = *path_bucket;
+	*path_bucket = entry;
+
+	listing_entry_t **watch_bucket = cache->watch_buckets + entry->watch % LISTING_CACHE_BUCKETS;
+	entry->watch_next = *watch_bucket;
+	*watch_bucket = entry;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL)
+	{
+		cache->lru_head->lru_prev = entry;
+	}
+	else
+	{
+		cache->lru_tail = entry;
+	}
+	cache->lru_head = entry;
+
+	cache->size += size;
+}
+
+void remove_listing_entry(listing_cache_t *cache, listing_entry_t *entry)
+{
+	listing_entry_t **link = cache->path_buckets + hash_path(entry->path) % LISTING_CACHE_BUCKETS;
+	while (*link != entry)
+	{
+		link = &(*link)->path_next;
+	}
+	*link = entry->path_next;
+
+	link = cache->watch_buckets + entry->watch % LISTING_CACHE_BUCKETS;
+	while (*link != entry)
+	{
+		link = &(*link)->watch_next;
+	}
+	*link = entry->watch_next;
+
+	if (entry->lru_prev != NULL)
+	{
+		entry->lru_prev->lru_next = entry->lru_next;
+	}
+	else
+	{
+		cache->lru_head = entry->lru_next;
+	}
+
+	if (entry->lru_next != NULL)
+	{
+		entry->lru_next->lru_prev = entry->lru_prev;
+	}
+	else
+	{
+		cache->lru_tail = entry->lru_prev;
+	}
+
+	cache->size -= listing_entry_size(strlen(entry->path), entry->length);
+	drop_watch_if_unused(cache, entry->watch);
+	free_listing_entry(entry);
+}
+
+void free_listing_entry(listing_entry_t *entry)
+{
+	free(entry->path);
+	free(entry->listing);
+	free(entry);
+}
+
+size_t listing_entry_size(size_t path_len, size_t length)
+{
+	return sizeof (listing_entry_t) + path_len + 1 + length;
+}
+
+void *listing_watcher(void *void_args)
+{
+	listing_cache_t *cache = (listing_cache_t *) void_args;
+	char buffer[INOTIFY_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (1)
+	{
+		ssize_t amount = read(cache->inotify_fd, buffer, sizeof buffer);
+		if (amount <= 0)
+		{
+			if (amount < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&cache->lock);
+		char *position = buffer;
+		while (position < buffer + amount)
+		{
+			struct inotify_event *event = (struct inotify_event *) position;
+			position += sizeof *event + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				//Events were lost, so there's no knowing what's stale any more
+				while (cache->lru_head != NULL)
+				{
+					remove_listing_entry(cache, cache->lru_head);
+				}
+				continue;
+			}
+
+			//Every entry for the directory goes; the last one to go takes the
+			//watch with it
+			listing_entry_t *entry = cache->watch_buckets[event->wd % LISTING_CACHE_BUCKETS];
+			while (entry != NULL)
+			{
+				listing_entry_t *next = entry->watch_next;
+				if (entry->watch == event->wd)
+				{
+					remove_listing_entry(cache, entry);
+				}
+				entry = next;
+			}
+
+			if (!(event->mask & IN_IGNORED))
+			{
+				drop_watch_if_unused(cache, event->wd);
+			}
+			cache->generation++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	return NULL;
+}
@@ -1,51 +1,224 @@
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
 #define LOG_FILE_NAME "/logfile."
 #define LOG_FILE_NAME_LEN (sizeof LOG_FILE_NAME - 1)
 
+//Longest a timestamp from ctime_r can be, with its '\0'
+#define TIME_STRING_LEN 26
+#define LOG_FLUSH_BATCH 64
+//Most pieces an entry is gathered from: a text entry is time, prefix, the
+//message's pieces and newline
+#define LOG_ENTRY_PARTS (LOG_MAX_MESSAGE_PARTS + 3)
+
 #include "log.h"
 #include "status_t.h"
 
-status_t open_log_file_clobber_opt(log_t *log, char *filename, uint8_t threaded, uint8_t clobber);
+status_t open_log_file_clobber_opt(log_t *log, char *filename, uint8_t threaded, log_format_t format, uint8_t clobber);
+
+//The session the calling thread is logging for; see set_log_session
+static __thread uint32_t log_session_id = 0;
+
+/**
+  * Gets the current CLOCK_MONOTONIC time, which is what binary entries are
+  * stamped with
+  * @param timestamp - out param; the time in nanoseconds
+  */
+status_t get_log_timestamp(uint64_t *timestamp);
+
+/**
+  * Writes the LOG_EVENT_OPEN entry that starts every binary log
+  * @param log - the newly opened log, before any other thread can use it
+  */
+status_t write_binary_log_open(log_t *log);
+
+/**
+  * Builds a text entry - timestamp, the prefix for event, message and newline -
+  * and hands it to emit_log_entry
+  * @param log - the log to write to
+  * @param event - decides the prefix
+  * @param message - the pieces of the message itself
+  * @param count - the number of pieces
+  */
+status_t write_text_log_event(log_t *log, log_event_t event, struct iovec *message, int count);
+
+/**
+  * Builds a binary entry - header and raw message - and hands it to
+  * emit_log_entry
+  * @param log - the log to write to
+  * @param event - recorded in the header
+  * @param message - the pieces of the payload
+  * @param count - the number of pieces
+  */
+status_t write_binary_log_event(log_t *log, log_event_t event, struct iovec *message, int count);
+
+/**
+  * Copies the pieces of a message into out, cutting them short so that they
+  * add up to no more than limit bytes
+  * @param message - the pieces of the message
+  * @param count - the number of pieces
+  * @param limit - the most bytes the pieces may add up to
+  * @param out - out param; the (possibly shortened) pieces
+  * @return the number of bytes in out
+  */
+size_t limit_log_parts(struct iovec *message, int count, size_t limit, struct iovec *out);
+
+/**
+  * Writes an entry, gathered from the given pieces, straight to the file for an
+  * unthreaded log or into the ring buffer for a threaded one
+  * @param log - the log to write to
+  * @param parts - the pieces of the entry, in order; for threaded logs they
+  *		must add up to no more than LOG_RECORD_SIZE
+  * @param count - the number of pieces
+  */
+status_t emit_log_entry(log_t *log, struct iovec *parts, int count);
+
+/**
+  * Formats the current time the way it appears at the start of each log line,
+  * i.e., the ctime format with the newline swapped for a space
+  * @param time_string - out param; must hold at least TIME_STRING_LEN bytes
+  * @param time_len - out param; the length of the formatted time
+  */
+status_t format_log_time(char *time_string, size_t *time_len);
+
+/**
+  * Puts one entry into the ring buffer of a threaded log, waiting for room or
+  * dropping the entry, according to the log's policy, if the ring is full
+  * @param log - the log to write to
+  * @param parts - the pieces of the entry, which must fit in LOG_RECORD_SIZE
+  * @param count - the number of pieces
+  */
+status_t push_log_record(log_t *log, struct iovec *parts, int count);
+
+/**
+  * The thread function for the flusher; drains the ring buffer into the log
+  * file in batches until the log is closed
+  * @param void_args - the log. Actually of type log_t *
+  */
+void *log_flusher(void *void_args);
+
+/**
+  * Puts the flusher to sleep until a producer or close_log_file wakes it,
+  * unless there turns out to be something for it to do after all
+  * @param log - the log whose flusher is calling
+  */
+void wait_for_log_records(log_t *log);
+
+/**
+  * Wakes the flusher if it is asleep, or about to go to sleep
+  * @param ring - the ring buffer of the flusher to wake
+  */
+void wake_log_flusher(log_ring_t *ring);
+
+/**
+  * Writes the count of entries dropped since the last time straight to the
+  * file, from the flusher
+  * @param log - the log to write to
+  * @param dropped - how many entries were dropped
+  */
+void write_dropped_count(log_t *log, size_t dropped);
+
+/**
+  * Writes out every iovec, picking up where a short write left off
+  * @param fd - the file to write to
+  * @param iov - the buffers to write; modified as they are written
+  * @param count - the number of buffers
+  */
+status_t writev_all(int fd, struct iovec *iov, int count);
 
 status_t open_log_file(log_t *log, char *filename, uint8_t threaded)
 {
-	return open_log_file_clobber_opt(log, filename, threaded, 0);
+	return open_log_file_clobber_opt(log, filename, threaded, LOG_FORMAT_TEXT, 0);
 }
 
-status_t open_log_file_clobber_opt(log_t *log, char *filename, uint8_t threaded, uint8_t clobber)
+status_t open_log_file_clobber_opt(log_t *log, char *filename, uint8_t threaded, log_format_t format, uint8_t clobber)
 {
+	status_t error = SUCCESS;
+
+	log->format = format;
+	log->threaded = threaded;
+	log->ring = NULL;
+	log->full_policy = LOG_FULL_BLOCK;
+	log->writers = 0;
+	log->closing = 0;
+
 	//Create the file if it doesn't exist, and always append new logs to the end
 	//of the file
 	if ((log->log_file = open(filename, O_WRONLY | O_CREAT | (clobber ? O_TRUNC : O_APPEND), 0600)) < 0)
 	{
-		return FILE_OPEN_ERROR;
+		error = FILE_OPEN_ERROR;
+		goto exit0;
 	}
 
-	if (threaded)
+	if (format == LOG_FORMAT_BINARY)
 	{
-		log->lock = malloc(sizeof *log->lock);
-		if (pthread_mutex_init(log->lock, NULL) != 0)
+		error = write_binary_log_open(log);
+		if (error)
 		{
-			close(log->log_file);
-			printf("Could not initialize pthread mutex.\n");
-			return LOCK_INIT_ERROR;
+			goto exit_error1;
 		}
 	}
-	else
+
+	if (!threaded)
 	{
-		log->lock = NULL;
+		goto exit0;
 	}
 
-	return SUCCESS;
+	log_ring_t *ring = calloc(1, sizeof *ring);
+	if (ring == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit_error1;
+	}
+
+	ring->records = malloc(LOG_RING_SLOTS * sizeof *ring->records);
+	if (ring->records == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit_error2;
+	}
 
+	//Slot i is free for whoever claims position i
+	size_t i;
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+	{
+		ring->records[i].sequence = i;
+	}
+
+	log->ring = ring;
+	if (pthread_create(&ring->flusher, NULL, log_flusher, log) != 0)
+	{
+		log->threaded = 0;
+		log->ring = NULL;
+		printf("Could not start the log flusher thread.\n");
+		error = PTHREAD_CREATE_ERROR;
+		goto exit_error3;
+	}
+
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit_error3:
+	free(ring->records);
+exit_error2:
+	free(ring);
+exit_error1:
+	close(log->log_file);
+exit0:
+	return error;
 }
 
-status_t open_log_file_in_dir(log_t *log, char *dirname, int files_to_keep, int next_log_num, uint8_t threaded)
+status_t open_log_file_in_dir(log_t *log, char *dirname, int files_to_keep, int next_log_num, uint8_t threaded, log_format_t format)
 {
 	status_t error = SUCCESS;
 
@@ -63,7 +236,7 @@ status_t open_log_file_in_dir(log_t *log, char *dirname, int files_to_keep, int
 	char_vector_copy(&opening_name, &generic_filename);
 	string_concatenate_char_array(&opening_name, next_string);
 
-	error = open_log_file_clobber_opt(log, string_c_str(&opening_name), threaded, 1);
+	error = open_log_file_clobber_opt(log, string_c_str(&opening_name), threaded, format, 1);
 	if (error)
 	{
 		goto exit0;
@@ -84,13 +257,207 @@ exit0:
 
 status_t close_log_file(log_t *log)
 {
+	log_ring_t *ring = log->ring;
+	if (log->threaded)
+	{
+		//Turn new lines away, then wait for anyone already in the middle of
+		//logging to finish, so the ring can be drained and freed safely
+		__atomic_store_n(&log->closing, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&log->writers, __ATOMIC_SEQ_CST) > 0)
+		{
+			sched_yield();
+		}
+
+		wake_log_flusher(ring);
+		pthread_join(ring->flusher, NULL);
+		log->ring = NULL;
+		free(ring->records);
+		free(ring);
+	}
+
 	close(log->log_file);
-	if (log->lock)
-		pthread_mutex_destroy(log->lock);
 	return SUCCESS;
 }
 
 status_t write_log(log_t *log, char *message, size_t length)
+{
+	return write_log_event(log, LOG_EVENT_MESSAGE, message, length);
+}
+
+status_t write_log_event(log_t *log, log_event_t event, char *message, size_t length)
+{
+	struct iovec part = { message, length };
+	return write_log_event_parts(log, event, &part, 1);
+}
+
+status_t write_log_event_parts(log_t *log, log_event_t event, struct iovec *message, int count)
+{
+	if (count > LOG_MAX_MESSAGE_PARTS)
+	{
+		count = LOG_MAX_MESSAGE_PARTS;
+	}
+
+	if (log->format == LOG_FORMAT_BINARY)
+	{
+		return write_binary_log_event(log, event, message, count);
+	}
+
+	return write_text_log_event(log, event, message, count);
+}
+
+void set_log_session(uint32_t session_id)
+{
+	log_session_id = session_id;
+}
+
+status_t write_text_log_event(log_t *log, log_event_t event, struct iovec *message, int count)
+{
+	status_t error = SUCCESS;
+
+	char time_string[TIME_STRING_LEN];
+	size_t time_len;
+	error = format_log_time(time_string, &time_len);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	char *prefix = "";
+	if (event == LOG_EVENT_RECEIVED)
+	{
+		prefix = "Received: ";
+	}
+	else if (event == LOG_EVENT_SENT)
+	{
+		prefix = "Sent: ";
+	}
+	size_t prefix_len = strlen(prefix);
+
+	struct iovec parts[LOG_ENTRY_PARTS];
+	parts[0].iov_base = time_string;
+	parts[0].iov_len = time_len;
+	parts[1].iov_base = prefix;
+	parts[1].iov_len = prefix_len;
+
+	//Anything that doesn't fit in a ring buffer slot gets cut short, but the
+	//line always ends with its newline
+	size_t limit = log->threaded ? LOG_RECORD_SIZE - time_len - prefix_len - 1 : SIZE_MAX;
+	limit_log_parts(message, count, limit, parts + 2);
+
+	parts[count + 2].iov_base = "\n";
+	parts[count + 2].iov_len = 1;
+	error = emit_log_entry(log, parts, count + 3);
+
+exit0:
+	return error;
+}
+
+status_t write_binary_log_event(log_t *log, log_event_t event, struct iovec *message, int count)
+{
+	status_t error = SUCCESS;
+
+	log_binary_header_t header;
+	error = get_log_timestamp(&header.timestamp);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	size_t limit = log->threaded ? LOG_RECORD_SIZE - sizeof header : UINT16_MAX;
+	struct iovec parts[LOG_MAX_MESSAGE_PARTS + 1];
+	parts[0].iov_base = &header;
+	parts[0].iov_len = sizeof header;
+
+	header.session_id = log_session_id;
+	header.event = event;
+	header.length = limit_log_parts(message, count, limit, parts + 1);
+
+	error = emit_log_entry(log, parts, count + 1);
+
+exit0:
+	return error;
+}
+
+size_t limit_log_parts(struct iovec *message, int count, size_t limit, struct iovec *out)
+{
+	size_t total = 0;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		out[i] = message[i];
+		if (out[i].iov_len > limit - total)
+		{
+			out[i].iov_len = limit - total;
+		}
+		total += out[i].iov_len;
+	}
+
+	return total;
+}
+
+status_t emit_log_entry(log_t *log, struct iovec *parts, int count)
+{
+	if (log->threaded)
+	{
+		return push_log_record(log, parts, count);
+	}
+
+	//Only one thread writes to an unthreaded log, so write the whole entry out
+	//in one go
+	return writev_all(log->log_file, parts, count);
+}
+
+status_t get_log_timestamp(uint64_t *timestamp)
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+	{
+		return TIME_GET_ERROR;
+	}
+
+	*timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	return SUCCESS;
+}
+
+status_t write_binary_log_open(log_t *log)
+{
+	status_t error = SUCCESS;
+
+	log_binary_open_t open_entry;
+	memset(&open_entry, 0, sizeof open_entry);
+	memcpy(open_entry.magic, LOG_BINARY_MAGIC, sizeof LOG_BINARY_MAGIC);
+
+	log_binary_header_t header;
+	header.session_id = 0;
+	header.event = LOG_EVENT_OPEN;
+	header.length = sizeof open_entry;
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+	{
+		error = TIME_GET_ERROR;
+		goto exit0;
+	}
+	open_entry.realtime = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+	error = get_log_timestamp(&header.timestamp);
+	if (error)
+	{
+		goto exit0;
+	}
+
+	struct iovec parts[2] =
+	{
+		{ &header, sizeof header },
+		{ &open_entry, sizeof open_entry },
+	};
+	error = writev_all(log->log_file, parts, 2);
+
+exit0:
+	return error;
+}
+
+status_t format_log_time(char *time_string, size_t *time_len)
 {
 	status_t error = SUCCESS;
 
@@ -101,55 +468,252 @@ status_t write_log(log_t *log, char *message, size_t length)
 		goto exit0;
 	}
 
-	char *time_val_string = ctime(&time_val);
-	if (time_val_string == NULL)
+	//ctime_r rather than ctime, since many threads log at once
+	if (ctime_r(&time_val, time_string) == NULL)
 	{
 		error = TIME_STRING_ERROR;
 		goto exit0;
 	}
-	size_t time_len = strlen(time_val_string);
-	time_val_string[time_len - 1] = ' ';
+	*time_len = strlen(time_string);
+	time_string[*time_len - 1] = ' ';
+
+exit0:
+	return error;
+}
 
-	if (log->lock)
-		pthread_mutex_lock(log->lock);
+status_t push_log_record(log_t *log, struct iovec *parts, int count)
+{
+	status_t error = SUCCESS;
 
-	if (write(log->log_file, time_val_string, time_len) < 0)
+	//Once closing is set, the ring might be freed as soon as writers drops to
+	//zero, so it can't be looked at until after the check
+	__atomic_add_fetch(&log->writers, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log->closing, __ATOMIC_SEQ_CST))
 	{
-		error = FILE_WRITE_ERROR;
-		goto exit1;
+		goto exit0;
 	}
+	log_ring_t *ring = log->ring;
 
-	if (write(log->log_file, message, length) < 0)
+	//Claim a slot: a slot whose sequence equals the position is free for that
+	//position, and one whose sequence is behind it hasn't been flushed yet
+	log_record_t *record;
+	size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+	while (1)
 	{
-		error = FILE_WRITE_ERROR;
-		goto exit1;
+		record = ring->records + pos % LOG_RING_SLOTS;
+		size_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			//The ring is full
+			if (log->full_policy == LOG_FULL_DROP)
+			{
+				__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+				goto exit0;
+			}
+
+			sched_yield();
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+		}
 	}
 
-	if (write(log->log_file, "\n", 1) < 0)
+	record->length = 0;
+	int i;
+	for (i = 0; i < count; i++)
 	{
-		error = FILE_WRITE_ERROR;
-		goto exit1;
+		memcpy(record->data + record->length, parts[i].iov_base, parts[i].iov_len);
+		record->length += parts[i].iov_len;
+	}
+
+	//Hand the slot over to the flusher, and make sure it isn't left asleep
+	//with it
+	__atomic_store_n(&record->sequence, pos + 1, __ATOMIC_SEQ_CST);
+	wake_log_flusher(ring);
+
+exit0:
+	__atomic_sub_fetch(&log->writers, 1, __ATOMIC_SEQ_CST);
+	return error;
+}
+
+void *log_flusher(void *void_args)
+{
+	log_t *log = (log_t *) void_args;
+	log_ring_t *ring = log->ring;
+	struct iovec iov[LOG_FLUSH_BATCH];
+
+	while (1)
+	{
+		//Gather up every line that is ready, in order
+		size_t pos = ring->dequeue_pos;
+		int count = 0;
+		while (count < LOG_FLUSH_BATCH)
+		{
+			log_record_t *record = ring->records + (pos + count) % LOG_RING_SLOTS;
+			if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != pos + count + 1)
+			{
+				break;
+			}
+
+			iov[count].iov_base = record->data;
+			iov[count].iov_len = record->length;
+			count++;
+		}
+
+		if (count > 0)
+		{
+			writev_all(log->log_file, iov, count);
+
+			//Give the slots back to the producers, one lap further on
+			int i;
+			for (i = 0; i < count; i++)
+			{
+				log_record_t *record = ring->records + (pos + i) % LOG_RING_SLOTS;
+				__atomic_store_n(&record->sequence, pos + i + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+			}
+			ring->dequeue_pos = pos + count;
+		}
+
+		size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0)
+		{
+			write_dropped_count(log, dropped);
+		}
+
+		if (count == 0)
+		{
+			//close_log_file only joins once no one is writing any more, so
+			//nothing can show up after the ring is seen to be empty here
+			if (__atomic_load_n(&log->closing, __ATOMIC_SEQ_CST) &&
+				__atomic_load_n(&log->writers, __ATOMIC_SEQ_CST) == 0 &&
+				__atomic_load_n(&ring->enqueue_pos, __ATOMIC_SEQ_CST) == ring->dequeue_pos)
+			{
+				break;
+			}
+
+			wait_for_log_records(log);
+		}
+	}
+
+	return NULL;
+}
+
+void wait_for_log_records(log_t *log)
+{
+	log_ring_t *ring = log->ring;
+	uint32_t wakeups = __atomic_load_n(&ring->wakeups, __ATOMIC_SEQ_CST);
+
+	//Say so before looking at the ring one last time: a producer publishes its
+	//record before checking sleeping, so either the record is seen here or
+	//the producer sees the flag and bumps wakeups, making the futex wait
+	//return straight away
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+	log_record_t *record = ring->records + ring->dequeue_pos % LOG_RING_SLOTS;
+	if (__atomic_load_n(&record->sequence, __ATOMIC_SEQ_CST) != ring->dequeue_pos + 1 &&
+		!__atomic_load_n(&log->closing, __ATOMIC_SEQ_CST) &&
+		__atomic_load_n(&ring->dropped, __ATOMIC_SEQ_CST) == 0)
+	{
+		syscall(SYS_futex, &ring->wakeups, FUTEX_WAIT_PRIVATE, wakeups, NULL, NULL, 0);
+	}
+	__atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+void wake_log_flusher(log_ring_t *ring)
+{
+	//Only costs a load while the flusher is busy
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+	{
+		__atomic_add_fetch(&ring->wakeups, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &ring->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+void write_dropped_count(log_t *log, size_t dropped)
+{
+	if (log->format == LOG_FORMAT_TEXT)
+	{
+		char message[64];
+		int message_len = sprintf(message, "%zu log messages dropped.\n", dropped);
+		write(log->log_file, message, message_len);
+		return;
+	}
+
+	uint64_t count = dropped;
+	log_binary_header_t header;
+	if (get_log_timestamp(&header.timestamp) != SUCCESS)
+	{
+		return;
+	}
+	header.session_id = 0;
+	header.event = LOG_EVENT_DROPPED;
+	header.length = sizeof count;
+
+	struct iovec parts[2] =
+	{
+		{ &header, sizeof header },
+		{ &count, sizeof count },
+	};
+	writev_all(log->log_file, parts, 2);
+}
+
+status_t writev_all(int fd, struct iovec *iov, int count)
+{
+	status_t error = SUCCESS;
+
+	while (count > 0)
+	{
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			error = FILE_WRITE_ERROR;
+			goto exit0;
+		}
+
+		//Skip past whatever made it out
+		while (count > 0 && (size_t) written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
 
-exit1:
-	if (log->lock)
-		pthread_mutex_unlock(log->lock);
 exit0:
 	return error;
 }
 
 status_t write_received_message_to_log(log_t *log, string_t *message)
 {
-	char received[] = "Received: ";
-	return prepend_and_write_to_log(log, message, received,
-		sizeof received - 1);
+	return write_log_event(log, LOG_EVENT_RECEIVED, string_c_str(message),
+		string_length(message));
 }
 
 status_t write_sent_message_to_log(log_t *log, string_t *message)
 {
-	char received[] = "Sent: ";
-	return prepend_and_write_to_log(log, message, received,
-		sizeof received - 1);
+	return write_log_event(log, LOG_EVENT_SENT, string_c_str(message),
+		string_length(message));
 }
 
 status_t prepend_and_write_to_log(log_t *log, string_t *message, char
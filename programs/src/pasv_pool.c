@@ -0,0 +1,185 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pasv_pool.h"
+#include "status_t.h"
+
+//Only one client is ever meant to connect to a leased socket, but leave a
+//little room for one that retries
+#define PASV_BACKLOG 4
+
+/**
+  * Sets up a nonblocking socket listening on the given port
+  * @param sock - out param; the listening socket
+  * @param port - the port to listen on
+  */
+status_t open_pasv_listener(int *sock, uint16_t port);
+
+status_t pasv_pool_initialize(pasv_pool_t *pool, uint16_t first_port, uint16_t last_port)
+{
+	status_t error = SUCCESS;
+
+	size_t capacity = (size_t) last_port - first_port + 1;
+	pool->count = 0;
+	pool->free_count = 0;
+	pool->sockets = malloc(capacity * sizeof *pool->sockets);
+	pool->ports = malloc(capacity * sizeof *pool->ports);
+	pool->free_leases = malloc(capacity * sizeof *pool->free_leases);
+	if (pool->sockets == NULL || pool->ports == NULL || pool->free_leases == NULL)
+	{
+		error = MEMORY_ERROR;
+		goto exit1;
+	}
+
+	if (pthread_mutex_init(&pool->lock, NULL) != 0)
+	{
+		error = LOCK_INIT_ERROR;
+		goto exit1;
+	}
+
+	uint32_t port;
+	for (port = first_port; port <= last_port; port++)
+	{
+		int sock;
+		if (open_pasv_listener(&sock, port) != SUCCESS)
+		{
+			//Probably something else has the port; just do without it
+			continue;
+		}
+
+		pool->sockets[pool->count] = sock;
+		pool->ports[pool->count] = port;
+		pool->free_leases[pool->free_count++] = pool->count;
+		pool->count++;
+	}
+
+	if (pool->count == 0)
+	{
+		error = BIND_ERROR;
+		goto exit2;
+	}
+
+	//equivalent to return SUCCESS (and don't free anything)
+	goto exit0;
+
+exit2:
+	pthread_mutex_destroy(&pool->lock);
+exit1:
+	free(pool->sockets);
+	free(pool->ports);
+	free(pool->free_leases);
+exit0:
+	return error;
+}
+
+status_t pasv_pool_lease(pasv_pool_t *pool, size_t *lease, int *sock, uint16_t *port)
+{
+	status_t error = SUCCESS;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->free_count == 0)
+	{
+		error = PASV_POOL_EMPTY_ERROR;
+		goto exit0;
+	}
+	*lease = pool->free_leases[--pool->free_count];
+
+exit0:
+	pthread_mutex_unlock(&pool->lock);
+	if (error)
+	{
+		return error;
+	}
+
+	*sock = pool->sockets[*lease];
+	*port = pool->ports[*lease];
+
+	//A client from an earlier lease might have connected too late to be
+	//accepted; it mustn't be handed to this lease's session
+	int stale;
+	while ((stale = accept(*sock, NULL, NULL)) >= 0)
+	{
+		close(stale);
+	}
+
+	return SUCCESS;
+}
+
+void pasv_pool_release(pasv_pool_t *pool, size_t lease)
+{
+	//A client that connected too late, or to a PASV it then replaced, mustn't
+	//end up as the next lease's data connection
+	int sock;
+	while ((sock = accept(pool->sockets[lease], NULL, NULL)) >= 0)
+	{
+		close(sock);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->free_leases[pool->free_count++] = lease;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pasv_pool_free(pasv_pool_t *pool)
+{
+	size_t i;
+	for (i = 0; i < pool->count; i++)
+	{
+		close(pool->sockets[i]);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->sockets);
+	free(pool->ports);
+	free(pool->free_leases);
+}
+
+status_t open_pasv_listener(int *sock, uint16_t port)
+{
+	status_t error = SUCCESS;
+
+	*sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (*sock < 0)
+	{
+		error = SOCKET_OPEN_ERROR;
+		goto exit0;
+	}
+
+	//So that a restarted server can have its ports straight back
+	int on = 1;
+	setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+	struct sockaddr_in sad;
+	memset(&sad, 0, sizeof sad);
+	sad.sin_family = AF_INET;
+	sad.sin_addr.s_addr = INADDR_ANY;
+	sad.sin_port = htons(port);
+	if (bind(*sock, (struct sockaddr *) &sad, sizeof sad) < 0)
+	{
+		error = BIND_ERROR;
+		goto exit_error1;
+	}
+
+	if (listen(*sock, PASV_BACKLOG) < 0)
+	{
+		error = LISTEN_ERROR;
+		goto exit_error1;
+	}
+
+	//Accepts are only ever tried once the socket is known to be ready, or to
+	//throw away stale connections, so they must never wait
+	fcntl(*sock, F_SETFL, fcntl(*sock, F_GETFL) | O_NONBLOCK);
+
+	//equivalent to return SUCCESS (and don't close the socket)
+	goto exit0;
+
+exit_error1:
+	close(*sock);
+exit0:
+	return error;
+}
@@ -1,4 +1,13 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "accounts.h"
 #include "ftp.h"
@@ -12,7 +21,29 @@
 #define USER_FILE_PARAM "usernamefile"
 #define PORT_MODE_PARAM "port_mode"
 #define PASV_MODE_PARAM "pasv_mode"
+#define SERVER_MODE_PARAM "server_mode"
+#define EVENT_THREADS_PARAM "event_threads"
+#define MAX_USERS_PARAM "max_users"
+#define ACCEPT_QUEUE_PARAM "accept_queue_size"
+#define LOG_FULL_POLICY_PARAM "log_full_policy"
+#define LOG_FORMAT_PARAM "log_format"
+#define PASV_PORT_RANGE_PARAM "pasv_port_range"
+#define PASV_ACCEPT_TIMEOUT_PARAM "pasv_accept_timeout"
+#define LISTING_CACHE_SIZE_PARAM "listing_cache_size"
+#define OPEN_FILE_CACHE_SIZE_PARAM "open_file_cache_size"
+#define FILE_CONTENTS_CACHE_SIZE_PARAM "file_contents_cache_size"
+#define FILE_CONTENTS_MAX_SIZE_PARAM "file_contents_max_size"
+#define ROOT_DIR_PARAM "root_directory"
 #define DEFAULT_LOG_DIR "logs"
+#define DEFAULT_EVENT_THREADS 4
+#define MAX_EVENT_THREADS 256
+#define DEFAULT_MAX_USERS 30
+#define DEFAULT_ACCEPT_QUEUE_SIZE 8
+#define DEFAULT_PASV_ACCEPT_TIMEOUT 30
+#define DEFAULT_LISTING_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_OPEN_FILE_CACHE_SIZE 64
+#define DEFAULT_FILE_CONTENTS_CACHE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_FILE_CONTENTS_MAX_SIZE (64 * 1024)
 
 /**
   * Handles the "port_mode" and "pasv_mode" parameters of the configuration
@@ -33,6 +64,14 @@ status_t initialize_server(server_t *server)
 	server->log = NULL;
 	server->ip4 = NULL;
 	server->ip6 = NULL;
+	server->pasv_pool = NULL;
+	server->listing_cache = NULL;
+	server->file_cache = NULL;
+	server->root_fd = -1;
+	server->root = NULL;
+	server->config_path = NULL;
+	server->accounts_path = NULL;
+	server->log_path = NULL;
 
 	FILE *file = fopen(CONFIG_FILE, "r+");
 	if (file == NULL)
@@ -45,11 +84,27 @@ status_t initialize_server(server_t *server)
 	//Initialize all the integer variables to -1 so that it can be determined whether
 	//or not they've been seen when parsing is over
 	char *log_dir = NULL; //so it's safe to free
+	char *root_dir = NULL;
 	int files_to_keep = -1;
 	long int next_log_num_pos = -1;
 	int next_log_num = -1;
+	log_full_policy_t full_policy = LOG_FULL_BLOCK;
+	log_format_t log_format = LOG_FORMAT_TEXT;
+	unsigned int first_pasv_port = 0;
+	unsigned int last_pasv_port = 0;
+	size_t listing_cache_size = DEFAULT_LISTING_CACHE_SIZE;
+	size_t open_file_cache_size = DEFAULT_OPEN_FILE_CACHE_SIZE;
+	size_t file_contents_cache_size = DEFAULT_FILE_CONTENTS_CACHE_SIZE;
+	size_t file_contents_max_size = DEFAULT_FILE_CONTENTS_MAX_SIZE;
 	server->port_enabled = -1;
 	server->pasv_enabled = -1;
+	server->event_mode = 0;
+	server->event_threads = DEFAULT_EVENT_THREADS;
+	server->max_users = DEFAULT_MAX_USERS;
+	server->accept_queue_size = DEFAULT_ACCEPT_QUEUE_SIZE;
+	server->active_sessions = 0;
+	server->next_session_id = 0;
+	server->pasv_accept_timeout = DEFAULT_PASV_ACCEPT_TIMEOUT;
 
 	char *line = NULL; //make sure that getline allocates space for the line
 	size_t length = 0;
@@ -80,6 +135,16 @@ status_t initialize_server(server_t *server)
 				//config file has been parse
 				log_dir = strdup(value);
 			}
+			else if (bool_strcmp(param, ROOT_DIR_PARAM))
+			{
+				free(root_dir);
+				root_dir = strdup(value);
+				if (root_dir == NULL)
+				{
+					error = MEMORY_ERROR;
+					goto exit1;
+				}
+			}
 			else if (bool_strcmp(param, NUM_LOGS_PARAM))
 			{
 				files_to_keep = atoi(value);
@@ -103,14 +168,14 @@ status_t initialize_server(server_t *server)
 			}
 			else if (bool_strcmp(param, USER_FILE_PARAM))
 			{
-				accounts_table_t *accounts = malloc(sizeof *server->accounts);
+				accounts_t *accounts = malloc(sizeof *server->accounts);
 				if (accounts == NULL)
 				{
 					error = MEMORY_ERROR;
 					goto exit1;
 				}
 
-				error = get_accounts(value, accounts);
+				error = initialize_accounts(accounts, value);
 				if (error)
 				{
 					free(accounts);
@@ -136,6 +201,160 @@ status_t initialize_server(server_t *server)
 					goto exit1;
 				}
 			}
+			else if (bool_strcmp(param, SERVER_MODE_PARAM))
+			{
+				if (bool_strcmp(value, "THREADED"))
+				{
+					server->event_mode = 0;
+				}
+				else if (bool_strcmp(value, "EVENT"))
+				{
+					server->event_mode = 1;
+				}
+				else
+				{
+					printf("The '%s' parameter must be either 'THREADED' or 'EVENT'.\n", SERVER_MODE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, EVENT_THREADS_PARAM))
+			{
+				server->event_threads = atoi(value);
+				if (server->event_threads <= 0 || server->event_threads > MAX_EVENT_THREADS)
+				{
+					printf("The '%s' parameter must be greater than 0 and less than or equal to %d.\n", EVENT_THREADS_PARAM, MAX_EVENT_THREADS);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, MAX_USERS_PARAM))
+			{
+				server->max_users = atoi(value);
+				if (server->max_users <= 0)
+				{
+					printf("The '%s' parameter must be greater than 0.\n", MAX_USERS_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, ACCEPT_QUEUE_PARAM))
+			{
+				server->accept_queue_size = atoi(value);
+				if (server->accept_queue_size <= 0)
+				{
+					printf("The '%s' parameter must be greater than 0.\n", ACCEPT_QUEUE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, LOG_FULL_POLICY_PARAM))
+			{
+				if (bool_strcmp(value, "BLOCK"))
+				{
+					full_policy = LOG_FULL_BLOCK;
+				}
+				else if (bool_strcmp(value, "DROP"))
+				{
+					full_policy = LOG_FULL_DROP;
+				}
+				else
+				{
+					printf("The '%s' parameter must be either 'BLOCK' or 'DROP'.\n", LOG_FULL_POLICY_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, LOG_FORMAT_PARAM))
+			{
+				if (bool_strcmp(value, "TEXT"))
+				{
+					log_format = LOG_FORMAT_TEXT;
+				}
+				else if (bool_strcmp(value, "BINARY"))
+				{
+					log_format = LOG_FORMAT_BINARY;
+				}
+				else
+				{
+					printf("The '%s' parameter must be either 'TEXT' or 'BINARY'.\n", LOG_FORMAT_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, PASV_PORT_RANGE_PARAM))
+			{
+				char extra;
+				if (sscanf(value, "%u-%u%c", &first_pasv_port, &last_pasv_port, &extra) != 2 ||
+					first_pasv_port == 0 || last_pasv_port > UINT16_MAX || first_pasv_port > last_pasv_port)
+				{
+					printf("The '%s' parameter must be of the form 'first-last', with 0 < first <= last <= %u.\n", PASV_PORT_RANGE_PARAM, UINT16_MAX);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, PASV_ACCEPT_TIMEOUT_PARAM))
+			{
+				server->pasv_accept_timeout = atoi(value);
+				if (server->pasv_accept_timeout <= 0)
+				{
+					printf("The '%s' parameter must be greater than 0.\n", PASV_ACCEPT_TIMEOUT_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+			}
+			else if (bool_strcmp(param, LISTING_CACHE_SIZE_PARAM))
+			{
+				char *end;
+				errno = 0;
+				unsigned long long tmp = strtoull(value, &end, 10);
+				if (errno != 0 || end == value || *end != '\0' || *value == '-' || tmp > SIZE_MAX)
+				{
+					printf("The '%s' parameter must be a number of bytes, or 0 to turn the cache off.\n", LISTING_CACHE_SIZE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+				listing_cache_size = tmp;
+			}
+			else if (bool_strcmp(param, OPEN_FILE_CACHE_SIZE_PARAM))
+			{
+				char *end;
+				errno = 0;
+				unsigned long tmp = strtoul(value, &end, 10);
+				if (errno != 0 || end == value || *end != '\0' || *value == '-' || tmp > INT_MAX)
+				{
+					printf("The '%s' parameter must be a number of files, or 0 to turn the cache off.\n", OPEN_FILE_CACHE_SIZE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+				open_file_cache_size = tmp;
+			}
+			else if (bool_strcmp(param, FILE_CONTENTS_CACHE_SIZE_PARAM))
+			{
+				char *end;
+				errno = 0;
+				unsigned long long tmp = strtoull(value, &end, 10);
+				if (errno != 0 || end == value || *end != '\0' || *value == '-' || tmp > SIZE_MAX)
+				{
+					printf("The '%s' parameter must be a number of bytes, or 0 to keep no file contents in memory.\n", FILE_CONTENTS_CACHE_SIZE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+				file_contents_cache_size = tmp;
+			}
+			else if (bool_strcmp(param, FILE_CONTENTS_MAX_SIZE_PARAM))
+			{
+				char *end;
+				errno = 0;
+				unsigned long long tmp = strtoull(value, &end, 10);
+				if (errno != 0 || end == value || *end != '\0' || *value == '-' || tmp > SIZE_MAX)
+				{
+					printf("The '%s' parameter must be a number of bytes.\n", FILE_CONTENTS_MAX_SIZE_PARAM);
+					error = CONFIG_FILE_ERROR;
+					goto exit1;
+				}
+				file_contents_max_size = tmp;
+			}
 			else
 			{
 				//Don't just ignore unrecognized parameters - treat them like an error in case
@@ -172,7 +391,7 @@ status_t initialize_server(server_t *server)
 
 	//Open up a log file in the given directory, keeping files_to_keep files, using next_log_num
 	//as the suffix of the file, and making sure it's thread safe
-	error = open_log_file_in_dir(log, log_dir, files_to_keep, next_log_num, 1);
+	error = open_log_file_in_dir(log, log_dir, files_to_keep, next_log_num, 1, log_format);
 	if (error)
 	{
 		printf("Error opening log file.\n");
@@ -182,6 +401,7 @@ status_t initialize_server(server_t *server)
 	}
 
 	//The log has been set up successfully, so it's safe to assign it to the server object
+	log->full_policy = full_policy;
 	server->log = log;
 
 	//Move to the position of the next log number in the config file
@@ -230,7 +450,107 @@ status_t initialize_server(server_t *server)
 	}
 	//-----------------------------------------------------------------------------------
 
+	//Bind the passive mode ports up front, if a range was given------------------------
+	if (server->pasv_enabled && first_pasv_port > 0)
+	{
+		pasv_pool_t *pasv_pool = malloc(sizeof *pasv_pool);
+		if (pasv_pool == NULL)
+		{
+			error = MEMORY_ERROR;
+			goto exit1;
+		}
+
+		error = pasv_pool_initialize(pasv_pool, first_pasv_port, last_pasv_port);
+		if (error)
+		{
+			free(pasv_pool);
+			printf("Could not listen on any port in the '%s' range.\n", PASV_PORT_RANGE_PARAM);
+			goto exit1;
+		}
+		server->pasv_pool = pasv_pool;
+	}
+	//-----------------------------------------------------------------------------------
+
+	//Start the directory listing cache, unless it's been turned off-------------------
+	if (listing_cache_size > 0)
+	{
+		listing_cache_t *listing_cache = malloc(sizeof *listing_cache);
+		if (listing_cache == NULL)
+		{
+			error = MEMORY_ERROR;
+			goto exit1;
+		}
+
+		error = listing_cache_initialize(listing_cache, listing_cache_size);
+		if (error)
+		{
+			free(listing_cache);
+			printf("Could not start the directory listing cache.\n");
+			goto exit1;
+		}
+		server->listing_cache = listing_cache;
+	}
+	//-----------------------------------------------------------------------------------
+
+	//Start the open file cache, unless it's been turned off---------------------------
+	if (open_file_cache_size > 0)
+	{
+		file_cache_t *file_cache = malloc(sizeof *file_cache);
+		if (file_cache == NULL)
+		{
+			error = MEMORY_ERROR;
+			goto exit1;
+		}
+
+		error = file_cache_initialize(file_cache, open_file_cache_size, file_contents_cache_size,
+			file_contents_max_size);
+		if (error)
+		{
+			free(file_cache);
+			printf("Could not start the open file cache.\n");
+			goto exit1;
+		}
+		server->file_cache = file_cache;
+	}
+	//-----------------------------------------------------------------------------------
+
+	//Sessions are kept inside the root directory, or else the directory the server is
+	//started in
+	server->root = realpath(root_dir != NULL ? root_dir : ".", NULL);
+	if (server->root == NULL)
+	{
+		printf("Could not find the '%s' directory.\n", ROOT_DIR_PARAM);
+		error = REALPATH_ERROR;
+		goto exit1;
+	}
+	//When the root is "/", every path under it is already what clients see
+	server->root_length = strcmp(server->root, "/") == 0 ? 0 : strlen(server->root);
+
+	server->root_fd = open(server->root, O_PATH | O_DIRECTORY);
+	if (server->root_fd < 0)
+	{
+		error = DIR_OPEN_ERROR;
+		goto exit1;
+	}
+
+	//The server's own files can be under the root, so remember where they are to keep
+	//uploads off them
+	server->config_path = realpath(CONFIG_FILE, NULL);
+	server->log_path = realpath(log_dir, NULL);
+	if (server->accounts != NULL)
+	{
+		server->accounts_path = realpath(server->accounts->filename, NULL);
+	}
+	if (server->config_path == NULL || server->log_path == NULL ||
+		(server->accounts != NULL && server->accounts_path == NULL))
+	{
+		error = REALPATH_ERROR;
+		goto exit1;
+	}
+	//-----------------------------------------------------------------------------------
+
 exit1:
+	free(root_dir);
 	free(log_dir);
 	free(line);
 	fclose(file);
@@ -242,7 +562,7 @@ void free_server(server_t *server)
 {
 	if (server->accounts != NULL)
 	{
-		free_accounts(server->accounts);
+		uninitialize_accounts(server->accounts);
 		free(server->accounts);
 	}
 
@@ -252,6 +572,33 @@ void free_server(server_t *server)
 		free(server->log);
 	}
 
+	if (server->pasv_pool != NULL)
+	{
+		pasv_pool_free(server->pasv_pool);
+		free(server->pasv_pool);
+	}
+
+	if (server->listing_cache != NULL)
+	{
+		listing_cache_free(server->listing_cache);
+		free(server->listing_cache);
+	}
+
+	if (server->file_cache != NULL)
+	{
+		file_cache_free(server->file_cache);
+		free(server->file_cache);
+	}
+
+	if (server->root_fd >= 0)
+	{
+		close(server->root_fd);
+	}
+
+	free(server->root);
+	free(server->config_path);
+	free(server->accounts_path);
+	free(server->log_path);
 	free(server->ip4);
 	free(server->ip6);
 }
@@ -58,6 +58,23 @@ char *get_error_message(status_t error)
 			return "Could not determine path.";
 		case CONFIG_FILE_ERROR:
 			return "";
+		case SOCKET_WOULD_BLOCK:
+			//not really an error - the caller should wait on the socket
+			return "Socket not ready.";
+		case EPOLL_ERROR:
+			return "Could not wait on sockets.";
+		case QUEUE_FULL_ERROR:
+			return "Too many users. Turning connection away.";
+		case SIGNAL_ERROR:
+			return "Could not set up signal handling.";
+		case LOG_FORMAT_ERROR:
+			return "Not a binary log file, or the log file is damaged.";
+		case PASV_POOL_EMPTY_ERROR:
+			return "No passive mode ports are free.";
+		case COMPRESSION_ERROR:
+			return "Could not compress or decompress data.";
+		case ACCOUNTS_FORMAT_ERROR:
+			return "Not a compiled accounts file, or the accounts file is damaged.";
 		default:
 			return "Unknown error";
 	}